@@ -17,26 +17,200 @@ extern "C" {
 #endif
 
 struct framebuffer_t;
+struct texture_t;
+struct command_list_t;
 
 typedef enum attachment_t
 {
     attachment_color0,
-    attachment_depth
+    attachment_depth,
+    attachment_visibility
 } attachment_t;
 
 typedef enum pixelformat_t
 {
     pixelformat_r8g8b8a8_unorm,
     pixelformat_b8g8r8a8_unorm,
-    pixelformat_r32_unorm
+    pixelformat_r32_unorm,
+    pixelformat_r32_uint
 } pixelformat_t;
 
+typedef enum framebuffer_flag_t
+{
+    // only allocate a depth buffer. The raster kernels skip all color work, and attachment_color0 can't be read back.
+    // useful for occlusion culling, shadow maps and depth prepasses.
+    framebuffer_flag_depth_only = 1 << 0,
+
+    // instead of a color, the raster kernels store the visibility id of the closest triangle of each pixel (see framebuffer_draw_indexed_with_ids).
+    // the color buffer is then filled by framebuffer_shade, which runs once per visible pixel regardless of overdraw.
+    framebuffer_flag_visibility_buffer = 1 << 1,
+
+    // reversed-Z: depth is cleared to 0 rather than 0xFFFFFFFF, and draws default to depth_func_greater.
+    // meant for projections that map the near plane to 1 and the far plane to 0.
+    framebuffer_flag_reversed_z = 1 << 2,
+
+    // Pipelining: framebuffer_submit hands the frame drawn so far to the worker threads and returns right away,
+    // so the next frame can be drawn while it's resolved. The frame being drawn, the frame in flight and the last completed frame
+    // each have their own storage, which triples the memory. Readbacks return the last completed frame (see framebuffer_wait).
+    framebuffer_flag_pipelined = 1 << 3,
+
+    // The framebuffer is split into 64x64 pixel tiles by default. Smaller tiles make more jobs to spread over the worker threads,
+    // larger tiles bin each triangle to fewer tiles. Which one is faster depends on the scene and the number of cores.
+    framebuffer_flag_tile_width_32 = 1 << 4,
+    framebuffer_flag_tile_width_128 = 1 << 5,
+
+    // Large pages: the pixels and tile command buffers are put on large pages when the buffers are big enough, so fewer TLB entries cover them.
+    // Large pages are locked in memory, and using them enables the "Lock pages in memory" privilege for the whole process
+    // (which the user must have been granted), so it's up to the application. Without the privilege, the framebuffer uses regular pages.
+    framebuffer_flag_large_pages = 1 << 6
+} framebuffer_flag_t;
+
+// When the raster kernels let a pixel through, comparing its depth (left) to the depth buffer (right).
+// Each draw uses the depth function and depth write state that were set when it was issued.
+typedef enum depth_func_t
+{
+    // the default
+    depth_func_less,
+    depth_func_less_equal,
+    // the default of reversed-Z framebuffers
+    depth_func_greater,
+    depth_func_greater_equal,
+    // never writes depth, since it's already there.
+    // for shading only the visible pixels, after a depth-only pass of the same triangles.
+    depth_func_equal,
+    depth_func_always
+} depth_func_t;
+
+// What the raster kernels write for each pixel that passes the depth test, besides depth.
+// Each draw uses the pixel stage that was set when it was issued.
+typedef enum pixel_stage_t
+{
+    // nothing, only depth is written
+    pixel_stage_depth_only,
+    // the barycentric coordinates of the pixel, as a color (the default)
+    pixel_stage_barycentric_color,
+    // the color set with framebuffer_set_flat_color
+    pixel_stage_flat_color,
+    // the visibility id of the triangle (the default of visibility buffer framebuffers)
+    pixel_stage_visibility_id,
+    // the interpolation of the colors set with framebuffer_set_vertex_colors (not perspective-correct)
+    pixel_stage_vertex_color,
+    // the perspective-correct interpolation of the attributes set with framebuffer_set_vertex_attributes, as r, g, b and a.
+    // attributes are clamped to [0,1], and missing ones are 0 (or 1 for alpha).
+    pixel_stage_attribute_color,
+    // the texture set with framebuffer_set_texture, at the perspective-correct texture coordinates given by attributes 0 and 1.
+    // bilinear filtering of the mip level selected from the screen space derivatives of the texture coordinates, with wrapping.
+    pixel_stage_textured
+} pixel_stage_t;
+
+// Maximum number of floats per vertex for framebuffer_set_vertex_attributes
+#define RASTERIZER_MAX_VERTEX_ATTRIBUTES 4
+
+// Visibility ids pack an instance id in the high bits and a primitive (triangle) id in the low bits.
+#define VISIBILITY_PRIMITIVE_ID_BITS 22
+#define VISIBILITY_INSTANCE_ID_BITS (32 - VISIBILITY_PRIMITIVE_ID_BITS)
+#define VISIBILITY_ID(instance_id, primitive_id) (((uint32_t)(instance_id) << VISIBILITY_PRIMITIVE_ID_BITS) | (uint32_t)(primitive_id))
+#define VISIBILITY_ID_INSTANCE(visibility_id) ((uint32_t)(visibility_id) >> VISIBILITY_PRIMITIVE_ID_BITS)
+#define VISIBILITY_ID_PRIMITIVE(visibility_id) ((uint32_t)(visibility_id) & ((1u << VISIBILITY_PRIMITIVE_ID_BITS) - 1))
+
+// Visibility id of pixels not covered by any triangle (so the last primitive of the last instance can't be used)
+#define VISIBILITY_ID_NONE 0xFFFFFFFF
+
+// How a framebuffer stores its attachments, so they can be read in place rather than through framebuffer_pack_row_major.
+// The framebuffer is padded up to a whole number of square tiles, which are stored row major. The pixels of a tile are contiguous,
+// in Z-order (morton order): the index of pixel (x, y) in its tile interleaves the bits of x (even bits) with the bits of y (odd bits).
+// So pixel (x, y) of the framebuffer is pixel number
+//     (y / tile_width_in_pixels * width_in_tiles + x / tile_width_in_pixels) * tile_width_in_pixels * tile_width_in_pixels
+//     + interleave_bits(x % tile_width_in_pixels, y % tile_width_in_pixels)
+// of each attachment. Pixels are 32 bits: 0xAARRGGBB colors, unorm depths and visibility ids.
+typedef struct framebuffer_layout_t
+{
+    int32_t tile_width_in_pixels;
+    int32_t width_in_tiles;
+    int32_t height_in_tiles;
+
+    // where each attachment starts in the framebuffer's memory in bytes, indexed by attachment_t. -1 for the ones the framebuffer doesn't have.
+    int64_t attachment_offsets[attachment_visibility + 1];
+
+    uint64_t size_in_bytes;
+    uint64_t alignment_in_bytes;
+} framebuffer_layout_t;
+
+// A rectangle of pixels, in window coordinates
+typedef struct framebuffer_rect_t
+{
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+} framebuffer_rect_t;
+
+// Shades the visible pixels of a visibility buffer, one batch per tile.
+// pixel_xs and pixel_ys are window coordinates, and one 0xAARRGGBB color must be written per pixel.
+// Tiles are shaded in parallel by the thread pool, so the shader must be thread safe: it's called on several threads at once with the same userdata.
+typedef void(*framebuffer_shader_t)(void* userdata, int32_t num_pixels, const int32_t* pixel_xs, const int32_t* pixel_ys, const uint32_t* visibility_ids, uint32_t* colors);
+
 RASTERIZER_API framebuffer_t* new_framebuffer(int32_t width, int32_t height);
+RASTERIZER_API framebuffer_t* new_framebuffer_with_flags(int32_t width, int32_t height, uint32_t flags); // flags is a combination of framebuffer_flag_t
 RASTERIZER_API void delete_framebuffer(framebuffer_t* fb);
 
+// Layout of the attachments of framebuffers created with these arguments, to know how much memory to give new_framebuffer_with_memory.
+RASTERIZER_API void get_framebuffer_layout(int32_t width, int32_t height, uint32_t flags, framebuffer_layout_t* layout);
+// Creates a framebuffer that draws into attachments owned by the caller (eg. in memory shared with another process), laid out as get_framebuffer_layout says.
+// The memory needs layout.size_in_bytes bytes aligned to layout.alignment_in_bytes. It's cleared, and must stay alive until the framebuffer is deleted,
+// which doesn't free it. Pipelined framebuffers can't use the caller's memory, since they rotate between several sets of attachments.
+// A NULL memory makes the framebuffer allocate its own, like new_framebuffer_with_flags.
+RASTERIZER_API framebuffer_t* new_framebuffer_with_memory(int32_t width, int32_t height, uint32_t flags, void* memory);
+// Layout of the attachments of a framebuffer, and the memory they're in, to read the pixels in place.
+// For pipelined framebuffers, that's the last completed frame (see framebuffer_wait), whose memory changes with the frames.
+RASTERIZER_API void framebuffer_get_layout(framebuffer_t* fb, framebuffer_layout_t* layout, void** memory);
+
 RASTERIZER_API void framebuffer_clear(framebuffer_t* fb, uint32_t color);
+// Runs the commands queued in the tiles of the framebuffer. Tiles are resolved in parallel, on a pool of worker threads,
+// the ones with the most commands queued first so the threads finish at about the same time.
 RASTERIZER_API void framebuffer_resolve(framebuffer_t* fb);
+// Resolves several framebuffers at once, so the tiles of all of them are shared between the worker threads.
+// Better than resolving them one after the other when each one doesn't have enough work to keep every thread busy.
+RASTERIZER_API void framebuffer_resolve_many(framebuffer_t* const* fbs, int32_t num_fbs);
+// Resolves the tiles one after the other on the calling thread, to time the rasterization without the worker threads.
+RASTERIZER_API void framebuffer_resolve_on_calling_thread(framebuffer_t* fb);
+
+// Ends a frame, and returns its fence. Pipelined framebuffers resolve the frame in the background, and wait for the previous frame first.
+// The next draws go to a new frame, which starts with the pixels of an older frame, so it should start with a clear.
+// Textures and other resources used by the frame must stay alive until its fence is done. Other framebuffers resolve it right away.
+RASTERIZER_API uint64_t framebuffer_submit(framebuffer_t* fb);
+// Waits until the frame of the fence is resolved. Readbacks (framebuffer_pack_row_major, statistics and perfcounters)
+// then return it, until the next frame is done.
+RASTERIZER_API void framebuffer_wait(framebuffer_t* fb, uint64_t fence);
+RASTERIZER_API int32_t framebuffer_is_fence_done(framebuffer_t* fb, uint64_t fence);
 RASTERIZER_API void framebuffer_pack_row_major(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data);
+// Packs only the tiles of the attachment that changed since the last call for that attachment: the ones whose draws or clears were resolved, or that were shaded.
+// data holds the whole framebuffer in row major order, as framebuffer_pack_row_major(fb, attachment, 0, 0, width, height, format, data) writes it,
+// and the pixels of the other tiles are left as they were. So the first call packs everything.
+// The changed tiles go in damage_rects, merged along rows of tiles and clipped to the framebuffer, and the number of rectangles is returned.
+// damage_rects needs room for one rectangle per tile (see framebuffer_get_total_num_tiles).
+// Pipelined framebuffers start each frame with a clear, so every tile of their frames changes.
+RASTERIZER_API int32_t framebuffer_pack_dirty_tiles(framebuffer_t* fb, attachment_t attachment, pixelformat_t format, void* data, framebuffer_rect_t* damage_rects);
+
+RASTERIZER_API void framebuffer_set_depth_func(framebuffer_t* fb, depth_func_t func);
+// Whether pixels that pass the depth test write their depth (enabled by default). Disable it for decals and other overlays.
+RASTERIZER_API void framebuffer_set_depth_write(framebuffer_t* fb, int32_t enabled);
+// Restricts the next draws, clears and framebuffer_shade to the tiles that overlap any of the rectangles, so the other tiles keep their pixels.
+// Works on whole tiles (see framebuffer_get_tile_width): a tile is either left alone, or drawn to like without the scissor.
+// NULL rects disables the scissor, which is the default.
+RASTERIZER_API void framebuffer_set_tile_scissor(framebuffer_t* fb, int32_t num_rects, const framebuffer_rect_t* rects);
+
+// Color stages need a color buffer, and the visibility id stage needs a visibility buffer.
+RASTERIZER_API void framebuffer_set_pixel_stage(framebuffer_t* fb, pixel_stage_t stage);
+RASTERIZER_API pixel_stage_t framebuffer_get_pixel_stage(framebuffer_t* fb);
+RASTERIZER_API void framebuffer_set_flat_color(framebuffer_t* fb, uint32_t color); // 0xAARRGGBB
+// One 0xAARRGGBB color per vertex, indexed like the vertices of the next draws. The array must stay alive until then.
+RASTERIZER_API void framebuffer_set_vertex_colors(framebuffer_t* fb, const uint32_t* colors);
+// num_attributes floats per vertex (up to RASTERIZER_MAX_VERTEX_ATTRIBUTES), indexed like the vertices of the next draws.
+// They're interpolated with perspective correction. The array must stay alive until then.
+RASTERIZER_API void framebuffer_set_vertex_attributes(framebuffer_t* fb, const float* attributes, int32_t num_attributes);
+// The texture must stay alive until the next draws are resolved.
+RASTERIZER_API void framebuffer_set_texture(framebuffer_t* fb, const texture_t* tex);
 
 RASTERIZER_API void framebuffer_draw(
     framebuffer_t* fb,
@@ -49,7 +223,56 @@ RASTERIZER_API void framebuffer_draw_indexed(
     const uint32_t* indices,
     uint32_t num_indices);
 
+// Same as framebuffer_draw_indexed, but the triangle starting at indices[3 * i] gets the visibility id first_visibility_id + i.
+// framebuffer_draw and framebuffer_draw_indexed number their triangles from 0.
+RASTERIZER_API void framebuffer_draw_indexed_with_ids(
+    framebuffer_t* fb,
+    const int32_t* vertices,
+    const uint32_t* indices,
+    uint32_t num_indices,
+    uint32_t first_visibility_id);
+
+// Resolves a visibility buffer framebuffer, then calls the shader to fill its color buffer with the covered pixels, one job per tile (of the scissor).
+// Pixels not covered by any triangle keep the clear color.
+RASTERIZER_API void framebuffer_shade(framebuffer_t* fb, framebuffer_shader_t shader, void* userdata);
+
+// Command lists: the tile commands of draws and clears, recorded once and pushed to the tiles again every time the list is executed,
+// skipping the transform, clipping, setup and binning. For geometry that stays put relative to the camera, like overlays.
+// Between framebuffer_begin_command_list and framebuffer_end_command_list, the draws and clears of the framebuffer go to the list instead of its tiles,
+// with the state they're issued with. Beginning a list again replaces its commands.
+// A list can only be executed by framebuffers of the same size and flags (pipelining and large pages aside) as the one that recorded it,
+// and the textures of its draws must stay alive as long as it's executed. The scissor applies when the list is executed.
+RASTERIZER_API command_list_t* new_command_list();
+RASTERIZER_API void delete_command_list(command_list_t* cl);
+RASTERIZER_API void framebuffer_begin_command_list(framebuffer_t* fb, command_list_t* cl);
+RASTERIZER_API void framebuffer_end_command_list(framebuffer_t* fb);
+RASTERIZER_API void framebuffer_execute_command_list(framebuffer_t* fb, const command_list_t* cl);
+// Same, but the tiles that have to be resolved while the commands are pushed are resolved on the calling thread (see framebuffer_resolve_on_calling_thread).
+RASTERIZER_API void framebuffer_execute_command_list_on_calling_thread(framebuffer_t* fb, const command_list_t* cl);
+// Size and flags (a combination of framebuffer_flag_t) of the framebuffers that can execute the list
+RASTERIZER_API void command_list_get_framebuffer_info(const command_list_t* cl, int32_t* width, int32_t* height, uint32_t* flags);
+
+// Frame capture: between framebuffer_begin_capture and framebuffer_end_capture, the commands queued in the tiles of the framebuffer
+// (after the scissor) are also copied to the list, which then holds everything the tiles were asked to do. Beginning a capture again replaces its commands.
+// framebuffer_shade isn't part of it, since it calls back into the caller.
+// Captures can be saved to a file, to replay the frame in another process (eg. to benchmark the rasterization on its own).
+// Texture pointers can't be saved, so the textured draws of a loaded list all sample the texture given to load_command_list.
+// save_command_list returns 0 on failure, and load_command_list returns NULL.
+RASTERIZER_API void framebuffer_begin_capture(framebuffer_t* fb, command_list_t* cl);
+RASTERIZER_API void framebuffer_end_capture(framebuffer_t* fb);
+RASTERIZER_API int32_t save_command_list(const command_list_t* cl, const char* filename);
+RASTERIZER_API command_list_t* load_command_list(const char* filename, const texture_t* texture);
+
+// Textures are made of 0xAARRGGBB texels, given row major. The width and height must be powers of two.
+// The whole mip chain is generated.
+RASTERIZER_API texture_t* new_texture(int32_t width, int32_t height, const uint32_t* texels);
+RASTERIZER_API void delete_texture(texture_t* tex);
+
 RASTERIZER_API int32_t framebuffer_get_total_num_tiles(framebuffer_t* fb); // to know how big an array to pass to get_tile_perfcounters
+RASTERIZER_API int32_t framebuffer_get_width(framebuffer_t* fb); // in pixels
+RASTERIZER_API int32_t framebuffer_get_height(framebuffer_t* fb); // in pixels
+RASTERIZER_API int32_t framebuffer_get_tile_width(framebuffer_t* fb); // in pixels, tiles are square
+RASTERIZER_API int32_t framebuffer_get_large_pages(framebuffer_t* fb); // whether the pixels and tile command buffers are on large pages
 RASTERIZER_API uint64_t framebuffer_get_perfcounter_frequency(framebuffer_t* fb);
 RASTERIZER_API void framebuffer_reset_perfcounters(framebuffer_t* fb);
 RASTERIZER_API int32_t framebuffer_get_num_perfcounters(framebuffer_t* fb);
@@ -59,6 +282,20 @@ RASTERIZER_API int32_t framebuffer_get_num_tile_perfcounters(framebuffer_t* fb);
 RASTERIZER_API void framebuffer_get_tile_perfcounter_names(framebuffer_t* fb, const char** names);
 RASTERIZER_API void framebuffer_get_tile_perfcounters(framebuffer_t* fb, uint64_t* tile_pcs); // grabs perfcounters for ALL tiles: (total_num_tiles * num_tile_perfcounters) counters.
 
+// Counts of depth tested pixels since the framebuffer was created or the statistics were last reset
+RASTERIZER_API void framebuffer_reset_statistics(framebuffer_t* fb);
+RASTERIZER_API int32_t framebuffer_get_num_statistics(framebuffer_t* fb);
+RASTERIZER_API void framebuffer_get_statistics(framebuffer_t* fb, uint64_t* stats);
+RASTERIZER_API void framebuffer_get_statistic_names(framebuffer_t* fb, const char** names);
+
+// The worker threads that resolve tiles, for other work that splits into independent jobs (eg. rendering many small framebuffers).
+// Runs job(userdata, job_id, thread_id) for every job_id in [0, num_jobs) and returns once they're all done.
+// thread_id is in [0, rasterizer_get_num_threads()) and no two jobs of a call run with the same thread_id at once, so it can index per thread scratch data.
+// Framebuffers resolved from inside a job are resolved on the job's thread.
+typedef void(*rasterizer_job_t)(void* userdata, int32_t job_id, int32_t thread_id);
+RASTERIZER_API void rasterizer_run_jobs(int32_t num_jobs, rasterizer_job_t job, void* userdata);
+RASTERIZER_API int32_t rasterizer_get_num_threads();
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
\ No newline at end of file
@@ -10,10 +10,14 @@
 #include <rasterizer.h>
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
 
+#include <utility>
+#include <algorithm>
+
 #ifdef _MSC_VER
 #include <intrin.h>
 #endif
@@ -34,43 +38,59 @@
 // #define ENABLE_PERFCOUNTERS
 // ------------------
 
+#include "texture.h"
+#include "thread_pool.h"
+
 // Sized according to the Larrabee rasterizer's description
 // The tile size must be up to 128x128
 //    this is because any edge that isn't trivially accepted or rejected
 //    can be rasterized with 32 bits inside a 128x128 tile
-// moved it down to 64x64 since it allows more parallelism
-#define TILE_WIDTH_IN_PIXELS 64
+// Smaller tiles allow more parallelism, larger tiles bin each triangle to fewer command buffers,
+// so the tile size is chosen per framebuffer (see framebuffer_flag_tile_width_32 and framebuffer_flag_tile_width_128).
+#define MIN_TILE_WIDTH_IN_PIXELS 32
+#define DEFAULT_TILE_WIDTH_IN_PIXELS 64
+#define MAX_TILE_WIDTH_IN_PIXELS 128
 #define COARSE_BLOCK_WIDTH_IN_PIXELS 16
 #define FINE_BLOCK_WIDTH_IN_PIXELS 4
 
 // Convenience
-#define PIXELS_PER_TILE (TILE_WIDTH_IN_PIXELS * TILE_WIDTH_IN_PIXELS)
 #define PIXELS_PER_COARSE_BLOCK (COARSE_BLOCK_WIDTH_IN_PIXELS * COARSE_BLOCK_WIDTH_IN_PIXELS)
 #define PIXELS_PER_FINE_BLOCK (FINE_BLOCK_WIDTH_IN_PIXELS * FINE_BLOCK_WIDTH_IN_PIXELS)
 
-#define TILE_WIDTH_IN_COARSE_BLOCKS (TILE_WIDTH_IN_PIXELS / COARSE_BLOCK_WIDTH_IN_PIXELS)
 #define COARSE_BLOCK_WIDTH_IN_FINE_BLOCKS (COARSE_BLOCK_WIDTH_IN_PIXELS / FINE_BLOCK_WIDTH_IN_PIXELS)
-#define COARSE_BLOCKS_PER_TILE (PIXELS_PER_TILE / PIXELS_PER_COARSE_BLOCK)
- 
+#define MAX_COARSE_BLOCKS_PER_TILE (MAX_TILE_WIDTH_IN_PIXELS * MAX_TILE_WIDTH_IN_PIXELS / PIXELS_PER_COARSE_BLOCK)
+
+// masks of which coarse blocks of a tile to draw have one bit per block, in the order they're stored
+static_assert(MAX_COARSE_BLOCKS_PER_TILE <= 64, "Coarse block masks are 64 bits");
+
 // The swizzle masks, using alternating yxyxyx bit pattern for morton-code swizzling pixels in a tile.
 // This makes the pixels morton code swizzled within every rasterization level (fine/coarse/tile)
-// The tiles themselves are stored row major.
+// The tiles themselves are stored row major. The masks of whole tiles depend on the tile size (see tile_layout_t).
 // For examples of this concept, see:
 // https://software.intel.com/en-us/node/514045
 // https://msdn.microsoft.com/en-us/library/windows/desktop/dn770442%28v=vs.85%29.aspx
-#define TILE_X_SWIZZLE_MASK (0x55555555 & (PIXELS_PER_TILE - 1))
-#define TILE_Y_SWIZZLE_MASK (0xAAAAAAAA & (PIXELS_PER_TILE - 1))
+#define COARSE_BLOCK_X_SWIZZLE_MASK (0x55555555 & (PIXELS_PER_COARSE_BLOCK - 1))
+#define COARSE_BLOCK_Y_SWIZZLE_MASK (0xAAAAAAAA & (PIXELS_PER_COARSE_BLOCK - 1))
 
-#define COARSE_BLOCK_X_SWIZZLE_MASK (TILE_X_SWIZZLE_MASK & (PIXELS_PER_COARSE_BLOCK - 1))
-#define COARSE_BLOCK_Y_SWIZZLE_MASK (TILE_Y_SWIZZLE_MASK & (PIXELS_PER_COARSE_BLOCK - 1))
+#define FINE_BLOCK_X_SWIZZLE_MASK (0x55555555 & (PIXELS_PER_FINE_BLOCK - 1))
+#define FINE_BLOCK_Y_SWIZZLE_MASK (0xAAAAAAAA & (PIXELS_PER_FINE_BLOCK - 1))
 
-#define FINE_BLOCK_X_SWIZZLE_MASK (TILE_X_SWIZZLE_MASK & (PIXELS_PER_FINE_BLOCK - 1))
-#define FINE_BLOCK_Y_SWIZZLE_MASK (TILE_Y_SWIZZLE_MASK & (PIXELS_PER_FINE_BLOCK - 1))
+// Small triangles are set up relative to the tile they end in, with edge equations that only fit in 32 bits
+// when the triangles are up to 64 pixels wide. With 128x128 tiles, the triangles in between are drawn as large triangles.
+#define MAX_SMALLTRI_WIDTH_IN_PIXELS 64
 
 // If there are too many commands and this buffer gets filled up,
 // then the command buffer for that tile must be flushed.
 #define TILE_COMMAND_BUFFER_SIZE_IN_DWORDS 1024
 
+// Attribute plane equations are too big for tile commands, so commands refer to them by index.
+// If the framebuffer runs out, all the tiles are flushed so their planes can be reused.
+#define MAX_ATTRIBUTE_PLANES 8192
+
+// Tiles that would take longer to resolve than their share of the work are split into jobs for groups of coarse blocks,
+// unless they have fewer command dwords queued than this, in which case handing them to several threads costs more than it saves.
+#define MIN_SPLIT_TILE_COST_IN_DWORDS 256
+
 // parallel bit deposit low-order source bits according to mask bits
 #ifdef USE_HSWni
 __forceinline uint32_t pdep_u32(uint32_t source, uint32_t mask)
@@ -314,6 +334,21 @@ static int32_t s168_s1516(int32_t s1516)
     return s1516_div(s1516, s1516_int(256));
 }
 
+// The layout of the pixels of a tile of a given size. The tile kernels are templated on it, like they are on the pixel stage.
+template<int32_t TileWidth>
+struct tile_layout_t
+{
+    static_assert(TileWidth >= MIN_TILE_WIDTH_IN_PIXELS && TileWidth <= MAX_TILE_WIDTH_IN_PIXELS, "Unsupported tile size");
+
+    static const int32_t width_in_pixels = TileWidth;
+    static const int32_t num_pixels = TileWidth * TileWidth;
+    static const int32_t width_in_coarse_blocks = TileWidth / COARSE_BLOCK_WIDTH_IN_PIXELS;
+    static const int32_t num_coarse_blocks = num_pixels / PIXELS_PER_COARSE_BLOCK;
+
+    static const uint32_t x_swizzle_mask = 0x55555555 & (num_pixels - 1);
+    static const uint32_t y_swizzle_mask = 0xAAAAAAAA & (num_pixels - 1);
+};
+
 typedef struct tile_cmdbuf_t
 {
     // start and past-the-end of the allocation for the buffer
@@ -324,6 +359,14 @@ typedef struct tile_cmdbuf_t
     uint32_t* cmdbuf_write;
 } tile_cmdbuf_t;
 
+// the low bits of a tile command's first dword are its tilecmd_id_t, and draw commands keep their pixel_stage_t and depth_func_t in the high bits
+#define TILECMD_ID_MASK 0xFF
+#define TILECMD_PIXEL_STAGE_SHIFT 8
+#define TILECMD_PIXEL_STAGE_MASK 0xFF
+#define TILECMD_DEPTH_FUNC_SHIFT 16
+#define TILECMD_DEPTH_FUNC_MASK 0xFF
+#define TILECMD_DEPTH_WRITE_BIT (1 << 24)
+
 typedef enum tilecmd_id_t
 {
     tilecmd_id_resetbuf, // when there's not enough space in the command ring buffer and the ring loops
@@ -381,11 +424,70 @@ const char* kFramebufferTilePerfcounterNames[] = {
 
 static_assert(sizeof(kFramebufferTilePerfcounterNames) / sizeof(*kFramebufferTilePerfcounterNames) == sizeof(framebuffer_tile_perfcounters_t) / sizeof(uint64_t), "Names for perfcounters");
 
+// counts of pixels, unlike the perfcounters these are always kept
+typedef struct framebuffer_statistics_t
+{
+    // covered pixels that were depth tested, and how many of them were closer than the depth buffer
+    uint64_t depth_tests;
+    uint64_t depth_tests_passed;
+} framebuffer_statistics_t;
+
+const char* kFramebufferStatisticNames[] = {
+    "depth_tests",
+    "depth_tests_passed"
+};
+
+static_assert(sizeof(kFramebufferStatisticNames) / sizeof(*kFramebufferStatisticNames) == sizeof(framebuffer_statistics_t) / sizeof(uint64_t), "Names for statistics");
+
+// Statistics are counted per coarse block, since tiles and the coarse blocks of hot tiles are resolved in parallel.
+// Padded to a cache line, so that the threads resolving neighboring blocks don't fight over it.
+typedef struct coarse_block_statistics_t
+{
+    framebuffer_statistics_t statistics;
+    uint8_t padding[64 - sizeof(framebuffer_statistics_t)];
+} coarse_block_statistics_t;
+
 typedef struct xyzw_i32_t
 {
     int32_t x, y, z, w;
 } xyzw_i32_t;
 
+// what gets interpolated across a triangle, per vertex
+typedef struct vertex_varyings_t
+{
+    uint32_t color;
+    float attributes[RASTERIZER_MAX_VERTEX_ATTRIBUTES];
+} vertex_varyings_t;
+
+// missing attributes default to (0, 0, 0, 1), and attribute_color_stage_t writes them as r, g, b, a
+static_assert(RASTERIZER_MAX_VERTEX_ATTRIBUTES == 4, "Attributes map to the 4 channels of a color");
+
+// Plane equations for perspective-correct interpolation, computed once per triangle in setup.
+// With u and v the barycentrics of vertices 1 and 2 (in 0.16 fixed point):
+// 1/w = one_over_w[0] + u * one_over_w[1] + v * one_over_w[2]
+// attribute/w = attribute_over_w[i][0] + u * attribute_over_w[i][1] + v * attribute_over_w[i][2]
+// so each pixel only needs a reciprocal and a multiply to get back the attributes.
+typedef struct attribute_planes_t
+{
+    float one_over_w[3];
+    float attribute_over_w[RASTERIZER_MAX_VERTEX_ATTRIBUTES][3];
+
+    // derivatives of u and v along x and y, for the derivatives of the attributes (eg. to select mip levels)
+    float barycentric_dxs[2];
+    float barycentric_dys[2];
+
+    const texture_t* texture;
+} attribute_planes_t;
+
+// inputs of the pixel stage of a triangle (only the member of the stage it's drawn with is set)
+typedef union pixel_stage_data_t
+{
+    uint32_t flat_color;
+    uint32_t visibility_id;
+    uint32_t vert_colors[3];
+    uint32_t attribute_planes_id;
+} pixel_stage_data_t;
+
 typedef struct tilecmd_drawsmalltri_t
 {
     uint32_t tilecmd_id;
@@ -397,6 +499,7 @@ typedef struct tilecmd_drawsmalltri_t
     uint32_t shifted_triarea2;
     uint32_t rcp_triarea2_mantissa;
     int32_t rcp_triarea2_rshift;
+    pixel_stage_data_t stage;
 } tilecmd_drawsmalltri_t;
 
 typedef struct tilecmd_drawtile_t
@@ -411,6 +514,7 @@ typedef struct tilecmd_drawtile_t
     uint32_t shifted_triarea2;
     uint32_t rcp_triarea2_mantissa;
     int32_t rcp_triarea2_rshift;
+    pixel_stage_data_t stage;
 } tilecmd_drawtile_t;
 
 typedef struct tilecmd_cleartile_t
@@ -419,13 +523,126 @@ typedef struct tilecmd_cleartile_t
     uint32_t color;
 } tilecmd_cleartile_t;
 
+// Where a tile command keeps the id of its attribute planes, in dwords from its start, or 0 if it doesn't refer to any.
+static size_t get_tilecmd_attribute_planes_offset(const uint32_t* cmd)
+{
+    uint32_t tilecmd_id = cmd[0] & TILECMD_ID_MASK;
+    pixel_stage_t pixel_stage = (pixel_stage_t)((cmd[0] >> TILECMD_PIXEL_STAGE_SHIFT) & TILECMD_PIXEL_STAGE_MASK);
+
+    if (pixel_stage != pixel_stage_attribute_color && pixel_stage != pixel_stage_textured)
+    {
+        return 0;
+    }
+
+    if (tilecmd_id == tilecmd_id_drawsmalltri)
+    {
+        return offsetof(tilecmd_drawsmalltri_t, stage) / sizeof(uint32_t);
+    }
+
+    if (tilecmd_id >= tilecmd_id_drawlargetri_0edgemask && tilecmd_id <= tilecmd_id_drawlargetri_7edgemask)
+    {
+        return offsetof(tilecmd_drawtile_t, stage) / sizeof(uint32_t);
+    }
+
+    return 0;
+}
+
+// Tile commands recorded by framebuffer_begin_command_list, which framebuffer_execute_command_list pushes to the tiles again.
+// Each command is stored after the id of its tile and its size in dwords. Commands refer to the list's own attribute planes,
+// which are allocated in the order of the triangles, and all the commands of a triangle are next to each other.
+// flags that change where the framebuffer keeps its frames, but not what the commands do
+#define COMMAND_LIST_IGNORED_FLAGS (framebuffer_flag_pipelined | framebuffer_flag_large_pages)
+
+typedef struct command_list_t
+{
+    // what the commands were binned for: the flags (besides COMMAND_LIST_IGNORED_FLAGS) and size of the framebuffer
+    uint32_t flags;
+    int32_t width_in_pixels;
+    int32_t height_in_pixels;
+
+    uint32_t* dwords;
+    size_t num_dwords;
+    size_t dwords_capacity;
+
+    attribute_planes_t* attribute_planes;
+    uint32_t num_attribute_planes;
+    uint32_t attribute_planes_capacity;
+} command_list_t;
+
+// Commands of a tile to resolve, for all its coarse blocks or only some of them when it's split between several jobs.
+// cost is the number of command dwords to run for those blocks.
+typedef struct tile_job_t
+{
+    struct framebuffer_t* fb;
+    int32_t tile_id;
+    int32_t node;
+    uint64_t coarse_block_mask;
+    uint32_t* first_cmd;
+    uint32_t cost;
+} tile_job_t;
+
+// tile_dirty_attachments bits of a tile whose every attachment might have changed
+#define TILE_DIRTY_ALL_ATTACHMENTS ((1 << (attachment_visibility + 1)) - 1)
+
 typedef struct framebuffer_t
 {
+    // framebuffer_flag_t bits given at creation
+    uint32_t flags;
+
+    // one allocation for the backbuffer, depthbuffer, visbuffer and tile_cmdpool (see alloc_tile_memory).
+    // when the caller provides the memory of the attachments, tile_memory only has the tile_cmdpool.
+    void* tile_memory;
+    int32_t tile_memory_large_pages;
+
+    // where the attachments are, either in tile_memory or in the caller's memory
+    void* attachment_memory;
+    framebuffer_layout_t layout;
+
+    // NULL for depth-only framebuffers
     uint32_t* backbuffer;
     uint32_t* depthbuffer;
+
+    // visibility id of the closest triangle of each pixel. NULL unless framebuffer_flag_visibility_buffer is set.
+    uint32_t* visbuffer;
+
+    // depth test of the next draws
+    depth_func_t depth_func;
+    int32_t depth_write;
+
+    // far depth, what the depth buffer is cleared to
+    uint32_t depth_clear;
+
+    // Scissor: when enabled, commands are only queued in the tiles whose tile_in_scissor is set, and only those get shaded
+    int32_t scissor_enabled;
+    uint8_t* tile_in_scissor;
+
+    // the command list the next draws and clears go to rather than the tiles, or NULL
+    command_list_t* recording;
+    // the command list that gets a copy of the commands queued in the tiles, or NULL
+    command_list_t* capturing;
+
+    // pixel stage state for the next draws
+    pixel_stage_t pixel_stage;
+    uint32_t flat_color;
+    const uint32_t* vertex_colors;
+    const float* vertex_attributes;
+    int32_t num_vertex_attributes;
+    const texture_t* texture;
+
+    // planes of the triangles in the tile command buffers, in order of setup (NULL for depth-only framebuffers)
+    attribute_planes_t* attribute_planes;
+    int32_t num_attribute_planes;
     
     uint32_t* tile_cmdpool;
     tile_cmdbuf_t* tile_cmdbufs;
+
+    // per tile, a bit for each attachment_t whose pixels might have changed since framebuffer_pack_dirty_tiles last read it.
+    // set when the tile's draws or clears are resolved, or when it's shaded.
+    uint8_t* tile_dirty_attachments;
+
+    // the jobs of the last resolve, by node and most expensive first (see schedule_tile_jobs)
+    // room for every coarse block of every tile, in case they're all split
+    tile_job_t* tile_jobs;
     
     int32_t width_in_pixels;
     int32_t height_in_pixels;
@@ -433,6 +650,19 @@ typedef struct framebuffer_t
     int32_t width_in_tiles;
     int32_t height_in_tiles;
     int32_t total_num_tiles;
+
+    // the size of the tiles and the layout of their pixels (see tile_layout_t)
+    int32_t tile_width_in_pixels;
+    int32_t pixels_per_tile;
+    int32_t coarse_blocks_per_tile;
+    uint32_t tile_x_swizzle_mask;
+    uint32_t tile_y_swizzle_mask;
+
+    // triangles up to this size are binned as small triangles
+    int32_t max_smalltri_width_in_pixels;
+
+    // number of NUMA nodes the tiles are split between (see get_tile_node)
+    int32_t num_nodes;
     
     // num_tiles_per_row * num_pixels_per_tile
     int32_t pixels_per_row_of_tiles;
@@ -447,9 +677,262 @@ typedef struct framebuffer_t
     framebuffer_tile_perfcounters_t* tile_perfcounters;
 #endif
 
+    coarse_block_statistics_t* coarse_block_statistics;
+
+    // Pipelining: the storage of the frame being resolved in the background, and of the last frame that was.
+    // Both are framebuffers of their own (without the flag), whose storage gets rotated with this one's by framebuffer_submit.
+    // NULL unless framebuffer_flag_pipelined is set.
+    struct framebuffer_t* in_flight;
+    struct framebuffer_t* completed;
+    thread_pool_batch_t* in_flight_batch;
+    int32_t in_flight_finished;
+
+    // fences of the frames in in_flight and completed (0 when there's none), and of the last submitted frame
+    uint64_t in_flight_fence;
+    uint64_t completed_fence;
+    uint64_t last_fence;
 } framebuffer_t;
 
 framebuffer_t* new_framebuffer(int32_t width, int32_t height)
+{
+    return new_framebuffer_with_flags(width, height, 0);
+}
+
+#ifdef _WIN32
+// Size of the large pages of the machine, or 0 if the process can't use them.
+// Large pages are locked in memory, so the user needs the "Lock pages in memory" privilege, which also has to be enabled for the process.
+// Only called for framebuffers created with framebuffer_flag_large_pages, so the process's token is left alone unless the application asks for them.
+static size_t get_large_page_size()
+{
+    static size_t large_page_size = []
+    {
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        {
+            return (size_t)0;
+        }
+
+        TOKEN_PRIVILEGES privileges;
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+        // AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED when the user doesn't have the privilege
+        BOOL enabled =
+            LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+            GetLastError() == ERROR_SUCCESS;
+
+        CloseHandle(token);
+
+        return enabled ? (size_t)GetLargePageMinimum() : (size_t)0;
+    }();
+
+    return large_page_size;
+}
+#else
+static size_t get_large_page_size()
+{
+    return 0;
+}
+#endif
+
+static int32_t get_tile_width_from_flags(uint32_t flags)
+{
+    if (flags & framebuffer_flag_tile_width_32)
+        return 32;
+    if (flags & framebuffer_flag_tile_width_128)
+        return 128;
+    return DEFAULT_TILE_WIDTH_IN_PIXELS;
+}
+
+// The attachments are laid out one after the other as:
+//     backbuffer | depthbuffer | visbuffer
+// where attachments the framebuffer doesn't have take no room, and each attachment starts on a new page.
+static void layout_attachments(int32_t width, int32_t height, uint32_t flags, uint64_t page_size, framebuffer_layout_t* layout)
+{
+    int32_t tile_width = get_tile_width_from_flags(flags);
+
+    layout->tile_width_in_pixels = tile_width;
+    layout->width_in_tiles = (width + (tile_width - 1)) / tile_width;
+    layout->height_in_tiles = (height + (tile_width - 1)) / tile_width;
+
+    uint64_t attachment_size = (uint64_t)layout->width_in_tiles * layout->height_in_tiles * tile_width * tile_width * sizeof(uint32_t);
+    attachment_size = (attachment_size + page_size - 1) & ~(page_size - 1);
+
+    uint64_t offset = 0;
+
+    layout->attachment_offsets[attachment_color0] = -1;
+    if (!(flags & framebuffer_flag_depth_only))
+    {
+        layout->attachment_offsets[attachment_color0] = (int64_t)offset;
+        offset += attachment_size;
+    }
+
+    layout->attachment_offsets[attachment_depth] = (int64_t)offset;
+    offset += attachment_size;
+
+    layout->attachment_offsets[attachment_visibility] = -1;
+    if (flags & framebuffer_flag_visibility_buffer)
+    {
+        layout->attachment_offsets[attachment_visibility] = (int64_t)offset;
+        offset += attachment_size;
+    }
+
+    layout->size_in_bytes = offset;
+    layout->alignment_in_bytes = page_size;
+}
+
+// The memory of the tiles is one allocation, with the tile_cmdpool after the attachments (see layout_attachments).
+// Tiles are stored one after the other in each buffer. With large pages (2MB on x64), the size of a tile divides the page size, so a tile is never
+// split between two pages, and a TLB entry covers 128 64x64 tiles of a buffer. With 4KB pages, a 64x64 tile spans 4 pages.
+// Large pages are used with framebuffer_flag_large_pages, when the process can use them and the buffers are big enough to fill them. Not when the tiles are split between NUMA nodes,
+// since large pages are committed where the allocating thread runs rather than on first touch (see first_touch_tiles).
+// When the caller provides the memory of the attachments, only the tile_cmdpool is allocated.
+static void alloc_tile_memory(framebuffer_t* fb, void* attachment_memory)
+{
+    size_t large_page_size = (fb->flags & framebuffer_flag_large_pages) ? get_large_page_size() : 0;
+    size_t pixel_buffer_size = (size_t)fb->pixels_per_slice * sizeof(uint32_t);
+    size_t cmdpool_size = (size_t)fb->total_num_tiles * TILE_COMMAND_BUFFER_SIZE_IN_DWORDS * sizeof(uint32_t);
+
+    fb->tile_memory_large_pages = !attachment_memory && large_page_size != 0 && fb->num_nodes == 1 && pixel_buffer_size >= large_page_size;
+
+    size_t page_size = fb->tile_memory_large_pages ? large_page_size : 4096;
+    layout_attachments(fb->width_in_pixels, fb->height_in_pixels, fb->flags, page_size, &fb->layout);
+
+    size_t cmdpool_offset = attachment_memory ? 0 : (size_t)fb->layout.size_in_bytes;
+    size_t tile_memory_size = cmdpool_offset + ((cmdpool_size + page_size - 1) & ~(page_size - 1));
+
+    fb->tile_memory = NULL;
+#ifdef _WIN32
+    if (fb->tile_memory_large_pages)
+    {
+        fb->tile_memory = VirtualAlloc(NULL, tile_memory_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+
+        // there might not be enough contiguous physical memory left for large pages
+        if (!fb->tile_memory)
+        {
+            fb->tile_memory_large_pages = 0;
+        }
+    }
+#endif
+    if (!fb->tile_memory)
+    {
+        fb->tile_memory = _aligned_malloc(tile_memory_size, 4096);
+    }
+    assert(fb->tile_memory);
+
+    fb->attachment_memory = attachment_memory ? attachment_memory : fb->tile_memory;
+
+    uint8_t* attachments = (uint8_t*)fb->attachment_memory;
+    const int64_t* offsets = fb->layout.attachment_offsets;
+    fb->backbuffer = offsets[attachment_color0] < 0 ? NULL : (uint32_t*)(attachments + offsets[attachment_color0]);
+    fb->depthbuffer = (uint32_t*)(attachments + offsets[attachment_depth]);
+    fb->visbuffer = offsets[attachment_visibility] < 0 ? NULL : (uint32_t*)(attachments + offsets[attachment_visibility]);
+    fb->tile_cmdpool = (uint32_t*)((uint8_t*)fb->tile_memory + cmdpool_offset);
+}
+
+static void free_tile_memory(framebuffer_t* fb)
+{
+#ifdef _WIN32
+    if (fb->tile_memory_large_pages)
+    {
+        VirtualFree(fb->tile_memory, 0, MEM_RELEASE);
+        return;
+    }
+#endif
+
+    _aligned_free(fb->tile_memory);
+}
+
+// The tiles are split between the NUMA nodes in ranges of consecutive tiles, which are also contiguous in memory.
+// A tile always belongs to the same node, so its pixels and commands stay in the memory of the threads that resolve it.
+static int32_t get_first_tile_of_node(const framebuffer_t* fb, int32_t node)
+{
+    return (int32_t)((int64_t)fb->total_num_tiles * node / fb->num_nodes);
+}
+
+static int32_t get_tile_node(const framebuffer_t* fb, int32_t tile_id)
+{
+    return (int32_t)(((int64_t)(tile_id + 1) * fb->num_nodes - 1) / fb->total_num_tiles);
+}
+
+typedef struct first_touch_t
+{
+    framebuffer_t* fb;
+
+    // each node's tiles are split between the threads of the node
+    int32_t node_first_job[THREAD_POOL_MAX_NODES + 1];
+} first_touch_t;
+
+static void first_touch_job(void* userdata, int32_t job_id, int32_t thread_id)
+{
+    const first_touch_t* first_touch = (const first_touch_t*)userdata;
+    framebuffer_t* fb = first_touch->fb;
+
+    int32_t node = 0;
+    while (job_id >= first_touch->node_first_job[node + 1])
+    {
+        node++;
+    }
+
+    int32_t num_node_jobs = first_touch->node_first_job[node + 1] - first_touch->node_first_job[node];
+    int32_t node_job_i = job_id - first_touch->node_first_job[node];
+
+    int32_t node_first_tile = get_first_tile_of_node(fb, node);
+    int32_t node_num_tiles = get_first_tile_of_node(fb, node + 1) - node_first_tile;
+    int32_t first_tile = node_first_tile + node_num_tiles * node_job_i / num_node_jobs;
+    int32_t num_tiles = node_first_tile + node_num_tiles * (node_job_i + 1) / num_node_jobs - first_tile;
+
+    size_t first_pixel = (size_t)first_tile * fb->pixels_per_tile;
+    size_t num_pixels = (size_t)num_tiles * fb->pixels_per_tile;
+
+    if (fb->backbuffer)
+    {
+        // clear to black/transparent initially
+        memset(fb->backbuffer + first_pixel, 0, num_pixels * sizeof(uint32_t));
+    }
+
+    // clear to infinity initially
+    memset(fb->depthbuffer + first_pixel, (fb->flags & framebuffer_flag_reversed_z) ? 0x00 : 0xFF, num_pixels * sizeof(uint32_t));
+
+    if (fb->visbuffer)
+    {
+        // initially not covered by any triangle
+        memset(fb->visbuffer + first_pixel, 0xFF, num_pixels * sizeof(uint32_t));
+    }
+
+    memset(fb->tile_cmdpool + (size_t)first_tile * TILE_COMMAND_BUFFER_SIZE_IN_DWORDS, 0, (size_t)num_tiles * TILE_COMMAND_BUFFER_SIZE_IN_DWORDS * sizeof(uint32_t));
+}
+
+// Pages are placed on the NUMA node of the thread that touches them first, so the memory of each tile is
+// cleared for the first time by the threads of its node. The threads don't help other nodes here, unlike in resolves.
+static void first_touch_tiles(framebuffer_t* fb)
+{
+    first_touch_t first_touch;
+    first_touch.fb = fb;
+    first_touch.node_first_job[0] = 0;
+    for (int32_t node = 0; node < fb->num_nodes; node++)
+    {
+        first_touch.node_first_job[node + 1] = first_touch.node_first_job[node] + thread_pool_get_num_node_threads(node);
+    }
+
+    thread_pool_run_on_nodes(first_touch.node_first_job, 0, first_touch_job, &first_touch);
+}
+
+void get_framebuffer_layout(int32_t width, int32_t height, uint32_t flags, framebuffer_layout_t* layout)
+{
+    assert(layout);
+
+    // the attachments of framebuffers that allocate their own memory can be on large pages, but the caller's only need to be page aligned
+    layout_attachments(width, height, flags, 4096, layout);
+}
+
+framebuffer_t* new_framebuffer_with_flags(int32_t width, int32_t height, uint32_t flags)
+{
+    return new_framebuffer_with_memory(width, height, flags, NULL);
+}
+
+framebuffer_t* new_framebuffer_with_memory(int32_t width, int32_t height, uint32_t flags, void* memory)
 {
     // limits of the rasterizer's precision
     // this is based on an analysis of the range of results of the 2D cross product between two fixed16.8 numbers.
@@ -459,37 +942,85 @@ framebuffer_t* new_framebuffer(int32_t width, int32_t height)
     framebuffer_t* fb = (framebuffer_t*)malloc(sizeof(framebuffer_t));
     assert(fb);
 
+    // a visibility buffer is shaded into the color buffer, so it can't be depth-only
+    assert(!((flags & framebuffer_flag_depth_only) && (flags & framebuffer_flag_visibility_buffer)));
+
+    // one tile size at a time
+    assert(!((flags & framebuffer_flag_tile_width_32) && (flags & framebuffer_flag_tile_width_128)));
+
+    // pipelined framebuffers rotate between several sets of attachments
+    assert(!(memory && (flags & framebuffer_flag_pipelined)));
+    assert(((uintptr_t)memory & 4095) == 0);
+
+    fb->flags = flags;
+
     fb->width_in_pixels = width;
     fb->height_in_pixels = height;
 
+    int32_t tile_width = get_tile_width_from_flags(flags);
+
+    fb->tile_width_in_pixels = tile_width;
+    fb->pixels_per_tile = tile_width * tile_width;
+    fb->coarse_blocks_per_tile = fb->pixels_per_tile / PIXELS_PER_COARSE_BLOCK;
+    fb->tile_x_swizzle_mask = 0x55555555 & (fb->pixels_per_tile - 1);
+    fb->tile_y_swizzle_mask = 0xAAAAAAAA & (fb->pixels_per_tile - 1);
+    fb->max_smalltri_width_in_pixels = tile_width < MAX_SMALLTRI_WIDTH_IN_PIXELS ? tile_width : MAX_SMALLTRI_WIDTH_IN_PIXELS;
+
     // pad framebuffer up to size of next tile
     // that way the rasterization code doesn't have to handlep otential out of bounds access after tile binning
-    int32_t padded_width_in_pixels = (width + (TILE_WIDTH_IN_PIXELS - 1)) & -TILE_WIDTH_IN_PIXELS;
-    int32_t padded_height_in_pixels = (height + (TILE_WIDTH_IN_PIXELS - 1)) & -TILE_WIDTH_IN_PIXELS;
+    int32_t padded_width_in_pixels = (width + (tile_width - 1)) & -tile_width;
+    int32_t padded_height_in_pixels = (height + (tile_width - 1)) & -tile_width;
     
-    fb->width_in_tiles = padded_width_in_pixels / TILE_WIDTH_IN_PIXELS;
-    fb->height_in_tiles = padded_height_in_pixels / TILE_WIDTH_IN_PIXELS;
+    fb->width_in_tiles = padded_width_in_pixels / tile_width;
+    fb->height_in_tiles = padded_height_in_pixels / tile_width;
     fb->total_num_tiles = fb->width_in_tiles * fb->height_in_tiles;
 
-    fb->pixels_per_row_of_tiles = padded_width_in_pixels * TILE_WIDTH_IN_PIXELS;
-    fb->pixels_per_slice = padded_height_in_pixels / TILE_WIDTH_IN_PIXELS * fb->pixels_per_row_of_tiles;
+    fb->pixels_per_row_of_tiles = padded_width_in_pixels * tile_width;
+    fb->pixels_per_slice = padded_height_in_pixels / tile_width * fb->pixels_per_row_of_tiles;
 
-    fb->backbuffer = (uint32_t*)_aligned_malloc(fb->pixels_per_slice * sizeof(uint32_t), 32);
-    assert(fb->backbuffer);
+    fb->num_nodes = thread_pool_get_num_nodes();
 
-    // clear to black/transparent initially
-    memset(fb->backbuffer, 0, fb->pixels_per_slice * sizeof(uint32_t));
-
-    fb->depthbuffer = (uint32_t*)_aligned_malloc(fb->pixels_per_slice * sizeof(uint32_t), 32);
-    assert(fb->depthbuffer);
+    // the pixels and command buffers are cleared by the threads of the nodes that own their tiles (see first_touch_tiles)
+    alloc_tile_memory(fb, memory);
     
-    // clear to infinity initially
-    memset(fb->depthbuffer, 0xFF, fb->pixels_per_slice * sizeof(uint32_t));
+    fb->depth_clear = (flags & framebuffer_flag_reversed_z) ? 0 : 0xFFFFFFFF;
+
+    fb->depth_func = (flags & framebuffer_flag_reversed_z) ? depth_func_greater : depth_func_less;
+    fb->depth_write = 1;
+
+    fb->recording = NULL;
+    fb->capturing = NULL;
+
+    fb->scissor_enabled = 0;
+    fb->tile_in_scissor = (uint8_t*)malloc(fb->total_num_tiles * sizeof(uint8_t));
+    assert(fb->tile_in_scissor);
+
+    // by default, write what the framebuffer was made for
+    if (flags & framebuffer_flag_depth_only)
+        fb->pixel_stage = pixel_stage_depth_only;
+    else if (flags & framebuffer_flag_visibility_buffer)
+        fb->pixel_stage = pixel_stage_visibility_id;
+    else
+        fb->pixel_stage = pixel_stage_barycentric_color;
+
+    fb->flat_color = 0xFFFFFFFF;
+    fb->vertex_colors = NULL;
+    fb->vertex_attributes = NULL;
+    fb->num_vertex_attributes = 0;
+    fb->texture = NULL;
 
-    // allocate command lists for each tile
-    fb->tile_cmdpool = (uint32_t*)malloc(fb->total_num_tiles * TILE_COMMAND_BUFFER_SIZE_IN_DWORDS * sizeof(uint32_t));
-    assert(fb->tile_cmdpool);
+    if (fb->backbuffer)
+    {
+        fb->attribute_planes = (attribute_planes_t*)_aligned_malloc(MAX_ATTRIBUTE_PLANES * sizeof(attribute_planes_t), 32);
+        assert(fb->attribute_planes);
+    }
+    else
+    {
+        fb->attribute_planes = NULL;
+    }
+    fb->num_attribute_planes = 0;
 
+    // command lists for each tile
     fb->tile_cmdbufs = (tile_cmdbuf_t*)malloc(fb->total_num_tiles * sizeof(tile_cmdbuf_t));
     assert(fb->tile_cmdbufs);
 
@@ -502,6 +1033,16 @@ framebuffer_t* new_framebuffer(int32_t width, int32_t height)
         fb->tile_cmdbufs[i].cmdbuf_write = fb->tile_cmdbufs[i].cmdbuf_start;
     }
 
+    // nothing was read yet
+    fb->tile_dirty_attachments = (uint8_t*)malloc(fb->total_num_tiles * sizeof(uint8_t));
+    assert(fb->tile_dirty_attachments);
+    memset(fb->tile_dirty_attachments, TILE_DIRTY_ALL_ATTACHMENTS, fb->total_num_tiles * sizeof(uint8_t));
+
+    first_touch_tiles(fb);
+
+    fb->tile_jobs = (tile_job_t*)malloc(fb->total_num_tiles * fb->coarse_blocks_per_tile * sizeof(tile_job_t));
+    assert(fb->tile_jobs);
+
 #ifdef ENABLE_PERFCOUNTERS
     fb->pc_frequency = qpf();
 
@@ -510,6 +1051,27 @@ framebuffer_t* new_framebuffer(int32_t width, int32_t height)
     fb->tile_perfcounters = (framebuffer_tile_perfcounters_t*)malloc(fb->total_num_tiles * sizeof(framebuffer_tile_perfcounters_t));
     memset(fb->tile_perfcounters, 0, fb->total_num_tiles * sizeof(framebuffer_tile_perfcounters_t));
 #endif
+
+    fb->coarse_block_statistics = (coarse_block_statistics_t*)_aligned_malloc(fb->total_num_tiles * fb->coarse_blocks_per_tile * sizeof(coarse_block_statistics_t), 64);
+    assert(fb->coarse_block_statistics);
+    memset(fb->coarse_block_statistics, 0, fb->total_num_tiles * fb->coarse_blocks_per_tile * sizeof(coarse_block_statistics_t));
+
+    if (flags & framebuffer_flag_pipelined)
+    {
+        fb->in_flight = new_framebuffer_with_flags(width, height, flags & ~framebuffer_flag_pipelined);
+        fb->completed = new_framebuffer_with_flags(width, height, flags & ~framebuffer_flag_pipelined);
+        fb->in_flight_batch = new thread_pool_batch_t();
+    }
+    else
+    {
+        fb->in_flight = NULL;
+        fb->completed = NULL;
+        fb->in_flight_batch = NULL;
+    }
+    fb->in_flight_finished = 0;
+    fb->in_flight_fence = 0;
+    fb->completed_fence = 0;
+    fb->last_fence = 0;
     
     return fb;
 }
@@ -519,65 +1081,393 @@ void delete_framebuffer(framebuffer_t* fb)
     if (!fb)
         return;
 
+    if (fb->flags & framebuffer_flag_pipelined)
+    {
+        // the workers might still be resolving the storage about to be freed
+        framebuffer_wait(fb, fb->last_fence);
+
+        delete fb->in_flight_batch;
+        delete_framebuffer(fb->in_flight);
+        delete_framebuffer(fb->completed);
+    }
+
 #ifdef ENABLE_PERFCOUNTERS
     free(fb->tile_perfcounters);
 #endif
 
+    _aligned_free(fb->coarse_block_statistics);
+    free(fb->tile_jobs);
+    free(fb->tile_dirty_attachments);
+    free(fb->tile_in_scissor);
     free(fb->tile_cmdbufs);
-    free(fb->tile_cmdpool);
-    _aligned_free(fb->depthbuffer);
-    _aligned_free(fb->backbuffer);
+    _aligned_free(fb->attribute_planes);
+    free_tile_memory(fb);
     free(fb);
 }
 
-static void draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* drawcmd)
+// Depth tests: how the raster kernels compare the depth of each pixel to the depth buffer, and whether they write it.
+// Like the pixel stages, the kernels are templated on them.
+
+template<depth_func_t DepthFunc, bool DepthWrite>
+struct depth_test_t
 {
-    int32_t edge_dxs[3];
-    int32_t edge_dys[3];
-    for (int32_t v = 0; v < 3; v++)
-    {
-        edge_dxs[v] = drawcmd->edge_dxs[v];
-        edge_dys[v] = drawcmd->edge_dys[v];
-    }
+    // writing the depth that's already there would do nothing
+    static const bool writes_depth = DepthWrite && DepthFunc != depth_func_equal;
 
-    int32_t edges[3];
-    for (int32_t v = 0; v < 3; v++)
+    static __forceinline bool test(uint32_t src_depth, uint32_t dst_depth)
     {
-        edges[v] = drawcmd->edges[v];
+        switch (DepthFunc)
+        {
+        case depth_func_less:
+            return src_depth < dst_depth;
+        case depth_func_less_equal:
+            return src_depth <= dst_depth;
+        case depth_func_greater:
+            return src_depth > dst_depth;
+        case depth_func_greater_equal:
+            return src_depth >= dst_depth;
+        case depth_func_equal:
+            return src_depth == dst_depth;
+        default:
+            return true;
+        }
     }
-    
-    for (
-        uint32_t px_y = 0, px_y_bits = 0;
-        px_y < FINE_BLOCK_WIDTH_IN_PIXELS;
-        px_y++, px_y_bits = (px_y_bits - FINE_BLOCK_Y_SWIZZLE_MASK) & FINE_BLOCK_Y_SWIZZLE_MASK)
+
+#ifdef USE_HSWni
+    static __forceinline __m256i test_avx2(__m256i src_depth, __m256i dst_depth)
     {
-        int32_t edges_row[3];
-        for (int32_t v = 0; v < 3; v++)
+        // note: unsigned compare implemented using signed compare, done by subtracting 2^31
+        __m256i src = _mm256_sub_epi32(src_depth, _mm256_set1_epi32(0x80000000));
+        __m256i dst = _mm256_sub_epi32(dst_depth, _mm256_set1_epi32(0x80000000));
+        __m256i all_ones = _mm256_set1_epi32(-1);
+
+        switch (DepthFunc)
         {
-            edges_row[v] = edges[v];
+        case depth_func_less:
+            return _mm256_cmpgt_epi32(dst, src);
+        case depth_func_less_equal:
+            return _mm256_xor_si256(_mm256_cmpgt_epi32(src, dst), all_ones);
+        case depth_func_greater:
+            return _mm256_cmpgt_epi32(src, dst);
+        case depth_func_greater_equal:
+            return _mm256_xor_si256(_mm256_cmpgt_epi32(dst, src), all_ones);
+        case depth_func_equal:
+            return _mm256_cmpeq_epi32(src_depth, dst_depth);
+        default:
+            return all_ones;
         }
+    }
+#endif
+};
 
-        for (
-            uint32_t px_x = 0, px_x_bits = 0;
-            px_x < FINE_BLOCK_WIDTH_IN_PIXELS;
-            px_x++, px_x_bits = (px_x_bits - FINE_BLOCK_X_SWIZZLE_MASK) & FINE_BLOCK_X_SWIZZLE_MASK)
-        {
-            int32_t dst_i = fine_dst_i + (px_y_bits | px_x_bits);
+// Pixel stages: what the raster kernels do for each pixel that passes the depth test, besides writing depth.
+// The kernels are templated on them so that each stage compiles into its own tight loop.
+// u, v and w are the barycentrics of vertices 1, 2 and 0, in 0.16 fixed point.
 
-            int32_t pixel_discarded = 0;
-            for (int32_t v = 0; v < 3; v++)
-            {
-                if (edges_row[v] >= 0)
-                {
-                    pixel_discarded = 1;
-                    break;
-                }
-            }
+struct depth_only_stage_t
+{
+    static __forceinline void shade(framebuffer_t* fb, int32_t dst_i, uint32_t u, uint32_t v, uint32_t w, const pixel_stage_data_t* data)
+    {
+    }
 
-            if (!pixel_discarded)
-            {
-                uint32_t rcp_triarea2_mantissa = drawcmd->rcp_triarea2_mantissa;
-                int32_t rcp_triarea2_rshift = drawcmd->rcp_triarea2_rshift;
+#ifdef USE_HSWni
+    static __forceinline void shade_avx2(framebuffer_t* fb, int32_t dst_i, __m256i mask, __m256i u, __m256i v, __m256i w, const pixel_stage_data_t* data)
+    {
+    }
+#endif
+};
+
+struct barycentric_color_stage_t
+{
+    static __forceinline void shade(framebuffer_t* fb, int32_t dst_i, uint32_t u, uint32_t v, uint32_t w, const pixel_stage_data_t* data)
+    {
+        fb->backbuffer[dst_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+    }
+
+#ifdef USE_HSWni
+    static __forceinline void shade_avx2(framebuffer_t* fb, int32_t dst_i, __m256i mask, __m256i u, __m256i v, __m256i w, const pixel_stage_data_t* data)
+    {
+        // set color based on barycentrics.
+        __m256i src_color = _mm256_set1_epi32(0xFF << 24);
+        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(w, _mm256_set1_epi32(0xFF)), 16), 16));
+        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(u, _mm256_set1_epi32(0xFF)), 16), 8));
+        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(v, _mm256_set1_epi32(0xFF)), 16), 0));
+
+        // write color into backbuffer
+        _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[dst_i], mask, src_color);
+    }
+#endif
+};
+
+struct flat_color_stage_t
+{
+    static __forceinline void shade(framebuffer_t* fb, int32_t dst_i, uint32_t u, uint32_t v, uint32_t w, const pixel_stage_data_t* data)
+    {
+        fb->backbuffer[dst_i] = data->flat_color;
+    }
+
+#ifdef USE_HSWni
+    static __forceinline void shade_avx2(framebuffer_t* fb, int32_t dst_i, __m256i mask, __m256i u, __m256i v, __m256i w, const pixel_stage_data_t* data)
+    {
+        _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[dst_i], mask, _mm256_set1_epi32(data->flat_color));
+    }
+#endif
+};
+
+struct visibility_id_stage_t
+{
+    static __forceinline void shade(framebuffer_t* fb, int32_t dst_i, uint32_t u, uint32_t v, uint32_t w, const pixel_stage_data_t* data)
+    {
+        fb->visbuffer[dst_i] = data->visibility_id;
+    }
+
+#ifdef USE_HSWni
+    static __forceinline void shade_avx2(framebuffer_t* fb, int32_t dst_i, __m256i mask, __m256i u, __m256i v, __m256i w, const pixel_stage_data_t* data)
+    {
+        // shading happens later, once per visible pixel
+        _mm256_maskstore_epi32((int32_t*)&fb->visbuffer[dst_i], mask, _mm256_set1_epi32(data->visibility_id));
+    }
+#endif
+};
+
+// interpolates the 0xAARRGGBB colors of the vertices
+struct vertex_color_stage_t
+{
+    static __forceinline void shade(framebuffer_t* fb, int32_t dst_i, uint32_t u, uint32_t v, uint32_t w, const pixel_stage_data_t* data)
+    {
+        uint32_t color = 0;
+        for (int32_t shift = 0; shift < 32; shift += 8)
+        {
+            uint32_t c0 = (data->vert_colors[0] >> shift) & 0xFF;
+            uint32_t c1 = (data->vert_colors[1] >> shift) & 0xFF;
+            uint32_t c2 = (data->vert_colors[2] >> shift) & 0xFF;
+            color |= ((c0 * w + c1 * u + c2 * v) / 0xFFFF) << shift;
+        }
+        fb->backbuffer[dst_i] = color;
+    }
+
+#ifdef USE_HSWni
+    static __forceinline void shade_avx2(framebuffer_t* fb, int32_t dst_i, __m256i mask, __m256i u, __m256i v, __m256i w, const pixel_stage_data_t* data)
+    {
+        __m256i src_color = _mm256_setzero_si256();
+        for (int32_t shift = 0; shift < 32; shift += 8)
+        {
+            __m256i c0 = _mm256_set1_epi32((data->vert_colors[0] >> shift) & 0xFF);
+            __m256i c1 = _mm256_set1_epi32((data->vert_colors[1] >> shift) & 0xFF);
+            __m256i c2 = _mm256_set1_epi32((data->vert_colors[2] >> shift) & 0xFF);
+
+            // 8 bits times 16 bits, so the sum can't overflow
+            __m256i channel = _mm256_mullo_epi32(w, c0);
+            channel = _mm256_add_epi32(channel, _mm256_mullo_epi32(u, c1));
+            channel = _mm256_add_epi32(channel, _mm256_mullo_epi32(v, c2));
+            channel = _mm256_srli_epi32(channel, 16);
+
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(channel, shift));
+        }
+
+        _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[dst_i], mask, src_color);
+    }
+#endif
+};
+
+// writes the perspective-correct attributes as a color
+struct attribute_color_stage_t
+{
+    static __forceinline void shade(framebuffer_t* fb, int32_t dst_i, uint32_t u, uint32_t v, uint32_t w, const pixel_stage_data_t* data)
+    {
+        const attribute_planes_t* planes = &fb->attribute_planes[data->attribute_planes_id];
+
+        float fu = (float)u;
+        float fv = (float)v;
+        float w_over_1 = 1.0f / (planes->one_over_w[0] + fu * planes->one_over_w[1] + fv * planes->one_over_w[2]);
+
+        // attributes 0, 1, 2, 3 go to red, green, blue, alpha
+        static const int32_t kShifts[RASTERIZER_MAX_VERTEX_ATTRIBUTES] = { 16, 8, 0, 24 };
+
+        uint32_t color = 0;
+        for (int32_t i = 0; i < RASTERIZER_MAX_VERTEX_ATTRIBUTES; i++)
+        {
+            const float* plane = planes->attribute_over_w[i];
+            float attribute = (plane[0] + fu * plane[1] + fv * plane[2]) * w_over_1;
+            attribute = attribute < 0.0f ? 0.0f : attribute > 1.0f ? 1.0f : attribute;
+            color |= (uint32_t)(attribute * 255.0f + 0.5f) << kShifts[i];
+        }
+        fb->backbuffer[dst_i] = color;
+    }
+
+#ifdef USE_HSWni
+    static __forceinline void shade_avx2(framebuffer_t* fb, int32_t dst_i, __m256i mask, __m256i u, __m256i v, __m256i w, const pixel_stage_data_t* data)
+    {
+        const attribute_planes_t* planes = &fb->attribute_planes[data->attribute_planes_id];
+
+        __m256 fu = _mm256_cvtepi32_ps(u);
+        __m256 fv = _mm256_cvtepi32_ps(v);
+
+        __m256 one_over_w = _mm256_set1_ps(planes->one_over_w[0]);
+        one_over_w = _mm256_fmadd_ps(fu, _mm256_set1_ps(planes->one_over_w[1]), one_over_w);
+        one_over_w = _mm256_fmadd_ps(fv, _mm256_set1_ps(planes->one_over_w[2]), one_over_w);
+
+        // approximate reciprocal refined with one Newton-Raphson step: x' = x * (2 - d * x)
+        __m256 w_over_1 = _mm256_rcp_ps(one_over_w);
+        w_over_1 = _mm256_mul_ps(w_over_1, _mm256_fnmadd_ps(one_over_w, w_over_1, _mm256_set1_ps(2.0f)));
+
+        // pre-scale by 255 to go straight to 8 bit channels
+        w_over_1 = _mm256_mul_ps(w_over_1, _mm256_set1_ps(255.0f));
+
+        static const int32_t kShifts[RASTERIZER_MAX_VERTEX_ATTRIBUTES] = { 16, 8, 0, 24 };
+
+        __m256i src_color = _mm256_setzero_si256();
+        for (int32_t i = 0; i < RASTERIZER_MAX_VERTEX_ATTRIBUTES; i++)
+        {
+            const float* plane = planes->attribute_over_w[i];
+            __m256 attribute = _mm256_set1_ps(plane[0]);
+            attribute = _mm256_fmadd_ps(fu, _mm256_set1_ps(plane[1]), attribute);
+            attribute = _mm256_fmadd_ps(fv, _mm256_set1_ps(plane[2]), attribute);
+            attribute = _mm256_mul_ps(attribute, w_over_1);
+
+            // round to nearest and clamp to a byte
+            __m256i channel = _mm256_cvtps_epi32(attribute);
+            channel = _mm256_min_epi32(_mm256_max_epi32(channel, _mm256_setzero_si256()), _mm256_set1_epi32(0xFF));
+
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(channel, kShifts[i]));
+        }
+
+        _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[dst_i], mask, src_color);
+    }
+#endif
+};
+
+// samples the texture at the perspective-correct texture coordinates (attributes 0 and 1)
+struct textured_stage_t
+{
+    static __forceinline void shade(framebuffer_t* fb, int32_t dst_i, uint32_t u, uint32_t v, uint32_t w, const pixel_stage_data_t* data)
+    {
+        const attribute_planes_t* planes = &fb->attribute_planes[data->attribute_planes_id];
+
+        float fu = (float)u;
+        float fv = (float)v;
+        float w_over_1 = 1.0f / (planes->one_over_w[0] + fu * planes->one_over_w[1] + fv * planes->one_over_w[2]);
+
+        const float* s_plane = planes->attribute_over_w[0];
+        const float* t_plane = planes->attribute_over_w[1];
+        float s = (s_plane[0] + fu * s_plane[1] + fv * s_plane[2]) * w_over_1;
+        float t = (t_plane[0] + fu * t_plane[1] + fv * t_plane[2]) * w_over_1;
+
+        // quotient rule: d(a/q) = (da - (a/q) dq) / q
+        float one_over_w_dx = planes->one_over_w[1] * planes->barycentric_dxs[0] + planes->one_over_w[2] * planes->barycentric_dxs[1];
+        float one_over_w_dy = planes->one_over_w[1] * planes->barycentric_dys[0] + planes->one_over_w[2] * planes->barycentric_dys[1];
+        float dsdx = (s_plane[1] * planes->barycentric_dxs[0] + s_plane[2] * planes->barycentric_dxs[1] - s * one_over_w_dx) * w_over_1;
+        float dsdy = (s_plane[1] * planes->barycentric_dys[0] + s_plane[2] * planes->barycentric_dys[1] - s * one_over_w_dy) * w_over_1;
+        float dtdx = (t_plane[1] * planes->barycentric_dxs[0] + t_plane[2] * planes->barycentric_dxs[1] - t * one_over_w_dx) * w_over_1;
+        float dtdy = (t_plane[1] * planes->barycentric_dys[0] + t_plane[2] * planes->barycentric_dys[1] - t * one_over_w_dy) * w_over_1;
+
+        int32_t level = texture_select_level(planes->texture, dsdx, dtdx, dsdy, dtdy);
+        fb->backbuffer[dst_i] = texture_sample_bilinear(planes->texture, level, s, t);
+    }
+
+#ifdef USE_HSWni
+    static __forceinline void shade_avx2(framebuffer_t* fb, int32_t dst_i, __m256i mask, __m256i u, __m256i v, __m256i w, const pixel_stage_data_t* data)
+    {
+        const attribute_planes_t* planes = &fb->attribute_planes[data->attribute_planes_id];
+
+        __m256 fu = _mm256_cvtepi32_ps(u);
+        __m256 fv = _mm256_cvtepi32_ps(v);
+
+        __m256 one_over_w = _mm256_set1_ps(planes->one_over_w[0]);
+        one_over_w = _mm256_fmadd_ps(fu, _mm256_set1_ps(planes->one_over_w[1]), one_over_w);
+        one_over_w = _mm256_fmadd_ps(fv, _mm256_set1_ps(planes->one_over_w[2]), one_over_w);
+
+        // approximate reciprocal refined with one Newton-Raphson step: x' = x * (2 - d * x)
+        __m256 w_over_1 = _mm256_rcp_ps(one_over_w);
+        w_over_1 = _mm256_mul_ps(w_over_1, _mm256_fnmadd_ps(one_over_w, w_over_1, _mm256_set1_ps(2.0f)));
+
+        const float* s_plane = planes->attribute_over_w[0];
+        const float* t_plane = planes->attribute_over_w[1];
+        __m256 s = _mm256_fmadd_ps(fv, _mm256_set1_ps(s_plane[2]), _mm256_fmadd_ps(fu, _mm256_set1_ps(s_plane[1]), _mm256_set1_ps(s_plane[0])));
+        __m256 t = _mm256_fmadd_ps(fv, _mm256_set1_ps(t_plane[2]), _mm256_fmadd_ps(fu, _mm256_set1_ps(t_plane[1]), _mm256_set1_ps(t_plane[0])));
+        s = _mm256_mul_ps(s, w_over_1);
+        t = _mm256_mul_ps(t, w_over_1);
+
+        // The lanes are two 2x2 quads (see the morton order of fine blocks), and like GPUs each quad uses a single mip level.
+        // It's picked from the derivatives at the top left pixel of the quad, using the quotient rule: d(a/q) = (da - (a/q) dq) / q
+        const __m256i kQuadLeaders = _mm256_setr_epi32(0, 0, 0, 0, 4, 4, 4, 4);
+        __m256 quad_s = _mm256_permutevar8x32_ps(s, kQuadLeaders);
+        __m256 quad_t = _mm256_permutevar8x32_ps(t, kQuadLeaders);
+        __m256 quad_w_over_1 = _mm256_permutevar8x32_ps(w_over_1, kQuadLeaders);
+
+        float one_over_w_dx = planes->one_over_w[1] * planes->barycentric_dxs[0] + planes->one_over_w[2] * planes->barycentric_dxs[1];
+        float one_over_w_dy = planes->one_over_w[1] * planes->barycentric_dys[0] + planes->one_over_w[2] * planes->barycentric_dys[1];
+        float s_dx = s_plane[1] * planes->barycentric_dxs[0] + s_plane[2] * planes->barycentric_dxs[1];
+        float s_dy = s_plane[1] * planes->barycentric_dys[0] + s_plane[2] * planes->barycentric_dys[1];
+        float t_dx = t_plane[1] * planes->barycentric_dxs[0] + t_plane[2] * planes->barycentric_dxs[1];
+        float t_dy = t_plane[1] * planes->barycentric_dys[0] + t_plane[2] * planes->barycentric_dys[1];
+
+        __m256 dsdx = _mm256_mul_ps(_mm256_fnmadd_ps(quad_s, _mm256_set1_ps(one_over_w_dx), _mm256_set1_ps(s_dx)), quad_w_over_1);
+        __m256 dsdy = _mm256_mul_ps(_mm256_fnmadd_ps(quad_s, _mm256_set1_ps(one_over_w_dy), _mm256_set1_ps(s_dy)), quad_w_over_1);
+        __m256 dtdx = _mm256_mul_ps(_mm256_fnmadd_ps(quad_t, _mm256_set1_ps(one_over_w_dx), _mm256_set1_ps(t_dx)), quad_w_over_1);
+        __m256 dtdy = _mm256_mul_ps(_mm256_fnmadd_ps(quad_t, _mm256_set1_ps(one_over_w_dy), _mm256_set1_ps(t_dy)), quad_w_over_1);
+
+        __m256i level = texture_select_level_avx2(planes->texture, dsdx, dtdx, dsdy, dtdy);
+        __m256i src_color = texture_sample_bilinear_avx2(planes->texture, level, s, t);
+
+        _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[dst_i], mask, src_color);
+    }
+#endif
+};
+
+template<class DepthTest, class PixelStage>
+static void draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* drawcmd)
+{
+    // counted per fine block, rather than in memory for every pixel
+    uint32_t depth_tests = 0;
+    uint32_t depth_tests_passed = 0;
+
+    int32_t edge_dxs[3];
+    int32_t edge_dys[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        edge_dxs[v] = drawcmd->edge_dxs[v];
+        edge_dys[v] = drawcmd->edge_dys[v];
+    }
+
+    int32_t edges[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        edges[v] = drawcmd->edges[v];
+    }
+    
+    for (
+        uint32_t px_y = 0, px_y_bits = 0;
+        px_y < FINE_BLOCK_WIDTH_IN_PIXELS;
+        px_y++, px_y_bits = (px_y_bits - FINE_BLOCK_Y_SWIZZLE_MASK) & FINE_BLOCK_Y_SWIZZLE_MASK)
+    {
+        int32_t edges_row[3];
+        for (int32_t v = 0; v < 3; v++)
+        {
+            edges_row[v] = edges[v];
+        }
+
+        for (
+            uint32_t px_x = 0, px_x_bits = 0;
+            px_x < FINE_BLOCK_WIDTH_IN_PIXELS;
+            px_x++, px_x_bits = (px_x_bits - FINE_BLOCK_X_SWIZZLE_MASK) & FINE_BLOCK_X_SWIZZLE_MASK)
+        {
+            int32_t dst_i = fine_dst_i + (px_y_bits | px_x_bits);
+
+            int32_t pixel_discarded = 0;
+            for (int32_t v = 0; v < 3; v++)
+            {
+                if (edges_row[v] >= 0)
+                {
+                    pixel_discarded = 1;
+                    break;
+                }
+            }
+
+            if (!pixel_discarded)
+            {
+                uint32_t rcp_triarea2_mantissa = drawcmd->rcp_triarea2_mantissa;
+                int32_t rcp_triarea2_rshift = drawcmd->rcp_triarea2_rshift;
 
                 // note: off by one because -1 maps to 0
                 uint32_t shifted_e2 = -edges_row[2] - 1;
@@ -628,10 +1518,16 @@ static void draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_
                 assert(pixel_Z >= drawcmd->min_Z << 16);
                 assert(pixel_Z <= drawcmd->max_Z << 16);
 
-                if (pixel_Z < fb->depthbuffer[dst_i])
+                depth_tests++;
+
+                if (DepthTest::test(pixel_Z, fb->depthbuffer[dst_i]))
                 {
-                    fb->depthbuffer[dst_i] = pixel_Z;
-                    fb->backbuffer[dst_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+                    depth_tests_passed++;
+
+                    if (DepthTest::writes_depth)
+                        fb->depthbuffer[dst_i] = pixel_Z;
+
+                    PixelStage::shade(fb, dst_i, u, v, w, &drawcmd->stage);
                 }
             }
 
@@ -646,8 +1542,14 @@ static void draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_
             edges[v] += edge_dys[v];
         }
     }
+
+    // tiles are stored one after the other
+    framebuffer_statistics_t* block_statistics = &fb->coarse_block_statistics[fine_dst_i / PIXELS_PER_COARSE_BLOCK].statistics;
+    block_statistics->depth_tests += depth_tests;
+    block_statistics->depth_tests_passed += depth_tests_passed;
 }
 
+template<class DepthTest, class PixelStage>
 static void draw_coarse_block_smalltri_scalar(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawsmalltri_t* drawcmd)
 {
     int32_t fine_edge_dxs[3];
@@ -718,7 +1620,7 @@ static void draw_coarse_block_smalltri_scalar(framebuffer_t* fb, int32_t coarse_
                 }
 
                 int32_t dst_i = coarse_dst_i + (fine_y_bits | fine_x_bits);
-                draw_fine_block_smalltri_scalar(fb, dst_i, &fbargs);
+                draw_fine_block_smalltri_scalar<DepthTest, PixelStage>(fb, dst_i, &fbargs);
             }
 
             for (int32_t v = 0; v < 3; v++)
@@ -744,7 +1646,8 @@ static void draw_coarse_block_smalltri_scalar(framebuffer_t* fb, int32_t coarse_
     }
 }
 
-static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd)
+template<class Tile, class DepthTest, class PixelStage>
+static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, const tilecmd_drawsmalltri_t* drawcmd)
 {
     int32_t coarse_edge_dxs[3];
     int32_t coarse_edge_dys[3];
@@ -768,14 +1671,14 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
         if (coarse_edge_dys[v] < 0) edge_trivRejs[v] += coarse_edge_dys[v];
     }
 
-    const uint32_t mask_x = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, TILE_X_SWIZZLE_MASK);
-    const uint32_t mask_y = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, TILE_Y_SWIZZLE_MASK);
+    const uint32_t mask_x = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, Tile::x_swizzle_mask);
+    const uint32_t mask_y = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, Tile::y_swizzle_mask);
 
-    uint32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
+    uint32_t tile_dst_i = tile_id * Tile::num_pixels;
 
     for (
         uint32_t cb_y = 0, cb_y_bits = 0;
-        cb_y < TILE_WIDTH_IN_COARSE_BLOCKS;
+        cb_y < Tile::width_in_coarse_blocks;
         cb_y++, cb_y_bits = (cb_y_bits - mask_y) & mask_y)
     {
         int32_t edges_row[3];
@@ -792,12 +1695,12 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
 
         for (
             uint32_t cb_x = 0, cb_x_bits = 0;
-            cb_x < TILE_WIDTH_IN_COARSE_BLOCKS;
+            cb_x < Tile::width_in_coarse_blocks;
             cb_x++, cb_x_bits = (cb_x_bits - mask_x) & mask_x)
         {
-            // trivial reject if at least one edge doesn't cover the coarse block at all
-            int32_t trivially_rejected = 0;
-            for (int32_t v = 0; v < 3; v++)
+            // trivial reject if at least one edge doesn't cover the coarse block at all, or if the block is left to another job
+            int32_t trivially_rejected = !((coarse_block_mask >> ((cb_y_bits | cb_x_bits) / PIXELS_PER_COARSE_BLOCK)) & 1);
+            for (int32_t v = 0; v < 3 && !trivially_rejected; v++)
             {
                 if (edge_row_trivRejs[v] >= 0)
                 {
@@ -817,7 +1720,7 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
 
                 uint32_t dst_i = tile_dst_i + (cb_y_bits | cb_x_bits);
 
-                draw_coarse_block_smalltri_scalar(fb, dst_i, &cbargs);
+                draw_coarse_block_smalltri_scalar<DepthTest, PixelStage>(fb, dst_i, &cbargs);
             }
 
             for (int32_t v = 0; v < 3; v++)
@@ -844,8 +1747,12 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
 }
 
 #ifdef USE_HSWni
+template<class DepthTest, class PixelStage>
 static void draw_fine_block_smalltri_avx2(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* pDrawcmd)
 {
+    // tiles are stored one after the other
+    framebuffer_statistics_t* block_statistics = &fb->coarse_block_statistics[fine_dst_i / PIXELS_PER_COARSE_BLOCK].statistics;
+
     // pixels are stored in fine blocks according to a morton code ordering:
     //  0  1  4  5
     //  2  3  6  7
@@ -966,28 +1873,25 @@ static void draw_fine_block_smalltri_avx2(framebuffer_t* fb, int32_t fine_dst_i,
 
         __m256i dst_depth = _mm256_load_si256((__m256i*)&fb->depthbuffer[fine_dst_i]);
         
-        // note: unsigned compare implemented using signed compare, done by subtracting 2^31
-        __m256i depth_pass = _mm256_cmpgt_epi32(_mm256_sub_epi32(dst_depth, _mm256_set1_epi32(0x80000000)), _mm256_sub_epi32(src_depth, _mm256_set1_epi32(0x80000000)));
+        __m256i depth_pass = DepthTest::test_avx2(src_depth, dst_depth);
 
         // combine coverage and depth masks
         depth_pass = _mm256_and_si256(coverage_pass, depth_pass);
 
-        // early out if all depth tests fail
+        // only the top bit of each pixel's mask is set for sure
         int depth_pass_mask = _mm256_movemask_epi8(depth_pass);
+        block_statistics->depth_tests += _mm_popcnt_u32(coverage_mask);
+        block_statistics->depth_tests_passed += _mm_popcnt_u32(depth_pass_mask & 0x88888888);
+
+        // early out if all depth tests fail
         if (!depth_pass_mask)
             goto end_fineblock_half;
         
         // blend depth into depthbuffer
-        _mm256_maskstore_epi32((int32_t*)&fb->depthbuffer[fine_dst_i], depth_pass, src_depth);
-
-        // set color based on barycentrics.
-        __m256i src_color = _mm256_set1_epi32(0xFF << 24);
-        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(w, _mm256_set1_epi32(0xFF)), 16), 16));
-        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(u, _mm256_set1_epi32(0xFF)), 16), 8));
-        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(v, _mm256_set1_epi32(0xFF)), 16), 0));
+        if (DepthTest::writes_depth)
+            _mm256_maskstore_epi32((int32_t*)&fb->depthbuffer[fine_dst_i], depth_pass, src_depth);
 
-        // write color into backbuffer
-        _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[fine_dst_i], depth_pass, src_color);
+        PixelStage::shade_avx2(fb, fine_dst_i, depth_pass, u, v, w, &drawcmd.stage);
 
     end_fineblock_half:
         // offset edge equations down for the second half
@@ -1009,6 +1913,7 @@ static void draw_fine_block_smalltri_avx2(framebuffer_t* fb, int32_t fine_dst_i,
 #endif
 
 #ifdef USE_HSWni
+template<class DepthTest, class PixelStage>
 static void draw_coarse_block_smalltri_avx2(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawsmalltri_t* pDrawcmd)
 {
     // coarse blocks are made out of 4x4 fine blocks, organized as:
@@ -1122,8 +2027,8 @@ static void draw_coarse_block_smalltri_avx2(framebuffer_t* fb, int32_t coarse_ds
                 finecmd.edges[1] = fineblock_edges[1][i];
                 finecmd.edges[2] = fineblock_edges[2][i];
 
-                draw_fine_block_smalltri_avx2(fb, dst_i, &finecmd);
-                // draw_fine_block_smalltri_scalar(fb, dst_i, &finecmd);
+                draw_fine_block_smalltri_avx2<DepthTest, PixelStage>(fb, dst_i, &finecmd);
+                // draw_fine_block_smalltri_scalar<DepthTest, PixelStage>(fb, dst_i, &finecmd);
             }
 
             dst_i += PIXELS_PER_FINE_BLOCK;
@@ -1150,14 +2055,14 @@ static void draw_coarse_block_smalltri_avx2(framebuffer_t* fb, int32_t coarse_ds
 #endif
 
 #ifdef USE_HSWni
-static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd)
+template<class Tile, class DepthTest, class PixelStage>
+static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, const tilecmd_drawsmalltri_t* drawcmd)
 {
-    // tiles are made out of 4x4 coarse blocks, organized as:
+    // coarse blocks are stored in Z-order, so each run of 8 of them is 4x2 coarse blocks organized as:
     //  0  1  4  5
     //  2  3  6  7
-    //  8  9 12 13
-    // 10 11 14 15
-    // therefore, tiles are rasterized by shifting around the fine block's edge equations.
+    // therefore, tiles are rasterized 8 coarse blocks at a time by shifting around the first coarse block's edge equations.
+    // 32x32 tiles only have the first 4, the others are left out by coarse_block_mask.
 
     __m256i edges[3];
     __m256i edge_trivRejs[3];
@@ -1176,25 +2081,40 @@ static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, const ti
         if (dy < 0) edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], _mm256_set1_epi32(dy));
     }
 
-    int32_t dst_i = tile_id * PIXELS_PER_TILE;
+    int32_t dst_i = tile_id * Tile::num_pixels;
 
-    for (int32_t tile_half = 0; tile_half < 2; tile_half++)
+    for (int32_t run_i = 0; run_i < (Tile::num_coarse_blocks + 7) / 8; run_i++)
     {
-        // draw each coarse block in the tile half
+        // where the run's first coarse block is in the tile, in coarse blocks
+        int32_t run_cb_x = (int32_t)pext_u32(run_i * 8, 0x55555555);
+        int32_t run_cb_y = (int32_t)pext_u32(run_i * 8, 0xAAAAAAAA);
+
+        __m256i run_edges[3];
+        __m256i run_edge_trivRejs[3];
+        for (int32_t i = 0; i < 3; i++)
+        {
+            __m256i offset = _mm256_set1_epi32((drawcmd->edge_dxs[i] * run_cb_x + drawcmd->edge_dys[i] * run_cb_y) * COARSE_BLOCK_WIDTH_IN_PIXELS);
+            run_edges[i] = _mm256_add_epi32(edges[i], offset);
+            run_edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], offset);
+        }
+
+        // draw each coarse block in the run
         __declspec(align(32)) int32_t coarseblock_edges[3][8];
-        _mm256_store_si256((__m256i*)&coarseblock_edges[0][0], edges[0]);
-        _mm256_store_si256((__m256i*)&coarseblock_edges[1][0], edges[1]);
-        _mm256_store_si256((__m256i*)&coarseblock_edges[2][0], edges[2]);
+        _mm256_store_si256((__m256i*)&coarseblock_edges[0][0], run_edges[0]);
+        _mm256_store_si256((__m256i*)&coarseblock_edges[1][0], run_edges[1]);
+        _mm256_store_si256((__m256i*)&coarseblock_edges[2][0], run_edges[2]);
 
-        __m256i trivRej_pass = _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[0]);
-        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[1]));
-        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[2]));
+        __m256i trivRej_pass = _mm256_cmpgt_epi32(_mm256_setzero_si256(), run_edge_trivRejs[0]);
+        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), run_edge_trivRejs[1]));
+        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), run_edge_trivRejs[2]));
 
+        // the coarse blocks left to another job are rejected too (one bit per block, spread to the 4 bits of the block's lane)
         int trivRej_pass_mask = _mm256_movemask_epi8(trivRej_pass);
+        trivRej_pass_mask &= pdep_u32((uint32_t)(coarse_block_mask >> (run_i * 8)) & 0xFF, 0x11111111);
         if (!trivRej_pass_mask)
         {
             dst_i += PIXELS_PER_COARSE_BLOCK * 8;
-            goto tile_half_end;
+            continue;
         }
 
         tilecmd_drawsmalltri_t coarsecmd = *drawcmd;
@@ -1206,26 +2126,22 @@ static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, const ti
                 coarsecmd.edges[1] = coarseblock_edges[1][i];
                 coarsecmd.edges[2] = coarseblock_edges[2][i];
 
-                draw_coarse_block_smalltri_avx2(fb, dst_i, &coarsecmd);
+                draw_coarse_block_smalltri_avx2<DepthTest, PixelStage>(fb, dst_i, &coarsecmd);
             }
 
             dst_i += PIXELS_PER_COARSE_BLOCK;
         }
-
-    tile_half_end:
-        for (int32_t i = 0; i < 3; i++)
-        {
-            __m256i dy2 = _mm256_set1_epi32(drawcmd->edge_dys[i] * COARSE_BLOCK_WIDTH_IN_PIXELS * 2);
-            edges[i] = _mm256_add_epi32(edges[i], dy2);
-            edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], dy2);
-        }
     }
 }
 #endif
 
-template<uint32_t TestEdgeMask>
+template<uint32_t TestEdgeMask, class DepthTest, class PixelStage>
 static void draw_fine_block_largetri_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawtile_t* drawcmd)
 {
+    // counted per fine block, rather than in memory for every pixel
+    uint32_t depth_tests = 0;
+    uint32_t depth_tests_passed = 0;
+
     int32_t edge_dxs[3];
     int32_t edge_dys[3];
     for (int32_t v = 0; v < 3; v++)
@@ -1328,10 +2244,16 @@ static void draw_fine_block_largetri_scalar(framebuffer_t* fb, int32_t fine_dst_
 
                 int32_t dst_i = fine_dst_i + (px_y_bits | px_x_bits);
 
-                if (pixel_Z < fb->depthbuffer[dst_i])
+                depth_tests++;
+
+                if (DepthTest::test(pixel_Z, fb->depthbuffer[dst_i]))
                 {
-                    fb->depthbuffer[dst_i] = pixel_Z;
-                    fb->backbuffer[dst_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+                    depth_tests_passed++;
+
+                    if (DepthTest::writes_depth)
+                        fb->depthbuffer[dst_i] = pixel_Z;
+
+                    PixelStage::shade(fb, dst_i, u, v, w, &drawcmd->stage);
                 }
             }
 
@@ -1346,9 +2268,14 @@ static void draw_fine_block_largetri_scalar(framebuffer_t* fb, int32_t fine_dst_
             edges[v] += edge_dys[v];
         }
     }
+
+    // tiles are stored one after the other
+    framebuffer_statistics_t* block_statistics = &fb->coarse_block_statistics[fine_dst_i / PIXELS_PER_COARSE_BLOCK].statistics;
+    block_statistics->depth_tests += depth_tests;
+    block_statistics->depth_tests_passed += depth_tests_passed;
 }
 
-template<uint32_t TestEdgeMask>
+template<uint32_t TestEdgeMask, class DepthTest, class PixelStage>
 static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t tile_id, int32_t coarse_dst_i, const tilecmd_drawtile_t* drawcmd)
 {
     int32_t fine_edge_dxs[3];
@@ -1427,7 +2354,7 @@ static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t tile_id
                 }
 
                 int32_t dst_i = coarse_dst_i + (fine_y_bits | fine_x_bits);
-                draw_fine_block_largetri_scalar<TestEdgeMask>(fb, dst_i, &fbargs);
+                draw_fine_block_largetri_scalar<TestEdgeMask, DepthTest, PixelStage>(fb, dst_i, &fbargs);
             }
 
             for (int32_t v = 0; v < 3; v++)
@@ -1459,8 +2386,8 @@ static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t tile_id
     }
 }
 
-template<uint32_t TestEdgeMask>
-static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawtile_t* drawcmd)
+template<class Tile, uint32_t TestEdgeMask, class DepthTest, class PixelStage>
+static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, const tilecmd_drawtile_t* drawcmd)
 {
    
     int32_t coarse_edge_dxs[3];
@@ -1492,15 +2419,15 @@ static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const
         }
     }
 
-    const uint32_t mask_x = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, TILE_X_SWIZZLE_MASK);
-    const uint32_t mask_y = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, TILE_Y_SWIZZLE_MASK);
+    const uint32_t mask_x = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, Tile::x_swizzle_mask);
+    const uint32_t mask_y = pdep_u32(-COARSE_BLOCK_WIDTH_IN_PIXELS, Tile::y_swizzle_mask);
 
-    uint32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
+    uint32_t tile_dst_i = tile_id * Tile::num_pixels;
 
     // figure out which coarse blocks pass the reject and accept tests
     for (
         uint32_t cb_y = 0, cb_y_bits = 0;
-        cb_y < TILE_WIDTH_IN_COARSE_BLOCKS; 
+        cb_y < Tile::width_in_coarse_blocks; 
         cb_y++, cb_y_bits = (cb_y_bits - mask_y) & mask_y)
     {
         int32_t edges_row[3];
@@ -1522,12 +2449,12 @@ static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const
 
         for (
             uint32_t cb_x = 0, cb_x_bits = 0;
-            cb_x < TILE_WIDTH_IN_COARSE_BLOCKS; 
+            cb_x < Tile::width_in_coarse_blocks; 
             cb_x++, cb_x_bits = (cb_x_bits - mask_x) & mask_x)
         {
-            // trivial reject if at least one edge doesn't cover the coarse block at all
-            int32_t trivially_rejected = 0;
-            for (int32_t v = 0; v < 3; v++)
+            // trivial reject if at least one edge doesn't cover the coarse block at all, or if the block is left to another job
+            int32_t trivially_rejected = !((coarse_block_mask >> ((cb_y_bits | cb_x_bits) / PIXELS_PER_COARSE_BLOCK)) & 1);
+            for (int32_t v = 0; v < 3 && !trivially_rejected; v++)
             {
                 if (TestEdgeMask & (1 << v))
                 {
@@ -1565,28 +2492,28 @@ static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const
                 switch (newTestEdgeMask)
                 {
                 case 0:
-                    draw_coarse_block_largetri_scalar<0>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<0, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 case 1:
-                    draw_coarse_block_largetri_scalar<1>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<1, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 case 2:
-                    draw_coarse_block_largetri_scalar<2>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<2, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 case 3:
-                    draw_coarse_block_largetri_scalar<3>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<3, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 case 4:
-                    draw_coarse_block_largetri_scalar<4>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<4, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 case 5:
-                    draw_coarse_block_largetri_scalar<5>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<5, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 case 6:
-                    draw_coarse_block_largetri_scalar<6>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<6, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 case 7:
-                    draw_coarse_block_largetri_scalar<7>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<7, DepthTest, PixelStage>(fb, tile_id, dst_i, &cbargs);
                     break;
                 }
             }
@@ -1753,15 +2680,42 @@ static void draw_tile_largetri_avx2(framebuffer_t* fb, int32_t tile_id, const ti
 #endif
 #endif
 
-static void clear_tile(framebuffer_t* fb, int32_t tile_id, tilecmd_cleartile_t* cmd)
+static void clear_coarse_block(framebuffer_t* fb, int32_t coarse_start_i, uint32_t color)
+{
+    int32_t coarse_end_i = coarse_start_i + PIXELS_PER_COARSE_BLOCK;
+
+    if (fb->backbuffer)
+    {
+        for (int32_t px = coarse_start_i; px < coarse_end_i; px++)
+        {
+            fb->backbuffer[px] = color;
+        }
+    }
+
+    if (fb->visbuffer)
+    {
+        for (int32_t px = coarse_start_i; px < coarse_end_i; px++)
+        {
+            fb->visbuffer[px] = VISIBILITY_ID_NONE;
+        }
+    }
+
+    uint32_t depth_clear = fb->depth_clear;
+    for (int32_t px = coarse_start_i; px < coarse_end_i; px++)
+    {
+        fb->depthbuffer[px] = depth_clear;
+    }
+}
+
+template<class Tile>
+static void clear_tile(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, tilecmd_cleartile_t* cmd)
 {
-    int32_t tile_start_i = PIXELS_PER_TILE * tile_id;
-    int32_t tile_end_i = tile_start_i + PIXELS_PER_TILE;
-    uint32_t color = cmd->color;
-    for (int32_t px = tile_start_i; px < tile_end_i; px++)
+    for (int32_t cb_i = 0; cb_i < Tile::num_coarse_blocks; cb_i++)
     {
-        fb->backbuffer[px] = color;
-        fb->depthbuffer[px] = 0xFFFFFFFF;
+        if ((coarse_block_mask >> cb_i) & 1)
+        {
+            clear_coarse_block(fb, Tile::num_pixels * tile_id + PIXELS_PER_COARSE_BLOCK * cb_i, cmd->color);
+        }
     }
 }
 
@@ -1793,14 +2747,169 @@ static void debugprint_cmdbuf(tile_cmdbuf_t* cmdbuf)
     printf("\n");
 }
 
-static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id)
+template<class Tile, class DepthTest, class PixelStage>
+static void draw_tile_smalltri(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, const tilecmd_drawsmalltri_t* drawcmd)
 {
-    tile_cmdbuf_t* cmdbuf = &fb->tile_cmdbufs[tile_id];
+#ifdef USE_HSWni
+    draw_tile_smalltri_avx2<Tile, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+#else
+    draw_tile_smalltri_scalar<Tile, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+#endif
+}
+
+template<class Tile, class DepthTest, class PixelStage>
+static void draw_tile_largetri(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, uint32_t edgemask, const tilecmd_drawtile_t* drawcmd)
+{
+#if defined(USE_HSWni) && 0
+    switch (edgemask)
+    {
+    case 0:
+        draw_tile_largetri_avx2<0>(fb, tile_id, drawcmd);
+        break;
+    case 1:
+        draw_tile_largetri_avx2<1>(fb, tile_id, drawcmd);
+        break;
+    case 2:
+        draw_tile_largetri_avx2<2>(fb, tile_id, drawcmd);
+        break;
+    case 3:
+        draw_tile_largetri_avx2<3>(fb, tile_id, drawcmd);
+        break;
+    case 4:
+        draw_tile_largetri_avx2<4>(fb, tile_id, drawcmd);
+        break;
+    case 5:
+        draw_tile_largetri_avx2<5>(fb, tile_id, drawcmd);
+        break;
+    case 6:
+        draw_tile_largetri_avx2<6>(fb, tile_id, drawcmd);
+        break;
+    case 7:
+        draw_tile_largetri_avx2<7>(fb, tile_id, drawcmd);
+        break;
+    }
+#else
+    switch (edgemask)
+    {
+    case 0:
+        draw_tile_largetri_scalar<Tile, 0, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case 1:
+        draw_tile_largetri_scalar<Tile, 1, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case 2:
+        draw_tile_largetri_scalar<Tile, 2, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case 3:
+        draw_tile_largetri_scalar<Tile, 3, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case 4:
+        draw_tile_largetri_scalar<Tile, 4, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case 5:
+        draw_tile_largetri_scalar<Tile, 5, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case 6:
+        draw_tile_largetri_scalar<Tile, 6, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case 7:
+        draw_tile_largetri_scalar<Tile, 7, DepthTest, PixelStage>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    }
+#endif
+}
+
+template<class Tile, class DepthTest>
+static void draw_tile_smalltri_with_stage(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, pixel_stage_t pixel_stage, const tilecmd_drawsmalltri_t* drawcmd)
+{
+    switch (pixel_stage)
+    {
+    case pixel_stage_depth_only:
+        draw_tile_smalltri<Tile, DepthTest, depth_only_stage_t>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case pixel_stage_barycentric_color:
+        draw_tile_smalltri<Tile, DepthTest, barycentric_color_stage_t>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case pixel_stage_flat_color:
+        draw_tile_smalltri<Tile, DepthTest, flat_color_stage_t>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case pixel_stage_visibility_id:
+        draw_tile_smalltri<Tile, DepthTest, visibility_id_stage_t>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case pixel_stage_vertex_color:
+        draw_tile_smalltri<Tile, DepthTest, vertex_color_stage_t>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case pixel_stage_attribute_color:
+        draw_tile_smalltri<Tile, DepthTest, attribute_color_stage_t>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    case pixel_stage_textured:
+        draw_tile_smalltri<Tile, DepthTest, textured_stage_t>(fb, tile_id, coarse_block_mask, drawcmd);
+        break;
+    }
+}
+
+template<class Tile, class DepthTest>
+static void draw_tile_largetri_with_stage(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, pixel_stage_t pixel_stage, uint32_t edgemask, const tilecmd_drawtile_t* drawcmd)
+{
+    switch (pixel_stage)
+    {
+    case pixel_stage_depth_only:
+        draw_tile_largetri<Tile, DepthTest, depth_only_stage_t>(fb, tile_id, coarse_block_mask, edgemask, drawcmd);
+        break;
+    case pixel_stage_barycentric_color:
+        draw_tile_largetri<Tile, DepthTest, barycentric_color_stage_t>(fb, tile_id, coarse_block_mask, edgemask, drawcmd);
+        break;
+    case pixel_stage_flat_color:
+        draw_tile_largetri<Tile, DepthTest, flat_color_stage_t>(fb, tile_id, coarse_block_mask, edgemask, drawcmd);
+        break;
+    case pixel_stage_visibility_id:
+        draw_tile_largetri<Tile, DepthTest, visibility_id_stage_t>(fb, tile_id, coarse_block_mask, edgemask, drawcmd);
+        break;
+    case pixel_stage_vertex_color:
+        draw_tile_largetri<Tile, DepthTest, vertex_color_stage_t>(fb, tile_id, coarse_block_mask, edgemask, drawcmd);
+        break;
+    case pixel_stage_attribute_color:
+        draw_tile_largetri<Tile, DepthTest, attribute_color_stage_t>(fb, tile_id, coarse_block_mask, edgemask, drawcmd);
+        break;
+    case pixel_stage_textured:
+        draw_tile_largetri<Tile, DepthTest, textured_stage_t>(fb, tile_id, coarse_block_mask, edgemask, drawcmd);
+        break;
+    }
+}
+
+// equal tests don't write depth either way, so they only get one set of kernels
+template<class Tile, depth_func_t DepthFunc>
+static void draw_tile_smalltri_with_depth_func(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, bool depth_write, pixel_stage_t pixel_stage, const tilecmd_drawsmalltri_t* drawcmd)
+{
+    if (depth_write && DepthFunc != depth_func_equal)
+        draw_tile_smalltri_with_stage<Tile, depth_test_t<DepthFunc, true>>(fb, tile_id, coarse_block_mask, pixel_stage, drawcmd);
+    else
+        draw_tile_smalltri_with_stage<Tile, depth_test_t<DepthFunc, false>>(fb, tile_id, coarse_block_mask, pixel_stage, drawcmd);
+}
+
+template<class Tile, depth_func_t DepthFunc>
+static void draw_tile_largetri_with_depth_func(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, bool depth_write, pixel_stage_t pixel_stage, uint32_t edgemask, const tilecmd_drawtile_t* drawcmd)
+{
+    if (depth_write && DepthFunc != depth_func_equal)
+        draw_tile_largetri_with_stage<Tile, depth_test_t<DepthFunc, true>>(fb, tile_id, coarse_block_mask, pixel_stage, edgemask, drawcmd);
+    else
+        draw_tile_largetri_with_stage<Tile, depth_test_t<DepthFunc, false>>(fb, tile_id, coarse_block_mask, pixel_stage, edgemask, drawcmd);
+}
+
+// Runs the commands of a tile from first_cmd on, drawing only to the coarse blocks of the mask, and returns where it stopped.
+// Doesn't touch the command buffer, so that several threads can run the commands of a tile for different coarse blocks.
+template<class Tile>
+static uint32_t* framebuffer_replay_tile_with_layout(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, uint32_t* first_cmd)
+{
+    const tile_cmdbuf_t* cmdbuf = &fb->tile_cmdbufs[tile_id];
     
     uint32_t* cmd;
-    for (cmd = cmdbuf->cmdbuf_read; cmd != cmdbuf->cmdbuf_write; )
+    for (cmd = first_cmd; cmd != cmdbuf->cmdbuf_write; )
     {
-        uint32_t tilecmd_id = *cmd;
+        uint32_t tilecmd_id = *cmd & TILECMD_ID_MASK;
+        pixel_stage_t pixel_stage = (pixel_stage_t)((*cmd >> TILECMD_PIXEL_STAGE_SHIFT) & TILECMD_PIXEL_STAGE_MASK);
+        depth_func_t depth_func = (depth_func_t)((*cmd >> TILECMD_DEPTH_FUNC_SHIFT) & TILECMD_DEPTH_FUNC_MASK);
+        bool depth_write = (*cmd & TILECMD_DEPTH_WRITE_BIT) != 0;
         
         // debugging code for logging commands
         // printf("Reading command [id: %d]\n", tilecmd_id);
@@ -1816,11 +2925,27 @@ static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id)
             uint64_t smalltri_start_pc = qpc();
 #endif
 
-#ifdef USE_HSWni
-            draw_tile_smalltri_avx2(fb, tile_id, (tilecmd_drawsmalltri_t*)cmd);
-#else
-            draw_tile_smalltri_scalar(fb, tile_id, (tilecmd_drawsmalltri_t*)cmd);
-#endif
+            switch (depth_func)
+            {
+            case depth_func_less:
+                draw_tile_smalltri_with_depth_func<Tile, depth_func_less>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, (tilecmd_drawsmalltri_t*)cmd);
+                break;
+            case depth_func_less_equal:
+                draw_tile_smalltri_with_depth_func<Tile, depth_func_less_equal>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, (tilecmd_drawsmalltri_t*)cmd);
+                break;
+            case depth_func_greater:
+                draw_tile_smalltri_with_depth_func<Tile, depth_func_greater>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, (tilecmd_drawsmalltri_t*)cmd);
+                break;
+            case depth_func_greater_equal:
+                draw_tile_smalltri_with_depth_func<Tile, depth_func_greater_equal>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, (tilecmd_drawsmalltri_t*)cmd);
+                break;
+            case depth_func_equal:
+                draw_tile_smalltri_with_depth_func<Tile, depth_func_equal>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, (tilecmd_drawsmalltri_t*)cmd);
+                break;
+            case depth_func_always:
+                draw_tile_smalltri_with_depth_func<Tile, depth_func_always>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, (tilecmd_drawsmalltri_t*)cmd);
+                break;
+            }
 
 #ifdef ENABLE_PERFCOUNTERS
             fb->tile_perfcounters[tile_id].smalltri_raster += qpc() - smalltri_start_pc;
@@ -1834,63 +2959,29 @@ static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id)
             uint64_t largetri_start_pc = qpc();
 #endif
 
-#if defined(USE_HSWni) && 0
-            switch (tilecmd_id - tilecmd_id_drawlargetri_0edgemask)
-            {
-            case 0:
-                draw_tile_largetri_avx2<0>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 1:
-                draw_tile_largetri_avx2<1>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 2:
-                draw_tile_largetri_avx2<2>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 3:
-                draw_tile_largetri_avx2<3>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 4:
-                draw_tile_largetri_avx2<4>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 5:
-                draw_tile_largetri_avx2<5>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 6:
-                draw_tile_largetri_avx2<6>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 7:
-                draw_tile_largetri_avx2<7>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            }
-#else
-            switch (tilecmd_id - tilecmd_id_drawlargetri_0edgemask)
+            uint32_t edgemask = tilecmd_id - tilecmd_id_drawlargetri_0edgemask;
+
+            switch (depth_func)
             {
-            case 0:
-                draw_tile_largetri_scalar<0>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 1:
-                draw_tile_largetri_scalar<1>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
+            case depth_func_less:
+                draw_tile_largetri_with_depth_func<Tile, depth_func_less>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, edgemask, (tilecmd_drawtile_t*)cmd);
                 break;
-            case 2:
-                draw_tile_largetri_scalar<2>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
+            case depth_func_less_equal:
+                draw_tile_largetri_with_depth_func<Tile, depth_func_less_equal>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, edgemask, (tilecmd_drawtile_t*)cmd);
                 break;
-            case 3:
-                draw_tile_largetri_scalar<3>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
+            case depth_func_greater:
+                draw_tile_largetri_with_depth_func<Tile, depth_func_greater>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, edgemask, (tilecmd_drawtile_t*)cmd);
                 break;
-            case 4:
-                draw_tile_largetri_scalar<4>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
+            case depth_func_greater_equal:
+                draw_tile_largetri_with_depth_func<Tile, depth_func_greater_equal>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, edgemask, (tilecmd_drawtile_t*)cmd);
                 break;
-            case 5:
-                draw_tile_largetri_scalar<5>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
+            case depth_func_equal:
+                draw_tile_largetri_with_depth_func<Tile, depth_func_equal>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, edgemask, (tilecmd_drawtile_t*)cmd);
                 break;
-            case 6:
-                draw_tile_largetri_scalar<6>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 7:
-                draw_tile_largetri_scalar<7>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
+            case depth_func_always:
+                draw_tile_largetri_with_depth_func<Tile, depth_func_always>(fb, tile_id, coarse_block_mask, depth_write, pixel_stage, edgemask, (tilecmd_drawtile_t*)cmd);
                 break;
             }
-#endif
 
 #ifdef ENABLE_PERFCOUNTERS
             fb->tile_perfcounters[tile_id].largetri_raster += qpc() - largetri_start_pc;
@@ -1904,7 +2995,7 @@ static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id)
             uint64_t clear_start_pc = qpc();
 #endif
 
-            clear_tile(fb, tile_id, (tilecmd_cleartile_t*)cmd);
+            clear_tile<Tile>(fb, tile_id, coarse_block_mask, (tilecmd_cleartile_t*)cmd);
 
 #ifdef ENABLE_PERFCOUNTERS
             fb->tile_perfcounters[tile_id].clear += qpc() - clear_start_pc;
@@ -1931,13 +3022,115 @@ static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id)
     // read ptr should never be at the end ptr after interpreting
     assert(cmd != cmdbuf->cmdbuf_end);
 
-    cmdbuf->cmdbuf_read = cmd;
+    return cmd;
+}
+
+static uint32_t* framebuffer_replay_tile(framebuffer_t* fb, int32_t tile_id, uint64_t coarse_block_mask, uint32_t* first_cmd)
+{
+    switch (fb->tile_width_in_pixels)
+    {
+    case 32:
+        return framebuffer_replay_tile_with_layout<tile_layout_t<32>>(fb, tile_id, coarse_block_mask, first_cmd);
+    case 64:
+        return framebuffer_replay_tile_with_layout<tile_layout_t<64>>(fb, tile_id, coarse_block_mask, first_cmd);
+    case 128:
+        return framebuffer_replay_tile_with_layout<tile_layout_t<128>>(fb, tile_id, coarse_block_mask, first_cmd);
+    }
+
+    assert(!"Unsupported tile size");
+    return first_cmd;
+}
+
+// one bit for each coarse block of a tile
+static uint64_t all_coarse_blocks(const framebuffer_t* fb)
+{
+    return fb->coarse_blocks_per_tile == 64 ? ~0ull : (1ull << fb->coarse_blocks_per_tile) - 1;
+}
+
+static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id)
+{
+    tile_cmdbuf_t* cmdbuf = &fb->tile_cmdbufs[tile_id];
+
+    // every command queued is a draw or a clear (a resetbuf is always followed by another command)
+    if (cmdbuf->cmdbuf_read != cmdbuf->cmdbuf_write)
+    {
+        fb->tile_dirty_attachments[tile_id] = TILE_DIRTY_ALL_ATTACHMENTS;
+    }
+
+    cmdbuf->cmdbuf_read = framebuffer_replay_tile(fb, tile_id, all_coarse_blocks(fb), cmdbuf->cmdbuf_read);
+}
+
+static void record_tilecmd(command_list_t* cl, int32_t tile_id, const uint32_t* cmd_dwords, int32_t num_dwords)
+{
+    if (cl->num_dwords + 2 + num_dwords > cl->dwords_capacity)
+    {
+        cl->dwords_capacity = cl->dwords_capacity ? cl->dwords_capacity * 2 : TILE_COMMAND_BUFFER_SIZE_IN_DWORDS;
+        cl->dwords = (uint32_t*)realloc(cl->dwords, cl->dwords_capacity * sizeof(uint32_t));
+        assert(cl->dwords);
+    }
+
+    cl->dwords[cl->num_dwords++] = (uint32_t)tile_id;
+    cl->dwords[cl->num_dwords++] = (uint32_t)num_dwords;
+    memcpy(&cl->dwords[cl->num_dwords], cmd_dwords, num_dwords * sizeof(uint32_t));
+    cl->num_dwords += num_dwords;
+}
+
+// Like record_tilecmd, for commands whose planes are in the framebuffer: they're copied to the list, once per triangle.
+static void capture_tilecmd(framebuffer_t* fb, command_list_t* cl, int32_t tile_id, const uint32_t* cmd_dwords, int32_t num_dwords)
+{
+    size_t planes_offset = get_tilecmd_attribute_planes_offset(cmd_dwords);
+    if (planes_offset == 0)
+    {
+        record_tilecmd(cl, tile_id, cmd_dwords, num_dwords);
+        return;
+    }
+
+    // The commands of a triangle are pushed one after the other, so the planes only need to be compared with the last ones copied.
+    // The ids of the framebuffer's planes start over after each resolve, but two triangles with the same planes draw the same either way.
+    const attribute_planes_t* planes = &fb->attribute_planes[cmd_dwords[planes_offset]];
+    if (cl->num_attribute_planes == 0 || memcmp(&cl->attribute_planes[cl->num_attribute_planes - 1], planes, sizeof(attribute_planes_t)) != 0)
+    {
+        if (cl->num_attribute_planes == cl->attribute_planes_capacity)
+        {
+            cl->attribute_planes_capacity = cl->attribute_planes_capacity ? cl->attribute_planes_capacity * 2 : 256;
+            cl->attribute_planes = (attribute_planes_t*)realloc(cl->attribute_planes, cl->attribute_planes_capacity * sizeof(attribute_planes_t));
+            assert(cl->attribute_planes);
+        }
+
+        cl->attribute_planes[cl->num_attribute_planes] = *planes;
+        cl->num_attribute_planes++;
+    }
+
+    uint32_t rebased_cmd[sizeof(tilecmd_drawtile_t) / sizeof(uint32_t)];
+    assert(num_dwords <= (int32_t)(sizeof(rebased_cmd) / sizeof(uint32_t)));
+    memcpy(rebased_cmd, cmd_dwords, num_dwords * sizeof(uint32_t));
+    rebased_cmd[planes_offset] = cl->num_attribute_planes - 1;
+
+    record_tilecmd(cl, tile_id, rebased_cmd, num_dwords);
 }
 
 static void framebuffer_push_tilecmd(framebuffer_t* fb, int32_t tile_id, const uint32_t* cmd_dwords, int32_t num_dwords)
 {
     assert(tile_id < fb->total_num_tiles);
 
+    // recorded commands reach the tiles when the command list is executed, through the scissor at that time
+    if (fb->recording)
+    {
+        record_tilecmd(fb->recording, tile_id, cmd_dwords, num_dwords);
+        return;
+    }
+
+    // tiles outside of the scissor keep their pixels
+    if (fb->scissor_enabled && !fb->tile_in_scissor[tile_id])
+    {
+        return;
+    }
+
+    if (fb->capturing)
+    {
+        capture_tilecmd(fb, fb->capturing, tile_id, cmd_dwords, num_dwords);
+    }
+
     tile_cmdbuf_t* cmdbuf = &fb->tile_cmdbufs[tile_id];
 
     // read should never be at the end.
@@ -2014,144 +3207,1133 @@ static void framebuffer_push_tilecmd(framebuffer_t* fb, int32_t tile_id, const u
     {
         if (cmdbuf->cmdbuf_start == cmdbuf->cmdbuf_read)
         {
-            // write is not allowed to catch up to read,
-            // so make sure read catches up to write instead.
-            framebuffer_resolve_tile(fb, tile_id);
+            // write is not allowed to catch up to read,
+            // so make sure read catches up to write instead.
+            framebuffer_resolve_tile(fb, tile_id);
+
+            // since the resolve made read ptr catch up to write ptr, that means read reached the end
+            // that also means it currently looped back to the start, so the write ptr can be put there too
+            // this is the case where the whole buffer gets consumed in one go
+        }
+
+        cmdbuf->cmdbuf_write = cmdbuf->cmdbuf_start;
+    }
+
+    // DEBUGGING: Always flush. Helpful since it gives you a straight call stack through the command list.
+    // framebuffer_resolve_tile(fb, tile_id);
+}
+
+// Number of command dwords queued in a tile, which is how long it takes to resolve it, roughly.
+static uint32_t count_queued_tilecmd_dwords(const tile_cmdbuf_t* cmdbuf)
+{
+    if (cmdbuf->cmdbuf_write >= cmdbuf->cmdbuf_read)
+    {
+        return (uint32_t)(cmdbuf->cmdbuf_write - cmdbuf->cmdbuf_read);
+    }
+
+    // the commands loop around the end of the ring
+    return (uint32_t)((cmdbuf->cmdbuf_end - cmdbuf->cmdbuf_read) + (cmdbuf->cmdbuf_write - cmdbuf->cmdbuf_start));
+}
+
+// Appends a job for each tile of fb that has commands to resolve, and returns how many there are.
+// The commands are handed to the jobs, so the tiles' command buffers are left empty, and the tiles are marked dirty like framebuffer_resolve_tile does.
+static int32_t gather_tile_jobs(framebuffer_t* fb, tile_job_t* jobs)
+{
+    int32_t num_jobs = 0;
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        tile_cmdbuf_t* cmdbuf = &fb->tile_cmdbufs[tile_id];
+
+        uint32_t cost = count_queued_tilecmd_dwords(cmdbuf);
+        if (cost == 0)
+        {
+            continue;
+        }
+
+        jobs[num_jobs].fb = fb;
+        jobs[num_jobs].tile_id = tile_id;
+        jobs[num_jobs].node = get_tile_node(fb, tile_id);
+        jobs[num_jobs].coarse_block_mask = all_coarse_blocks(fb);
+        jobs[num_jobs].first_cmd = cmdbuf->cmdbuf_read;
+        jobs[num_jobs].cost = cost;
+        num_jobs++;
+
+        cmdbuf->cmdbuf_read = cmdbuf->cmdbuf_write;
+        fb->tile_dirty_attachments[tile_id] = TILE_DIRTY_ALL_ATTACHMENTS;
+    }
+
+    return num_jobs;
+}
+
+// Finds where the jobs of each node start, once they're sorted by node.
+static void find_node_first_jobs(const tile_job_t* jobs, int32_t num_jobs, int32_t* node_first_job)
+{
+    int32_t num_nodes = thread_pool_get_num_nodes();
+
+    int32_t job_i = 0;
+    for (int32_t node = 0; node < num_nodes; node++)
+    {
+        node_first_job[node] = job_i;
+        while (job_i < num_jobs && jobs[job_i].node == node)
+        {
+            job_i++;
+        }
+    }
+    node_first_job[num_nodes] = num_jobs;
+    assert(job_i == num_jobs);
+}
+
+// Orders the jobs of a resolve so the threads finish at about the same time, and returns how many jobs there are then.
+// The jobs are grouped by the node that owns their tile, node_first_job (with room for THREAD_POOL_MAX_NODES + 1 entries) tells where each node's start.
+// jobs must have room for a job per coarse block of every tile.
+static int32_t schedule_tile_jobs(tile_job_t* jobs, int32_t num_jobs, int32_t* node_first_job)
+{
+    int32_t num_threads = thread_pool_get_num_threads();
+
+    // one thread resolves everything regardless of the order
+    if (num_threads == 1)
+    {
+        find_node_first_jobs(jobs, num_jobs, node_first_job);
+        return num_jobs;
+    }
+
+    // A tile that costs more than a thread's share of the work would be the only one left running at the end,
+    // so it's split into jobs for consecutive coarse blocks (which are next to each other since blocks are stored in Z-order).
+    // Each job runs all the commands of the tile, but only rasterizes its own blocks.
+    // Not with perfcounters, which are counted per tile.
+#ifndef ENABLE_PERFCOUNTERS
+    uint64_t total_cost = 0;
+    for (int32_t job_i = 0; job_i < num_jobs; job_i++)
+    {
+        total_cost += jobs[job_i].cost;
+    }
+
+    uint64_t cost_per_thread = total_cost / num_threads;
+
+    int32_t num_tile_jobs = num_jobs;
+    for (int32_t job_i = 0; job_i < num_tile_jobs; job_i++)
+    {
+        uint32_t cost = jobs[job_i].cost;
+        if (cost < MIN_SPLIT_TILE_COST_IN_DWORDS || cost <= cost_per_thread)
+        {
+            continue;
+        }
+
+        int32_t coarse_blocks_per_tile = jobs[job_i].fb->coarse_blocks_per_tile;
+
+        int32_t num_parts = 2;
+        while (num_parts < coarse_blocks_per_tile && cost / num_parts > cost_per_thread)
+        {
+            num_parts *= 2;
+        }
+
+        int32_t blocks_per_part = coarse_blocks_per_tile / num_parts;
+        uint64_t part_mask = blocks_per_part == 64 ? ~0ull : (1ull << blocks_per_part) - 1;
+
+        jobs[job_i].coarse_block_mask = part_mask;
+        jobs[job_i].cost = cost / num_parts;
+
+        for (int32_t part_i = 1; part_i < num_parts; part_i++)
+        {
+            jobs[num_jobs] = jobs[job_i];
+            jobs[num_jobs].coarse_block_mask = part_mask << (part_i * blocks_per_part);
+            num_jobs++;
+        }
+    }
+#endif
+
+    // Longest processing time first: the workers take the jobs of their node in order, so starting with the most expensive tiles
+    // keeps a dense tile that would be taken last from running alone while the other threads are done.
+    std::sort(jobs, jobs + num_jobs, [](const tile_job_t& a, const tile_job_t& b)
+    {
+        if (a.node != b.node)
+            return a.node < b.node;
+        return a.cost > b.cost;
+    });
+
+    find_node_first_jobs(jobs, num_jobs, node_first_job);
+
+    return num_jobs;
+}
+
+static void resolve_tile_job(void* userdata, int32_t job_id, int32_t thread_id)
+{
+    const tile_job_t* job = &((const tile_job_t*)userdata)[job_id];
+
+    framebuffer_replay_tile(job->fb, job->tile_id, job->coarse_block_mask, job->first_cmd);
+}
+
+void framebuffer_resolve(framebuffer_t* fb)
+{
+    framebuffer_resolve_many(&fb, 1);
+}
+
+void framebuffer_resolve_many(framebuffer_t* const* fbs, int32_t num_fbs)
+{
+    assert(fbs);
+    assert(num_fbs >= 0);
+
+    if (num_fbs == 0)
+    {
+        return;
+    }
+
+    // the tiles of all the framebuffers are sorted together, so a single framebuffer can use its own scratch memory
+    tile_job_t* jobs = fbs[0]->tile_jobs;
+    if (num_fbs > 1)
+    {
+        int32_t max_num_jobs = 0;
+        for (int32_t fb_i = 0; fb_i < num_fbs; fb_i++)
+        {
+            assert(fbs[fb_i]);
+            max_num_jobs += fbs[fb_i]->total_num_tiles * fbs[fb_i]->coarse_blocks_per_tile;
+        }
+
+        jobs = (tile_job_t*)malloc(max_num_jobs * sizeof(tile_job_t));
+        assert(jobs);
+    }
+
+    int32_t num_jobs = 0;
+    for (int32_t fb_i = 0; fb_i < num_fbs; fb_i++)
+    {
+        assert(fbs[fb_i]);
+        num_jobs += gather_tile_jobs(fbs[fb_i], jobs + num_jobs);
+    }
+
+    int32_t node_first_job[THREAD_POOL_MAX_NODES + 1];
+    num_jobs = schedule_tile_jobs(jobs, num_jobs, node_first_job);
+
+    thread_pool_run_on_nodes(node_first_job, 1, resolve_tile_job, jobs);
+
+    if (jobs != fbs[0]->tile_jobs)
+    {
+        free(jobs);
+    }
+
+    // no more commands refer to any planes
+    for (int32_t fb_i = 0; fb_i < num_fbs; fb_i++)
+    {
+        fbs[fb_i]->num_attribute_planes = 0;
+    }
+}
+
+void framebuffer_resolve_on_calling_thread(framebuffer_t* fb)
+{
+    assert(fb);
+
+    int32_t num_jobs = gather_tile_jobs(fb, fb->tile_jobs);
+    for (int32_t job_id = 0; job_id < num_jobs; job_id++)
+    {
+        resolve_tile_job(fb->tile_jobs, job_id, 0);
+    }
+
+    fb->num_attribute_planes = 0;
+}
+
+// exchanges everything a frame is drawn into: pixels, command buffers, planes and per tile counters
+static void swap_frame_storage(framebuffer_t* a, framebuffer_t* b)
+{
+    std::swap(a->tile_memory, b->tile_memory);
+    std::swap(a->tile_memory_large_pages, b->tile_memory_large_pages);
+    std::swap(a->attachment_memory, b->attachment_memory);
+    std::swap(a->layout, b->layout);
+    std::swap(a->backbuffer, b->backbuffer);
+    std::swap(a->depthbuffer, b->depthbuffer);
+    std::swap(a->visbuffer, b->visbuffer);
+    std::swap(a->attribute_planes, b->attribute_planes);
+    std::swap(a->num_attribute_planes, b->num_attribute_planes);
+    std::swap(a->tile_cmdpool, b->tile_cmdpool);
+    std::swap(a->tile_cmdbufs, b->tile_cmdbufs);
+    std::swap(a->tile_dirty_attachments, b->tile_dirty_attachments);
+    std::swap(a->coarse_block_statistics, b->coarse_block_statistics);
+#ifdef ENABLE_PERFCOUNTERS
+    std::swap(a->tile_perfcounters, b->tile_perfcounters);
+#endif
+}
+
+static void finish_in_flight_frame(framebuffer_t* fb)
+{
+    if (fb->in_flight_fence != 0 && !fb->in_flight_finished)
+    {
+        thread_pool_finish(fb->in_flight_batch);
+        fb->in_flight_finished = 1;
+        fb->in_flight->num_attribute_planes = 0;
+    }
+}
+
+// the last frame whose tiles are all resolved
+static framebuffer_t* framebuffer_get_readable(framebuffer_t* fb)
+{
+    if (!(fb->flags & framebuffer_flag_pipelined))
+    {
+        return fb;
+    }
+
+    if (fb->in_flight_fence != 0 && (fb->in_flight_finished || thread_pool_is_finished(fb->in_flight_batch)))
+    {
+        return fb->in_flight;
+    }
+
+    return fb->completed;
+}
+
+void framebuffer_get_layout(framebuffer_t* fb, framebuffer_layout_t* layout, void** memory)
+{
+    assert(fb);
+    assert(layout);
+
+    framebuffer_t* readable = framebuffer_get_readable(fb);
+
+    *layout = readable->layout;
+
+    if (memory)
+    {
+        *memory = readable->attachment_memory;
+    }
+}
+
+uint64_t framebuffer_submit(framebuffer_t* fb)
+{
+    assert(fb);
+
+    if (!(fb->flags & framebuffer_flag_pipelined))
+    {
+        framebuffer_resolve(fb);
+        return ++fb->last_fence;
+    }
+
+    // one frame in flight at a time: the previous one becomes the completed frame
+    if (fb->in_flight_fence != 0)
+    {
+        finish_in_flight_frame(fb);
+        swap_frame_storage(fb->completed, fb->in_flight);
+        fb->completed_fence = fb->in_flight_fence;
+    }
+
+    // this frame's commands go in flight, and the next frame is drawn over the storage of the frame before the completed one
+    swap_frame_storage(fb->in_flight, fb);
+    fb->num_attribute_planes = 0;
+
+    fb->in_flight_fence = ++fb->last_fence;
+    fb->in_flight_finished = 0;
+    int32_t num_jobs = gather_tile_jobs(fb->in_flight, fb->in_flight->tile_jobs);
+    int32_t node_first_job[THREAD_POOL_MAX_NODES + 1];
+    num_jobs = schedule_tile_jobs(fb->in_flight->tile_jobs, num_jobs, node_first_job);
+    thread_pool_start_on_nodes(fb->in_flight_batch, node_first_job, 1, resolve_tile_job, fb->in_flight->tile_jobs);
+
+    return fb->in_flight_fence;
+}
+
+void framebuffer_wait(framebuffer_t* fb, uint64_t fence)
+{
+    assert(fb);
+    assert(fence <= fb->last_fence);
+
+    if (fence > fb->completed_fence)
+    {
+        finish_in_flight_frame(fb);
+    }
+}
+
+int32_t framebuffer_is_fence_done(framebuffer_t* fb, uint64_t fence)
+{
+    assert(fb);
+    assert(fence <= fb->last_fence);
+
+    if (fence <= fb->completed_fence || !(fb->flags & framebuffer_flag_pipelined))
+    {
+        return 1;
+    }
+
+    return fb->in_flight_finished || thread_pool_is_finished(fb->in_flight_batch);
+}
+
+// Packs a rectangle of the attachment into data, which has dst_pixels_per_row pixels per row.
+static void pack_row_major(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data, int32_t dst_pixels_per_row)
+{
+    const int32_t tile_width = fb->tile_width_in_pixels;
+    const uint32_t tile_x_swizzle_mask = fb->tile_x_swizzle_mask;
+    const uint32_t tile_y_swizzle_mask = fb->tile_y_swizzle_mask;
+
+    int32_t topleft_tile_y = y / tile_width;
+    int32_t topleft_tile_x = x / tile_width;
+    int32_t bottomright_tile_y = (y + (height - 1)) / tile_width;
+    int32_t bottomright_tile_x = (x + (width - 1)) / tile_width;
+
+    int32_t curr_tile_row_start = topleft_tile_y * fb->pixels_per_row_of_tiles + topleft_tile_x * fb->pixels_per_tile;
+    for (int32_t tile_y = topleft_tile_y; tile_y <= bottomright_tile_y; tile_y++)
+    {
+        int32_t curr_tile_start = curr_tile_row_start;
+
+        for (int32_t tile_x = topleft_tile_x; tile_x <= bottomright_tile_x; tile_x++)
+        {
+            int32_t topleft_y = tile_y * tile_width;
+            int32_t topleft_x = tile_x * tile_width;
+            int32_t bottomright_y = topleft_y + tile_width;
+            int32_t bottomright_x = topleft_x + tile_width;
+            int32_t pixel_y_min = topleft_y < y ? y : topleft_y;
+            int32_t pixel_x_min = topleft_x < x ? x : topleft_x;
+            int32_t pixel_y_max = bottomright_y > y + height ? y + height : bottomright_y;
+            int32_t pixel_x_max = bottomright_x > x + width ? x + width : bottomright_x;
+
+            for (int32_t pixel_y = pixel_y_min, pixel_y_bits = pdep_u32(topleft_y, tile_y_swizzle_mask);
+                pixel_y < pixel_y_max;
+                pixel_y++, pixel_y_bits = (pixel_y_bits - tile_y_swizzle_mask) & tile_y_swizzle_mask)
+            {
+                for (int32_t pixel_x = pixel_x_min, pixel_x_bits = pdep_u32(topleft_x, tile_x_swizzle_mask);
+                    pixel_x < pixel_x_max;
+                    pixel_x++, pixel_x_bits = (pixel_x_bits - tile_x_swizzle_mask) & tile_x_swizzle_mask)
+                {
+                    int32_t rel_pixel_y = pixel_y - y;
+                    int32_t rel_pixel_x = pixel_x - x;
+                    int32_t dst_i = rel_pixel_y * dst_pixels_per_row + rel_pixel_x;
+
+                    int32_t src_i = curr_tile_start + (pixel_y_bits | pixel_x_bits);
+                    if (attachment == attachment_color0)
+                    {
+                        uint32_t src = fb->backbuffer[src_i];
+                        if (format == pixelformat_r8g8b8a8_unorm)
+                        {
+                            uint8_t* dst = (uint8_t*)data + dst_i * 4;
+                            dst[0] = (uint8_t)((src & 0x00FF0000) >> 16);
+                            dst[1] = (uint8_t)((src & 0x0000FF00) >> 8);
+                            dst[2] = (uint8_t)((src & 0x000000FF) >> 0);
+                            dst[3] = (uint8_t)((src & 0xFF000000) >> 24);
+                        }
+                        else if (format == pixelformat_b8g8r8a8_unorm)
+                        {
+                            uint8_t* dst = (uint8_t*)data + dst_i * 4;
+                            dst[0] = (uint8_t)((src & 0x000000FF) >> 0);
+                            dst[1] = (uint8_t)((src & 0x0000FF00) >> 8);
+                            dst[2] = (uint8_t)((src & 0x00FF0000) >> 16);
+                            dst[3] = (uint8_t)((src & 0xFF000000) >> 24);
+                        }
+                        else
+                        {
+                            assert(!"Unknown color pixel format");
+                        }
+                    }
+                    else if (attachment == attachment_depth)
+                    {
+                        uint32_t src = fb->depthbuffer[src_i];
+                        if (format == pixelformat_r32_unorm)
+                        {
+                            uint32_t* dst = (uint32_t*)data + dst_i;
+                            *dst = src;
+                        }
+                        else
+                        {
+                            assert(!"Unknown depth pixel format");
+                        }
+                    }
+                    else if (attachment == attachment_visibility)
+                    {
+                        uint32_t src = fb->visbuffer[src_i];
+                        if (format == pixelformat_r32_uint)
+                        {
+                            uint32_t* dst = (uint32_t*)data + dst_i;
+                            *dst = src;
+                        }
+                        else
+                        {
+                            assert(!"Unknown visibility pixel format");
+                        }
+                    }
+                }
+            }
+
+            curr_tile_start += fb->pixels_per_tile;
+        }
+
+        curr_tile_row_start += fb->pixels_per_row_of_tiles;
+    }
+}
+
+void framebuffer_pack_row_major(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data)
+{
+    assert(fb);
+
+    fb = framebuffer_get_readable(fb);
+
+    assert(x >= 0 && x < fb->width_in_pixels);
+    assert(y >= 0 && y < fb->height_in_pixels);
+    assert(width >= 0 && width <= fb->width_in_pixels);
+    assert(height >= 0 && height <= fb->height_in_pixels);
+    assert(x + width <= fb->width_in_pixels);
+    assert(y + height <= fb->height_in_pixels);
+    assert(data);
+    assert(attachment != attachment_color0 || fb->backbuffer);
+    assert(attachment != attachment_visibility || fb->visbuffer);
+
+    pack_row_major(fb, attachment, x, y, width, height, format, data, width);
+}
+
+int32_t framebuffer_pack_dirty_tiles(framebuffer_t* fb, attachment_t attachment, pixelformat_t format, void* data, framebuffer_rect_t* damage_rects)
+{
+    assert(fb);
+
+    fb = framebuffer_get_readable(fb);
+
+    assert(data);
+    assert(damage_rects);
+    assert(attachment != attachment_color0 || fb->backbuffer);
+    assert(attachment != attachment_visibility || fb->visbuffer);
+
+    const int32_t tile_width = fb->tile_width_in_pixels;
+    const uint8_t attachment_bit = (uint8_t)(1 << attachment);
+
+    // runs of dirty tiles along each row of tiles are packed as one rectangle, which also keeps the list short for the encoder
+    int32_t num_rects = 0;
+    for (int32_t tile_y = 0; tile_y < fb->height_in_tiles; tile_y++)
+    {
+        uint8_t* row_dirty_attachments = &fb->tile_dirty_attachments[tile_y * fb->width_in_tiles];
+
+        for (int32_t tile_x = 0; tile_x < fb->width_in_tiles; )
+        {
+            if (!(row_dirty_attachments[tile_x] & attachment_bit))
+            {
+                tile_x++;
+                continue;
+            }
+
+            int32_t first_tile_x = tile_x;
+            while (tile_x < fb->width_in_tiles && (row_dirty_attachments[tile_x] & attachment_bit))
+            {
+                row_dirty_attachments[tile_x] &= ~attachment_bit;
+                tile_x++;
+            }
+
+            // clipped to the framebuffer, since the tiles on the right and bottom edges are padded
+            framebuffer_rect_t* rect = &damage_rects[num_rects++];
+            rect->x = first_tile_x * tile_width;
+            rect->y = tile_y * tile_width;
+            rect->width = (tile_x * tile_width < fb->width_in_pixels ? tile_x * tile_width : fb->width_in_pixels) - rect->x;
+            rect->height = (rect->y + tile_width < fb->height_in_pixels ? rect->y + tile_width : fb->height_in_pixels) - rect->y;
+
+            uint8_t* dst = (uint8_t*)data + ((size_t)rect->y * fb->width_in_pixels + rect->x) * sizeof(uint32_t);
+            pack_row_major(fb, attachment, rect->x, rect->y, rect->width, rect->height, format, dst, fb->width_in_pixels);
+        }
+    }
+
+    return num_rects;
+}
+
+static void framebuffer_shade_tile(framebuffer_t* fb, int32_t tile_id, framebuffer_shader_t shader, void* userdata)
+{
+    // finish rasterizing the tile before shading it
+    framebuffer_resolve_tile(fb, tile_id);
+
+    int32_t tile_x = tile_id % fb->width_in_tiles;
+    int32_t tile_y = tile_id / fb->width_in_tiles;
+    int32_t tile_start_i = fb->pixels_per_tile * tile_id;
+
+    // the pixels of large tiles are shaded in several batches, so the batches fit on the stack whatever the tile size
+    const int32_t pixels_per_batch = DEFAULT_TILE_WIDTH_IN_PIXELS * DEFAULT_TILE_WIDTH_IN_PIXELS;
+
+    for (int32_t batch_start_i = 0; batch_start_i < fb->pixels_per_tile; batch_start_i += pixels_per_batch)
+    {
+        int32_t batch_end_i = batch_start_i + pixels_per_batch < fb->pixels_per_tile ? batch_start_i + pixels_per_batch : fb->pixels_per_tile;
+
+        // gather the covered pixels of the tile, so the shader only sees pixels it needs to shade
+        int32_t pixel_xs[pixels_per_batch];
+        int32_t pixel_ys[pixels_per_batch];
+        uint32_t visibility_ids[pixels_per_batch];
+        uint32_t colors[pixels_per_batch];
+        uint32_t pixel_is[pixels_per_batch];
+        int32_t num_pixels = 0;
+
+        for (int32_t i = batch_start_i; i < batch_end_i; i++)
+        {
+            uint32_t visibility_id = fb->visbuffer[tile_start_i + i];
+            if (visibility_id == VISIBILITY_ID_NONE)
+            {
+                continue;
+            }
+
+            int32_t x = tile_x * fb->tile_width_in_pixels + pext_u32(i, fb->tile_x_swizzle_mask);
+            int32_t y = tile_y * fb->tile_width_in_pixels + pext_u32(i, fb->tile_y_swizzle_mask);
+
+            // skip the padding around the edges of the framebuffer
+            if (x >= fb->width_in_pixels || y >= fb->height_in_pixels)
+            {
+                continue;
+            }
+
+            pixel_xs[num_pixels] = x;
+            pixel_ys[num_pixels] = y;
+            visibility_ids[num_pixels] = visibility_id;
+            pixel_is[num_pixels] = tile_start_i + i;
+            num_pixels++;
+        }
+
+        if (num_pixels == 0)
+        {
+            continue;
+        }
+
+        shader(userdata, num_pixels, pixel_xs, pixel_ys, visibility_ids, colors);
+
+        for (int32_t i = 0; i < num_pixels; i++)
+        {
+            fb->backbuffer[pixel_is[i]] = colors[i];
+        }
+
+        fb->tile_dirty_attachments[tile_id] |= 1 << attachment_color0;
+    }
+}
+
+typedef struct shade_t
+{
+    const tile_job_t* jobs;
+    framebuffer_shader_t shader;
+    void* userdata;
+} shade_t;
+
+static void shade_tile_job(void* userdata, int32_t job_id, int32_t thread_id)
+{
+    const shade_t* shade = (const shade_t*)userdata;
+    const tile_job_t* job = &shade->jobs[job_id];
+
+    framebuffer_shade_tile(job->fb, job->tile_id, shade->shader, shade->userdata);
+}
+
+void framebuffer_shade(framebuffer_t* fb, framebuffer_shader_t shader, void* userdata)
+{
+    assert(fb);
+    assert(fb->flags & framebuffer_flag_visibility_buffer);
+    assert(shader);
+
+    framebuffer_resolve(fb);
+
+    // tiles are independent, so each one is a job, on the node that owns it
+    int32_t num_jobs = 0;
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        if (fb->scissor_enabled && !fb->tile_in_scissor[tile_id])
+        {
+            continue;
+        }
+
+        fb->tile_jobs[num_jobs].fb = fb;
+        fb->tile_jobs[num_jobs].tile_id = tile_id;
+        fb->tile_jobs[num_jobs].node = get_tile_node(fb, tile_id);
+        num_jobs++;
+    }
+
+    shade_t shade;
+    shade.jobs = fb->tile_jobs;
+    shade.shader = shader;
+    shade.userdata = userdata;
+
+    int32_t node_first_job[THREAD_POOL_MAX_NODES + 1];
+    find_node_first_jobs(fb->tile_jobs, num_jobs, node_first_job);
+
+    thread_pool_run_on_nodes(node_first_job, 1, shade_tile_job, &shade);
+
+    fb->num_attribute_planes = 0;
+}
+
+command_list_t* new_command_list()
+{
+    command_list_t* cl = (command_list_t*)malloc(sizeof(command_list_t));
+    assert(cl);
+
+    cl->flags = 0;
+    cl->width_in_pixels = 0;
+    cl->height_in_pixels = 0;
+    cl->dwords = NULL;
+    cl->num_dwords = 0;
+    cl->dwords_capacity = 0;
+    cl->attribute_planes = NULL;
+    cl->num_attribute_planes = 0;
+    cl->attribute_planes_capacity = 0;
+
+    return cl;
+}
+
+void delete_command_list(command_list_t* cl)
+{
+    if (!cl)
+        return;
+
+    free(cl->dwords);
+    free(cl->attribute_planes);
+    free(cl);
+}
+
+void framebuffer_begin_command_list(framebuffer_t* fb, command_list_t* cl)
+{
+    assert(fb);
+    assert(cl);
+    assert(!fb->recording);
+    assert(!fb->capturing);
+
+    cl->flags = fb->flags & ~COMMAND_LIST_IGNORED_FLAGS;
+    cl->width_in_pixels = fb->width_in_pixels;
+    cl->height_in_pixels = fb->height_in_pixels;
+    cl->num_dwords = 0;
+    cl->num_attribute_planes = 0;
+
+    fb->recording = cl;
+}
+
+void framebuffer_end_command_list(framebuffer_t* fb)
+{
+    assert(fb);
+    assert(fb->recording);
+
+    fb->recording = NULL;
+}
+
+// on_calling_thread: whether flushes when the planes run out resolve on the calling thread, like framebuffer_resolve_on_calling_thread
+static void execute_command_list(framebuffer_t* fb, const command_list_t* cl, bool on_calling_thread)
+{
+    assert(fb);
+    assert(cl);
+    assert(!fb->recording);
+    assert(cl->flags == (fb->flags & ~COMMAND_LIST_IGNORED_FLAGS));
+    assert(cl->width_in_pixels == fb->width_in_pixels && cl->height_in_pixels == fb->height_in_pixels);
+
+    // planes of the list are copied to the framebuffer when the first command of their triangle is pushed
+    uint32_t list_planes_id = 0xFFFFFFFF;
+    uint32_t fb_planes_id = 0;
+
+    for (size_t dword_i = 0; dword_i < cl->num_dwords; )
+    {
+        int32_t tile_id = (int32_t)cl->dwords[dword_i];
+        int32_t num_dwords = (int32_t)cl->dwords[dword_i + 1];
+        const uint32_t* cmd = &cl->dwords[dword_i + 2];
+        dword_i += 2 + num_dwords;
+
+        size_t planes_offset = get_tilecmd_attribute_planes_offset(cmd);
+        if (planes_offset == 0)
+        {
+            framebuffer_push_tilecmd(fb, tile_id, cmd, num_dwords);
+            continue;
+        }
+
+        if (cmd[planes_offset] != list_planes_id)
+        {
+            if (fb->num_attribute_planes == MAX_ATTRIBUTE_PLANES)
+            {
+                // all planes are in use by commands, so flush them all
+                if (on_calling_thread)
+                    framebuffer_resolve_on_calling_thread(fb);
+                else
+                    framebuffer_resolve(fb);
+            }
+
+            list_planes_id = cmd[planes_offset];
+            fb_planes_id = fb->num_attribute_planes;
+            fb->num_attribute_planes++;
+            fb->attribute_planes[fb_planes_id] = cl->attribute_planes[list_planes_id];
+        }
+
+        uint32_t rebased_cmd[sizeof(tilecmd_drawtile_t) / sizeof(uint32_t)];
+        assert(num_dwords <= (int32_t)(sizeof(rebased_cmd) / sizeof(uint32_t)));
+        memcpy(rebased_cmd, cmd, num_dwords * sizeof(uint32_t));
+        rebased_cmd[planes_offset] = fb_planes_id;
+
+        framebuffer_push_tilecmd(fb, tile_id, rebased_cmd, num_dwords);
+    }
+}
+
+void framebuffer_execute_command_list(framebuffer_t* fb, const command_list_t* cl)
+{
+    execute_command_list(fb, cl, false);
+}
+
+void framebuffer_execute_command_list_on_calling_thread(framebuffer_t* fb, const command_list_t* cl)
+{
+    execute_command_list(fb, cl, true);
+}
+
+void command_list_get_framebuffer_info(const command_list_t* cl, int32_t* width, int32_t* height, uint32_t* flags)
+{
+    assert(cl);
+
+    if (width)
+        *width = cl->width_in_pixels;
+    if (height)
+        *height = cl->height_in_pixels;
+    if (flags)
+        *flags = cl->flags;
+}
+
+void framebuffer_begin_capture(framebuffer_t* fb, command_list_t* cl)
+{
+    assert(fb);
+    assert(cl);
+    assert(!fb->recording);
+    assert(!fb->capturing);
+
+    cl->flags = fb->flags & ~COMMAND_LIST_IGNORED_FLAGS;
+    cl->width_in_pixels = fb->width_in_pixels;
+    cl->height_in_pixels = fb->height_in_pixels;
+    cl->num_dwords = 0;
+    cl->num_attribute_planes = 0;
+
+    fb->capturing = cl;
+}
+
+void framebuffer_end_capture(framebuffer_t* fb)
+{
+    assert(fb);
+    assert(fb->capturing);
+
+    fb->capturing = NULL;
+}
+
+// "TCL1" in the first bytes of the file
+#define COMMAND_LIST_FILE_MAGIC 0x314C4354
+
+// Command list files are the header, then the dwords of the commands, then the planes.
+// Texture pointers mean nothing to another process, so planes are saved with whether they had a texture instead.
+typedef struct command_list_file_header_t
+{
+    uint32_t magic;
+    uint32_t flags;
+    int32_t width_in_pixels;
+    int32_t height_in_pixels;
+    uint64_t num_dwords;
+    uint32_t num_attribute_planes;
+    uint32_t padding;
+} command_list_file_header_t;
+
+typedef struct command_list_file_planes_t
+{
+    uint8_t planes[offsetof(attribute_planes_t, texture)];
+    uint32_t has_texture;
+} command_list_file_planes_t;
+
+int32_t save_command_list(const command_list_t* cl, const char* filename)
+{
+    assert(cl);
+    assert(filename);
+
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Error opening command list file %s\n", filename);
+        return 0;
+    }
+
+    command_list_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = COMMAND_LIST_FILE_MAGIC;
+    header.flags = cl->flags;
+    header.width_in_pixels = cl->width_in_pixels;
+    header.height_in_pixels = cl->height_in_pixels;
+    header.num_dwords = cl->num_dwords;
+    header.num_attribute_planes = cl->num_attribute_planes;
+
+    int32_t ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(cl->dwords, sizeof(uint32_t), cl->num_dwords, f) == cl->num_dwords;
+
+    for (uint32_t planes_id = 0; ok && planes_id < cl->num_attribute_planes; planes_id++)
+    {
+        command_list_file_planes_t file_planes;
+        memcpy(file_planes.planes, &cl->attribute_planes[planes_id], sizeof(file_planes.planes));
+        file_planes.has_texture = cl->attribute_planes[planes_id].texture != NULL;
+        ok = fwrite(&file_planes, sizeof(file_planes), 1, f) == 1;
+    }
+
+    fclose(f);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Error writing command list file %s\n", filename);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Whether a loaded command is one that framebuffer_push_tilecmd could have queued in a framebuffer with these flags:
+// the size that goes with its id, and a pixel stage and depth function that the framebuffer supports like framebuffer_set_pixel_stage checks.
+static bool is_valid_loaded_tilecmd(uint32_t flags, const uint32_t* cmd, uint32_t num_dwords, uint32_t num_attribute_planes)
+{
+    uint32_t tilecmd_id = cmd[0] & TILECMD_ID_MASK;
+
+    if (tilecmd_id == tilecmd_id_cleartile)
+    {
+        return num_dwords == sizeof(tilecmd_cleartile_t) / sizeof(uint32_t);
+    }
+
+    // resetbufs are only ever written by the ring buffers themselves
+    if (tilecmd_id == tilecmd_id_drawsmalltri)
+    {
+        if (num_dwords != sizeof(tilecmd_drawsmalltri_t) / sizeof(uint32_t))
+            return false;
+    }
+    else if (tilecmd_id >= tilecmd_id_drawlargetri_0edgemask && tilecmd_id <= tilecmd_id_drawlargetri_7edgemask)
+    {
+        if (num_dwords != sizeof(tilecmd_drawtile_t) / sizeof(uint32_t))
+            return false;
+    }
+    else
+    {
+        return false;
+    }
+
+    uint32_t pixel_stage = (cmd[0] >> TILECMD_PIXEL_STAGE_SHIFT) & TILECMD_PIXEL_STAGE_MASK;
+    uint32_t depth_func = (cmd[0] >> TILECMD_DEPTH_FUNC_SHIFT) & TILECMD_DEPTH_FUNC_MASK;
+
+    if (pixel_stage > pixel_stage_textured || depth_func > depth_func_always)
+    {
+        return false;
+    }
+
+    bool has_backbuffer = !(flags & framebuffer_flag_depth_only);
+    bool has_visbuffer = (flags & framebuffer_flag_visibility_buffer) != 0;
+    if (!(pixel_stage == pixel_stage_depth_only || pixel_stage == pixel_stage_visibility_id || has_backbuffer) ||
+        (pixel_stage == pixel_stage_visibility_id && !has_visbuffer))
+    {
+        return false;
+    }
+
+    size_t planes_offset = get_tilecmd_attribute_planes_offset(cmd);
+    return planes_offset == 0 || cmd[planes_offset] < num_attribute_planes;
+}
+
+command_list_t* load_command_list(const char* filename, const texture_t* texture)
+{
+    assert(filename);
+
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Error opening command list file %s\n", filename);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    // the flags new_framebuffer_with_flags accepts, besides COMMAND_LIST_IGNORED_FLAGS which aren't saved
+    const uint32_t kValidFlags = framebuffer_flag_depth_only | framebuffer_flag_visibility_buffer | framebuffer_flag_reversed_z |
+        framebuffer_flag_tile_width_32 | framebuffer_flag_tile_width_128;
+
+    command_list_file_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != COMMAND_LIST_FILE_MAGIC ||
+        header.width_in_pixels <= 0 || header.width_in_pixels >= 16384 || header.height_in_pixels <= 0 || header.height_in_pixels >= 16384 ||
+        (header.flags & ~kValidFlags) != 0 ||
+        ((header.flags & framebuffer_flag_depth_only) && (header.flags & framebuffer_flag_visibility_buffer)) ||
+        ((header.flags & framebuffer_flag_tile_width_32) && (header.flags & framebuffer_flag_tile_width_128)))
+    {
+        fprintf(stderr, "Error loading command list file %s: not a command list\n", filename);
+        fclose(f);
+        return NULL;
+    }
+
+    // checked before allocating anything, so a corrupt header can't ask for all the memory
+    uint64_t expected_file_size = sizeof(header) + header.num_dwords * sizeof(uint32_t) + (uint64_t)header.num_attribute_planes * sizeof(command_list_file_planes_t);
+    if (file_size < 0 || header.num_dwords > (uint64_t)file_size || (uint64_t)file_size != expected_file_size)
+    {
+        fprintf(stderr, "Error loading command list file %s: truncated\n", filename);
+        fclose(f);
+        return NULL;
+    }
+
+    command_list_t* cl = new_command_list();
+    cl->flags = header.flags;
+    cl->width_in_pixels = header.width_in_pixels;
+    cl->height_in_pixels = header.height_in_pixels;
+
+    cl->dwords_capacity = header.num_dwords ? (size_t)header.num_dwords : 1;
+    cl->dwords = (uint32_t*)malloc(cl->dwords_capacity * sizeof(uint32_t));
+    assert(cl->dwords);
+    cl->num_dwords = fread(cl->dwords, sizeof(uint32_t), (size_t)header.num_dwords, f);
+
+    cl->attribute_planes_capacity = header.num_attribute_planes ? header.num_attribute_planes : 1;
+    cl->attribute_planes = (attribute_planes_t*)malloc(cl->attribute_planes_capacity * sizeof(attribute_planes_t));
+    assert(cl->attribute_planes);
+
+    for (uint32_t planes_id = 0; planes_id < header.num_attribute_planes; planes_id++)
+    {
+        command_list_file_planes_t file_planes;
+        if (fread(&file_planes, sizeof(file_planes), 1, f) != 1)
+        {
+            break;
+        }
+
+        memcpy(&cl->attribute_planes[planes_id], file_planes.planes, sizeof(file_planes.planes));
+        cl->attribute_planes[planes_id].texture = file_planes.has_texture ? texture : NULL;
+        cl->num_attribute_planes++;
+    }
+
+    fclose(f);
+
+    if (cl->num_dwords != header.num_dwords || cl->num_attribute_planes != header.num_attribute_planes)
+    {
+        fprintf(stderr, "Error loading command list file %s: truncated\n", filename);
+        delete_command_list(cl);
+        return NULL;
+    }
+
+    // the commands are run as they are, so check that they stay in the framebuffer and its planes
+    int32_t tile_width = get_tile_width_from_flags(cl->flags);
+    int32_t total_num_tiles = ((cl->width_in_pixels + tile_width - 1) / tile_width) * ((cl->height_in_pixels + tile_width - 1) / tile_width);
+
+    for (size_t dword_i = 0; dword_i < cl->num_dwords; )
+    {
+        uint32_t tile_id = cl->dwords[dword_i];
+        uint32_t num_dwords = dword_i + 1 < cl->num_dwords ? cl->dwords[dword_i + 1] : 0;
+
+        int32_t valid = tile_id < (uint32_t)total_num_tiles &&
+            num_dwords >= 1 && num_dwords <= sizeof(tilecmd_drawtile_t) / sizeof(uint32_t) &&
+            dword_i + 2 + num_dwords <= cl->num_dwords;
+
+        const uint32_t* cmd = valid ? &cl->dwords[dword_i + 2] : NULL;
+
+        valid = valid && is_valid_loaded_tilecmd(cl->flags, cmd, num_dwords, cl->num_attribute_planes);
+
+        if (!valid)
+        {
+            fprintf(stderr, "Error loading command list file %s: invalid command at dword %zu\n", filename, dword_i);
+            delete_command_list(cl);
+            return NULL;
+        }
+
+        pixel_stage_t pixel_stage = (pixel_stage_t)((cmd[0] >> TILECMD_PIXEL_STAGE_SHIFT) & TILECMD_PIXEL_STAGE_MASK);
+        if (pixel_stage == pixel_stage_textured && !texture)
+        {
+            fprintf(stderr, "Error loading command list file %s: it has textured draws, but no texture to draw them with\n", filename);
+            delete_command_list(cl);
+            return NULL;
+        }
 
-            // since the resolve made read ptr catch up to write ptr, that means read reached the end
-            // that also means it currently looped back to the start, so the write ptr can be put there too
-            // this is the case where the whole buffer gets consumed in one go
+        // textured draws sample the texture of their planes, which the file must say they had
+        if (pixel_stage == pixel_stage_textured && !cl->attribute_planes[cmd[get_tilecmd_attribute_planes_offset(cmd)]].texture)
+        {
+            fprintf(stderr, "Error loading command list file %s: textured command without a texture at dword %zu\n", filename, dword_i);
+            delete_command_list(cl);
+            return NULL;
         }
 
-        cmdbuf->cmdbuf_write = cmdbuf->cmdbuf_start;
+        dword_i += 2 + num_dwords;
     }
 
-    // DEBUGGING: Always flush. Helpful since it gives you a straight call stack through the command list.
-    // framebuffer_resolve_tile(fb, tile_id);
+    return cl;
 }
 
-void framebuffer_resolve(framebuffer_t* fb)
+void framebuffer_clear(framebuffer_t* fb, uint32_t color)
 {
-    assert(fb);
+    tilecmd_cleartile_t tilecmd;
+    tilecmd.tilecmd_id = tilecmd_id_cleartile;
+    tilecmd.color = color;
 
-    int32_t tile_i = 0;
-    for (int32_t tile_y = 0; tile_y < fb->height_in_tiles; tile_y++)
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
     {
-        for (int32_t tile_x = 0; tile_x < fb->width_in_tiles; tile_x++)
-        {
-            framebuffer_resolve_tile(fb, tile_i);
-            tile_i++;
-        }
+        framebuffer_push_tilecmd(fb, tile_id, &tilecmd.tilecmd_id, sizeof(tilecmd) / sizeof(uint32_t));
     }
 }
 
-void framebuffer_pack_row_major(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data)
+// interpolates the varyings of two vertices by t in s15.16 (0 gives v0, 1 gives v1)
+static vertex_varyings_t lerp_varyings(const vertex_varyings_t* v0, const vertex_varyings_t* v1, int32_t t)
 {
-    assert(fb);
-    assert(x >= 0 && x < fb->width_in_pixels);
-    assert(y >= 0 && y < fb->height_in_pixels);
-    assert(width >= 0 && width <= fb->width_in_pixels);
-    assert(height >= 0 && height <= fb->height_in_pixels);
-    assert(x + width <= fb->width_in_pixels);
-    assert(y + height <= fb->height_in_pixels);
-    assert(data);
+    vertex_varyings_t varyings;
 
-    int32_t topleft_tile_y = y / TILE_WIDTH_IN_PIXELS;
-    int32_t topleft_tile_x = x / TILE_WIDTH_IN_PIXELS;
-    int32_t bottomright_tile_y = (y + (height - 1)) / TILE_WIDTH_IN_PIXELS;
-    int32_t bottomright_tile_x = (x + (width - 1)) / TILE_WIDTH_IN_PIXELS;
+    varyings.color = 0;
+    for (int32_t shift = 0; shift < 32; shift += 8)
+    {
+        int32_t ch0 = (v0->color >> shift) & 0xFF;
+        int32_t ch1 = (v1->color >> shift) & 0xFF;
+        varyings.color |= (uint32_t)(ch0 + s1516_mul(ch1 - ch0, t)) << shift;
+    }
 
-    int32_t curr_tile_row_start = topleft_tile_y * fb->pixels_per_row_of_tiles + topleft_tile_x * PIXELS_PER_TILE;
-    for (int32_t tile_y = topleft_tile_y; tile_y <= bottomright_tile_y; tile_y++)
+    // clip space is before the perspective divide, so attributes are linear in it
+    float ft = (float)t / 65536.0f;
+    for (int32_t i = 0; i < RASTERIZER_MAX_VERTEX_ATTRIBUTES; i++)
     {
-        int32_t curr_tile_start = curr_tile_row_start;
+        varyings.attributes[i] = v0->attributes[i] + (v1->attributes[i] - v0->attributes[i]) * ft;
+    }
 
-        for (int32_t tile_x = topleft_tile_x; tile_x <= bottomright_tile_x; tile_x++)
-        {
-            int32_t topleft_y = tile_y * TILE_WIDTH_IN_PIXELS;
-            int32_t topleft_x = tile_x * TILE_WIDTH_IN_PIXELS;
-            int32_t bottomright_y = topleft_y + TILE_WIDTH_IN_PIXELS;
-            int32_t bottomright_x = topleft_x + TILE_WIDTH_IN_PIXELS;
-            int32_t pixel_y_min = topleft_y < y ? y : topleft_y;
-            int32_t pixel_x_min = topleft_x < x ? x : topleft_x;
-            int32_t pixel_y_max = bottomright_y > y + height ? y + height : bottomright_y;
-            int32_t pixel_x_max = bottomright_x > x + width ? x + width : bottomright_x;
+    return varyings;
+}
 
-            for (int32_t pixel_y = pixel_y_min, pixel_y_bits = pdep_u32(topleft_y, TILE_Y_SWIZZLE_MASK);
-                pixel_y < pixel_y_max;
-                pixel_y++, pixel_y_bits = (pixel_y_bits - TILE_Y_SWIZZLE_MASK) & TILE_Y_SWIZZLE_MASK)
-            {
-                for (int32_t pixel_x = pixel_x_min, pixel_x_bits = pdep_u32(topleft_x, TILE_X_SWIZZLE_MASK);
-                    pixel_x < pixel_x_max;
-                    pixel_x++, pixel_x_bits = (pixel_x_bits - TILE_X_SWIZZLE_MASK) & TILE_X_SWIZZLE_MASK)
-                {
-                    int32_t rel_pixel_y = pixel_y - y;
-                    int32_t rel_pixel_x = pixel_x - x;
-                    int32_t dst_i = rel_pixel_y * width + rel_pixel_x;
+// allocates and computes the perspective-correct attribute planes of a triangle
+static uint32_t setup_attribute_planes(framebuffer_t* fb, const xyzw_i32_t verts[3], const vertex_varyings_t varyings[3])
+{
+    assert(fb->attribute_planes);
 
-                    int32_t src_i = curr_tile_start + (pixel_y_bits | pixel_x_bits);
-                    if (attachment == attachment_color0)
-                    {
-                        uint32_t src = fb->backbuffer[src_i];
-                        if (format == pixelformat_r8g8b8a8_unorm)
-                        {
-                            uint8_t* dst = (uint8_t*)data + dst_i * 4;
-                            dst[0] = (uint8_t)((src & 0x00FF0000) >> 16);
-                            dst[1] = (uint8_t)((src & 0x0000FF00) >> 8);
-                            dst[2] = (uint8_t)((src & 0x000000FF) >> 0);
-                            dst[3] = (uint8_t)((src & 0xFF000000) >> 24);
-                        }
-                        else if (format == pixelformat_b8g8r8a8_unorm)
-                        {
-                            uint8_t* dst = (uint8_t*)data + dst_i * 4;
-                            dst[0] = (uint8_t)((src & 0x000000FF) >> 0);
-                            dst[1] = (uint8_t)((src & 0x0000FF00) >> 8);
-                            dst[2] = (uint8_t)((src & 0x00FF0000) >> 16);
-                            dst[3] = (uint8_t)((src & 0xFF000000) >> 24);
-                        }
-                        else
-                        {
-                            assert(!"Unknown color pixel format");
-                        }
-                    }
-                    else if (attachment == attachment_depth)
-                    {
-                        uint32_t src = fb->depthbuffer[src_i];
-                        if (format == pixelformat_r32_unorm)
-                        {
-                            uint32_t* dst = (uint32_t*)data + dst_i;
-                            *dst = src;
-                        }
-                        else
-                        {
-                            assert(!"Unknown depth pixel format");
-                        }
-                    }
-                }
-            }
+    uint32_t planes_id;
+    attribute_planes_t* planes;
 
-            curr_tile_start += PIXELS_PER_TILE;
+    if (fb->recording)
+    {
+        // recorded commands keep their planes in the command list
+        command_list_t* cl = fb->recording;
+        if (cl->num_attribute_planes == cl->attribute_planes_capacity)
+        {
+            cl->attribute_planes_capacity = cl->attribute_planes_capacity ? cl->attribute_planes_capacity * 2 : 256;
+            cl->attribute_planes = (attribute_planes_t*)realloc(cl->attribute_planes, cl->attribute_planes_capacity * sizeof(attribute_planes_t));
+            assert(cl->attribute_planes);
         }
 
-        curr_tile_row_start += fb->pixels_per_row_of_tiles;
+        planes_id = cl->num_attribute_planes;
+        cl->num_attribute_planes++;
+        planes = &cl->attribute_planes[planes_id];
     }
-}
+    else
+    {
+        if (fb->num_attribute_planes == MAX_ATTRIBUTE_PLANES)
+        {
+            // all planes are in use by commands, so flush them all
+            framebuffer_resolve(fb);
+        }
 
-void framebuffer_clear(framebuffer_t* fb, uint32_t color)
-{
-    tilecmd_cleartile_t tilecmd;
-    tilecmd.tilecmd_id = tilecmd_id_cleartile;
-    tilecmd.color = color;
+        planes_id = fb->num_attribute_planes;
+        fb->num_attribute_planes++;
+        planes = &fb->attribute_planes[planes_id];
+    }
 
-    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    // w is s15.16, but only ratios of it matter
+    float one_over_w[3];
+    for (int32_t v = 0; v < 3; v++)
     {
-        framebuffer_push_tilecmd(fb, tile_id, &tilecmd.tilecmd_id, sizeof(tilecmd) / sizeof(uint32_t));
+        one_over_w[v] = 1.0f / (float)verts[v].w;
+    }
+
+    // the barycentrics reach 0xFFFF at their vertex, so scale the gradients down to match
+    const float kOneOverMaxBarycentric = 1.0f / 0xFFFF;
+
+    planes->one_over_w[0] = one_over_w[0];
+    planes->one_over_w[1] = (one_over_w[1] - one_over_w[0]) * kOneOverMaxBarycentric;
+    planes->one_over_w[2] = (one_over_w[2] - one_over_w[0]) * kOneOverMaxBarycentric;
+
+    for (int32_t i = 0; i < RASTERIZER_MAX_VERTEX_ATTRIBUTES; i++)
+    {
+        float a0 = varyings[0].attributes[i] * one_over_w[0];
+        float a1 = varyings[1].attributes[i] * one_over_w[1];
+        float a2 = varyings[2].attributes[i] * one_over_w[2];
+        planes->attribute_over_w[i][0] = a0;
+        planes->attribute_over_w[i][1] = (a1 - a0) * kOneOverMaxBarycentric;
+        planes->attribute_over_w[i][2] = (a2 - a0) * kOneOverMaxBarycentric;
     }
+
+    // gradients of the barycentrics of vertices 1 and 2, per pixel, in the same fixed point units as the kernels
+    float x0 = (float)verts[0].x / 256.0f, y0 = (float)verts[0].y / 256.0f;
+    float x1 = (float)verts[1].x / 256.0f, y1 = (float)verts[1].y / 256.0f;
+    float x2 = (float)verts[2].x / 256.0f, y2 = (float)verts[2].y / 256.0f;
+    float area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+    float scale = area != 0.0f ? (float)0xFFFF / area : 0.0f;
+    planes->barycentric_dxs[0] = (y2 - y0) * scale;
+    planes->barycentric_dys[0] = -(x2 - x0) * scale;
+    planes->barycentric_dxs[1] = -(y1 - y0) * scale;
+    planes->barycentric_dys[1] = (x1 - x0) * scale;
+
+    planes->texture = fb->texture;
+
+    return planes_id;
 }
 
 static void rasterize_triangle(
     framebuffer_t* fb,
-    xyzw_i32_t clipVerts[3])
+    xyzw_i32_t clipVerts[3],
+    vertex_varyings_t clipVaryings[3],
+    uint32_t visibility_id)
 {
 #ifdef ENABLE_PERFCOUNTERS
     uint64_t clipping_start_pc = qpc();
@@ -2194,6 +4376,7 @@ static void rasterize_triangle(
             clipVerts[v1].z = 0;
             clipVerts[v1].w = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
             assert(clipVerts[v1].w != 0);
+            clipVaryings[v1] = lerp_varyings(&clipVaryings[unclipped_vert], &clipVaryings[v1], a1);
 
             // clip the second edge
             int32_t a2 = s1516_div(clipVerts[unclipped_vert].z, clipVerts[unclipped_vert].z - clipVerts[v2].z);
@@ -2203,6 +4386,7 @@ static void rasterize_triangle(
             clipVerts[v2].z = 0;
             clipVerts[v2].w = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
             assert(clipVerts[v2].w != 0);
+            clipVaryings[v2] = lerp_varyings(&clipVaryings[unclipped_vert], &clipVaryings[v2], a2);
         }
 
         if (num_near_clipped == 1)
@@ -2224,6 +4408,7 @@ static void rasterize_triangle(
             clipped1.z = 0;
             clipped1.w = s1516_mul(one_minus_a1, clipVerts[clipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
             assert(clipped1.w != 0);
+            vertex_varyings_t clippedVaryings1 = lerp_varyings(&clipVaryings[clipped_vert], &clipVaryings[v1], a1);
 
             // clip the second edge
             xyzw_i32_t clipped2;
@@ -2234,16 +4419,19 @@ static void rasterize_triangle(
             clipped2.z = 0;
             clipped2.w = s1516_mul(one_minus_a2, clipVerts[clipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
             assert(clipped2.w != 0);
+            vertex_varyings_t clippedVaryings2 = lerp_varyings(&clipVaryings[clipped_vert], &clipVaryings[v2], a2);
 
             // output the first clipped triangle (note: recursive call)
             xyzw_i32_t clipVerts1[3] = { clipVerts[0], clipVerts[1], clipVerts[2] };
             clipVerts1[clipped_vert] = clipped1;
+            vertex_varyings_t clipVaryings1[3] = { clipVaryings[0], clipVaryings[1], clipVaryings[2] };
+            clipVaryings1[clipped_vert] = clippedVaryings1;
 
 #ifdef ENABLE_PERFCOUNTERS
             fb->perfcounters.clipping += qpc() - clipping_start_pc;
 #endif
 
-            rasterize_triangle(fb, clipVerts1);
+            rasterize_triangle(fb, clipVerts1, clipVaryings1, visibility_id);
             
 #ifdef ENABLE_PERFCOUNTERS
             clipping_start_pc = qpc();
@@ -2252,6 +4440,8 @@ static void rasterize_triangle(
             // set self up to output the second clipped triangle
             clipVerts[clipped_vert] = clipped2;
             clipVerts[v1] = clipped1;
+            clipVaryings[clipped_vert] = clippedVaryings2;
+            clipVaryings[v1] = clippedVaryings1;
         }
     }
 
@@ -2290,6 +4480,7 @@ static void rasterize_triangle(
             clipVerts[v1].w = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
             clipVerts[v1].z = clipVerts[v1].w - 1;
             assert(clipVerts[v1].w != 0);
+            clipVaryings[v1] = lerp_varyings(&clipVaryings[unclipped_vert], &clipVaryings[v1], a1);
 
             // clip the second edge
             int32_t a2 = s1516_div(clipVerts[unclipped_vert].z - clipVerts[unclipped_vert].w, (clipVerts[unclipped_vert].z - clipVerts[unclipped_vert].w) - (clipVerts[v2].z - clipVerts[v2].w));
@@ -2299,6 +4490,7 @@ static void rasterize_triangle(
             clipVerts[v2].w = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
             clipVerts[v2].z = clipVerts[v2].w - 1;
             assert(clipVerts[v2].w != 0);
+            clipVaryings[v2] = lerp_varyings(&clipVaryings[unclipped_vert], &clipVaryings[v2], a2);
         }
 
         if (num_far_clipped == 1)
@@ -2320,6 +4512,7 @@ static void rasterize_triangle(
             clipped1.w = s1516_mul(one_minus_a1, clipVerts[clipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
             clipped1.z = clipped1.w - 1;
             assert(clipped1.w != 0);
+            vertex_varyings_t clippedVaryings1 = lerp_varyings(&clipVaryings[clipped_vert], &clipVaryings[v1], a1);
 
             // clip the second edge
             xyzw_i32_t clipped2;
@@ -2330,16 +4523,19 @@ static void rasterize_triangle(
             clipped2.w = s1516_mul(one_minus_a2, clipVerts[clipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
             clipped2.z = clipped2.w - 1;
             assert(clipped2.w != 0);
+            vertex_varyings_t clippedVaryings2 = lerp_varyings(&clipVaryings[clipped_vert], &clipVaryings[v2], a2);
 
             // output the first clipped triangle (note: recursive call)
             xyzw_i32_t clipVerts1[3] = { clipVerts[0], clipVerts[1], clipVerts[2] };
             clipVerts1[clipped_vert] = clipped1;
+            vertex_varyings_t clipVaryings1[3] = { clipVaryings[0], clipVaryings[1], clipVaryings[2] };
+            clipVaryings1[clipped_vert] = clippedVaryings1;
 
 #ifdef ENABLE_PERFCOUNTERS
             fb->perfcounters.clipping += qpc() - clipping_start_pc;
 #endif
 
-            rasterize_triangle(fb, clipVerts1);
+            rasterize_triangle(fb, clipVerts1, clipVaryings1, visibility_id);
             
 #ifdef ENABLE_PERFCOUNTERS
             clipping_start_pc = qpc();
@@ -2348,6 +4544,8 @@ static void rasterize_triangle(
             // set self up to output the second clipped triangle
             clipVerts[clipped_vert] = clipped2;
             clipVerts[v1] = clipped1;
+            clipVaryings[clipped_vert] = clippedVaryings2;
+            clipVaryings[v1] = clippedVaryings1;
         }
     }
 
@@ -2434,10 +4632,12 @@ clipping_end:
     if (clamped_bbox_max_x >= (int32_t)(fb->width_in_pixels << 8)) clamped_bbox_max_x = ((int32_t)fb->width_in_pixels << 8) - 1;
     if (clamped_bbox_max_y >= (int32_t)(fb->height_in_pixels << 8)) clamped_bbox_max_y = ((int32_t)fb->height_in_pixels << 8) - 1;
 
-    // "small" triangles are no wider than a tile.
+    // "small" triangles are no wider than a tile (or than MAX_SMALLTRI_WIDTH_IN_PIXELS).
     int32_t is_large =
-        (bbox_max_x - bbox_min_x) >= (TILE_WIDTH_IN_PIXELS << 8) ||
-        (bbox_max_y - bbox_min_y) >= (TILE_WIDTH_IN_PIXELS << 8);
+        (bbox_max_x - bbox_min_x) >= (fb->max_smalltri_width_in_pixels << 8) ||
+        (bbox_max_y - bbox_min_y) >= (fb->max_smalltri_width_in_pixels << 8);
+
+    int32_t tile_width = fb->tile_width_in_pixels;
 
 commonsetup_end:
 
@@ -2454,21 +4654,47 @@ commonsetup_end:
     uint64_t setup_start_pc = qpc();
 #endif
 
+    // inputs of the pixel stage, shared by all the commands of the triangle
+    pixel_stage_data_t stage_data;
+    if (fb->pixel_stage == pixel_stage_flat_color)
+    {
+        stage_data.flat_color = fb->flat_color;
+    }
+    else if (fb->pixel_stage == pixel_stage_vertex_color)
+    {
+        stage_data.vert_colors[0] = clipVaryings[0].color;
+        stage_data.vert_colors[1] = clipVaryings[1].color;
+        stage_data.vert_colors[2] = clipVaryings[2].color;
+    }
+    else if (fb->pixel_stage == pixel_stage_attribute_color || fb->pixel_stage == pixel_stage_textured)
+    {
+        stage_data.attribute_planes_id = setup_attribute_planes(fb, verts, clipVaryings);
+    }
+    else
+    {
+        stage_data.visibility_id = visibility_id;
+    }
+
+    // the state the kernels are specialized for goes in the high bits of the tile command ids
+    uint32_t draw_state_bits = ((uint32_t)fb->pixel_stage << TILECMD_PIXEL_STAGE_SHIFT) | ((uint32_t)fb->depth_func << TILECMD_DEPTH_FUNC_SHIFT);
+    if (fb->depth_write)
+        draw_state_bits |= TILECMD_DEPTH_WRITE_BIT;
+
     if (!is_large)
     {
         // since this is a small triangle, that means the triangle is smaller than a tile.
         // that means it can overlap at most 2x2 adjacent tiles if it's in the middle of all of them.
         // just need to figure out which boxes are overlapping the triangle's bbox
-        int32_t first_tile_x = (bbox_min_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_y = (bbox_min_y >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_x = (bbox_max_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_y = (bbox_max_y >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_x = (bbox_min_x >> 8) / tile_width;
+        int32_t first_tile_y = (bbox_min_y >> 8) / tile_width;
+        int32_t last_tile_x = (bbox_max_x >> 8) / tile_width;
+        int32_t last_tile_y = (bbox_max_y >> 8) / tile_width;
         
         // pixel coordinates of the first and last tile of the (up to) 2x2 block of tiles
-        int32_t first_tile_px_x = (first_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_px_y = (first_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_px_x = (last_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_px_y = (last_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_px_x = (first_tile_x << 8) * tile_width;
+        int32_t first_tile_px_y = (first_tile_y << 8) * tile_width;
+        int32_t last_tile_px_x = (last_tile_x << 8) * tile_width;
+        int32_t last_tile_px_y = (last_tile_y << 8) * tile_width;
 
         // range of coarse blocks affected (relative to top left of 2x2 tile block)
         int32_t first_rel_cb_x = ((bbox_min_x - first_tile_px_x) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
@@ -2477,14 +4703,15 @@ commonsetup_end:
         int32_t last_rel_cb_y = ((bbox_max_y - first_tile_px_y) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
 
         tilecmd_drawsmalltri_t drawsmalltricmd;
-        drawsmalltricmd.tilecmd_id = tilecmd_id_drawsmalltri;
+        drawsmalltricmd.tilecmd_id = tilecmd_id_drawsmalltri | draw_state_bits;
+        drawsmalltricmd.stage = stage_data;
 
         // make vertices relative to the last tile they're in
         for (int32_t v = 0; v < 3; v++)
         {
             // the point of making them relative is to lower the required precision to 4 hex digits
-            assert((verts[v].x - last_tile_px_x) >= (-TILE_WIDTH_IN_PIXELS << 8) && (verts[v].x - last_tile_px_x) <= ((TILE_WIDTH_IN_PIXELS << 8) - 1));
-            assert((verts[v].y - last_tile_px_y) >= (-TILE_WIDTH_IN_PIXELS << 8) && (verts[v].y - last_tile_px_y) <= ((TILE_WIDTH_IN_PIXELS << 8) - 1));
+            assert((verts[v].x - last_tile_px_x) >= (-tile_width << 8) && (verts[v].x - last_tile_px_x) <= ((tile_width << 8) - 1));
+            assert((verts[v].y - last_tile_px_y) >= (-tile_width << 8) && (verts[v].y - last_tile_px_y) <= ((tile_width << 8) - 1));
 
             verts[v].x -= last_tile_px_x;
             verts[v].y -= last_tile_px_y;
@@ -2605,7 +4832,7 @@ commonsetup_end:
             {
                 drawsmalltricmd.edges[v] = edges[v] + (
                     edge_dxs[v] * (first_tile_x - last_tile_x) +
-                    edge_dys[v] * (first_tile_y - last_tile_y)) * TILE_WIDTH_IN_PIXELS;
+                    edge_dys[v] * (first_tile_y - last_tile_y)) * tile_width;
             }
 
 #ifdef ENABLE_PERFCOUNTERS
@@ -2625,7 +4852,7 @@ commonsetup_end:
         {
             for (int32_t v = 0; v < 3; v++)
             {
-                drawsmalltricmd.edges[v] = edges[v] + edge_dys[v] * (first_tile_y - last_tile_y) * TILE_WIDTH_IN_PIXELS;
+                drawsmalltricmd.edges[v] = edges[v] + edge_dys[v] * (first_tile_y - last_tile_y) * tile_width;
             }
 
             int32_t tile_id_right = first_tile_id + 1;
@@ -2647,7 +4874,7 @@ commonsetup_end:
         {
             for (int32_t v = 0; v < 3; v++)
             {
-                drawsmalltricmd.edges[v] = edges[v] + edge_dxs[v] * (first_tile_x - last_tile_x) * TILE_WIDTH_IN_PIXELS;
+                drawsmalltricmd.edges[v] = edges[v] + edge_dxs[v] * (first_tile_x - last_tile_x) * tile_width;
             }
 
             int32_t tile_id_down = first_tile_id + fb->width_in_tiles;
@@ -2689,14 +4916,14 @@ commonsetup_end:
     {
         // for large triangles, test each tile in their bbox for overlap
         // done using scalar code for simplicity, since rasterization dominates large triangle performance anyways.
-        int32_t first_tile_x = (clamped_bbox_min_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_y = (clamped_bbox_min_y >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_x = (clamped_bbox_max_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_y = (clamped_bbox_max_y >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_x = (clamped_bbox_min_x >> 8) / tile_width;
+        int32_t first_tile_y = (clamped_bbox_min_y >> 8) / tile_width;
+        int32_t last_tile_x = (clamped_bbox_max_x >> 8) / tile_width;
+        int32_t last_tile_y = (clamped_bbox_max_y >> 8) / tile_width;
 
         // evaluate edge equation at the top left tile
-        int32_t first_tile_px_x = (first_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_px_y = (first_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_px_x = (first_tile_x << 8) * tile_width;
+        int32_t first_tile_px_y = (first_tile_y << 8) * tile_width;
 
         // 64 bit integers are used for the edge equations here because multiplying two 16.8 numbers requires up to 48 bits
         // this results in some extra overhead, but it's not a big deal when you consider that this happens only for large triangles.
@@ -2797,8 +5024,8 @@ commonsetup_end:
         int64_t tile_edge_dys[3];
         for (int32_t v = 0; v < 3; v++)
         {
-            tile_edge_dxs[v] = edge_dxs[v] * TILE_WIDTH_IN_PIXELS;
-            tile_edge_dys[v] = edge_dys[v] * TILE_WIDTH_IN_PIXELS;
+            tile_edge_dxs[v] = edge_dxs[v] * tile_width;
+            tile_edge_dys[v] = edge_dys[v] * tile_width;
         }
 
         int64_t edge_trivRejs[3];
@@ -2847,6 +5074,7 @@ commonsetup_end:
                     drawtilecmd.tilecmd_id += edge_needs_test[0];
                     drawtilecmd.tilecmd_id += edge_needs_test[1] << 1;
                     drawtilecmd.tilecmd_id += edge_needs_test[2] << 2;
+                    drawtilecmd.tilecmd_id |= draw_state_bits;
 
                     for (int32_t v = 0; v < 3; v++)
                     {
@@ -2893,6 +5121,7 @@ commonsetup_end:
                     drawtilecmd.shifted_triarea2 = triarea2_mantissa >> 1;
                     drawtilecmd.rcp_triarea2_mantissa = rcp_triarea2_mantissa;
                     drawtilecmd.rcp_triarea2_rshift = rcp_triarea2_mantissa_rshift;
+                    drawtilecmd.stage = stage_data;
 
 #ifdef ENABLE_PERFCOUNTERS
                     fb->perfcounters.largetri_setup += qpc() - setup_start_pc;
@@ -2938,6 +5167,128 @@ setup_end:;
     }
 } 
 
+void framebuffer_set_pixel_stage(framebuffer_t* fb, pixel_stage_t stage)
+{
+    assert(fb);
+    assert(stage == pixel_stage_depth_only || stage == pixel_stage_visibility_id || fb->backbuffer);
+    assert(stage != pixel_stage_visibility_id || fb->visbuffer);
+
+    fb->pixel_stage = stage;
+}
+
+pixel_stage_t framebuffer_get_pixel_stage(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->pixel_stage;
+}
+
+void framebuffer_set_depth_func(framebuffer_t* fb, depth_func_t func)
+{
+    assert(fb);
+    assert(func >= depth_func_less && func <= depth_func_always);
+
+    fb->depth_func = func;
+}
+
+void framebuffer_set_depth_write(framebuffer_t* fb, int32_t enabled)
+{
+    assert(fb);
+
+    fb->depth_write = enabled;
+}
+
+void framebuffer_set_tile_scissor(framebuffer_t* fb, int32_t num_rects, const framebuffer_rect_t* rects)
+{
+    assert(fb);
+
+    if (!rects)
+    {
+        fb->scissor_enabled = 0;
+        return;
+    }
+
+    assert(num_rects >= 0);
+
+    fb->scissor_enabled = 1;
+    memset(fb->tile_in_scissor, 0, fb->total_num_tiles * sizeof(uint8_t));
+
+    const int32_t tile_width = fb->tile_width_in_pixels;
+    for (int32_t rect_i = 0; rect_i < num_rects; rect_i++)
+    {
+        const framebuffer_rect_t* rect = &rects[rect_i];
+
+        // clipped to the framebuffer, padding included
+        int32_t first_tile_x = rect->x < 0 ? 0 : rect->x / tile_width;
+        int32_t first_tile_y = rect->y < 0 ? 0 : rect->y / tile_width;
+        int32_t end_tile_x = (rect->x + rect->width + tile_width - 1) / tile_width;
+        int32_t end_tile_y = (rect->y + rect->height + tile_width - 1) / tile_width;
+        end_tile_x = end_tile_x > fb->width_in_tiles ? fb->width_in_tiles : end_tile_x;
+        end_tile_y = end_tile_y > fb->height_in_tiles ? fb->height_in_tiles : end_tile_y;
+
+        for (int32_t tile_y = first_tile_y; tile_y < end_tile_y; tile_y++)
+        {
+            for (int32_t tile_x = first_tile_x; tile_x < end_tile_x; tile_x++)
+            {
+                fb->tile_in_scissor[tile_y * fb->width_in_tiles + tile_x] = 1;
+            }
+        }
+    }
+}
+
+void framebuffer_set_flat_color(framebuffer_t* fb, uint32_t color)
+{
+    assert(fb);
+
+    fb->flat_color = color;
+}
+
+void framebuffer_set_vertex_colors(framebuffer_t* fb, const uint32_t* colors)
+{
+    assert(fb);
+
+    fb->vertex_colors = colors;
+}
+
+void framebuffer_set_vertex_attributes(framebuffer_t* fb, const float* attributes, int32_t num_attributes)
+{
+    assert(fb);
+    assert(num_attributes >= 0 && num_attributes <= RASTERIZER_MAX_VERTEX_ATTRIBUTES);
+
+    fb->vertex_attributes = attributes;
+    fb->num_vertex_attributes = num_attributes;
+}
+
+void framebuffer_set_texture(framebuffer_t* fb, const texture_t* tex)
+{
+    assert(fb);
+
+    fb->texture = tex;
+}
+
+// gets what the current pixel stage interpolates for a vertex
+static void fetch_varyings(framebuffer_t* fb, uint32_t vertex_id, vertex_varyings_t* varyings)
+{
+    varyings->color = 0;
+    if (fb->pixel_stage == pixel_stage_vertex_color)
+    {
+        varyings->color = fb->vertex_colors[vertex_id];
+    }
+
+    // missing attributes are (0, 0, 0, 1)
+    varyings->attributes[0] = 0.0f;
+    varyings->attributes[1] = 0.0f;
+    varyings->attributes[2] = 0.0f;
+    varyings->attributes[3] = 1.0f;
+    if (fb->pixel_stage == pixel_stage_attribute_color || fb->pixel_stage == pixel_stage_textured)
+    {
+        const float* attributes = &fb->vertex_attributes[vertex_id * fb->num_vertex_attributes];
+        for (int32_t i = 0; i < fb->num_vertex_attributes; i++)
+        {
+            varyings->attributes[i] = attributes[i];
+        }
+    }
+}
+
 void framebuffer_draw(
     framebuffer_t* fb,
     const int32_t* vertices,
@@ -2946,6 +5297,9 @@ void framebuffer_draw(
     assert(fb);
     assert(vertices);
     assert(num_vertices % 3 == 0);
+    assert(fb->pixel_stage != pixel_stage_vertex_color || fb->vertex_colors);
+    assert(fb->pixel_stage != pixel_stage_attribute_color || fb->vertex_attributes);
+    assert(fb->pixel_stage != pixel_stage_textured || (fb->vertex_attributes && fb->num_vertex_attributes >= 2 && fb->texture));
 
     for (uint32_t vertex_id = 0, cmpt_id = 0; vertex_id < num_vertices; vertex_id += 3, cmpt_id += 12)
     {
@@ -2964,7 +5318,12 @@ void framebuffer_draw(
         verts[2].z = vertices[cmpt_id + 10];
         verts[2].w = vertices[cmpt_id + 11];
 
-        rasterize_triangle(fb, verts);
+        vertex_varyings_t varyings[3];
+        fetch_varyings(fb, vertex_id + 0, &varyings[0]);
+        fetch_varyings(fb, vertex_id + 1, &varyings[1]);
+        fetch_varyings(fb, vertex_id + 2, &varyings[2]);
+
+        rasterize_triangle(fb, verts, varyings, vertex_id / 3);
     }
 }
 
@@ -2973,11 +5332,24 @@ void framebuffer_draw_indexed(
     const int32_t* vertices,
     const uint32_t* indices,
     uint32_t num_indices)
+{
+    framebuffer_draw_indexed_with_ids(fb, vertices, indices, num_indices, 0);
+}
+
+void framebuffer_draw_indexed_with_ids(
+    framebuffer_t* fb,
+    const int32_t* vertices,
+    const uint32_t* indices,
+    uint32_t num_indices,
+    uint32_t first_visibility_id)
 {
     assert(fb);
     assert(vertices);
     assert(indices);
     assert(num_indices % 3 == 0);
+    assert(fb->pixel_stage != pixel_stage_vertex_color || fb->vertex_colors);
+    assert(fb->pixel_stage != pixel_stage_attribute_color || fb->vertex_attributes);
+    assert(fb->pixel_stage != pixel_stage_textured || (fb->vertex_attributes && fb->num_vertex_attributes >= 2 && fb->texture));
 
     for (uint32_t index_id = 0; index_id < num_indices; index_id += 3)
     {
@@ -3000,7 +5372,12 @@ void framebuffer_draw_indexed(
         verts[2].z = vertices[cmpt_i2 + 2];
         verts[2].w = vertices[cmpt_i2 + 3];
 
-        rasterize_triangle(fb, verts);
+        vertex_varyings_t varyings[3];
+        fetch_varyings(fb, indices[index_id + 0], &varyings[0]);
+        fetch_varyings(fb, indices[index_id + 1], &varyings[1]);
+        fetch_varyings(fb, indices[index_id + 2], &varyings[2]);
+
+        rasterize_triangle(fb, verts, varyings, first_visibility_id + index_id / 3);
     }
 }
 
@@ -3010,6 +5387,30 @@ int32_t framebuffer_get_total_num_tiles(framebuffer_t* fb)
     return fb->total_num_tiles;
 }
 
+int32_t framebuffer_get_width(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->width_in_pixels;
+}
+
+int32_t framebuffer_get_height(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->height_in_pixels;
+}
+
+int32_t framebuffer_get_tile_width(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->tile_width_in_pixels;
+}
+
+int32_t framebuffer_get_large_pages(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->tile_memory_large_pages;
+}
+
 uint64_t framebuffer_get_perfcounter_frequency(framebuffer_t* fb)
 {
     assert(fb);
@@ -3085,7 +5486,67 @@ void framebuffer_get_tile_perfcounters(framebuffer_t* fb, uint64_t* tile_pcs)
     assert(fb);
     assert(tile_pcs);
 
+    fb = framebuffer_get_readable(fb);
+
 #ifdef ENABLE_PERFCOUNTERS
     memcpy(tile_pcs, fb->tile_perfcounters, sizeof(framebuffer_tile_perfcounters_t) * fb->total_num_tiles);
 #endif
+}
+
+void framebuffer_reset_statistics(framebuffer_t* fb)
+{
+    assert(fb);
+
+    memset(fb->coarse_block_statistics, 0, fb->total_num_tiles * fb->coarse_blocks_per_tile * sizeof(coarse_block_statistics_t));
+}
+
+int32_t framebuffer_get_num_statistics(framebuffer_t* fb)
+{
+    assert(fb);
+
+    return sizeof(framebuffer_statistics_t) / sizeof(uint64_t);
+}
+
+void framebuffer_get_statistics(framebuffer_t* fb, uint64_t* stats)
+{
+    assert(fb);
+    assert(stats);
+
+    fb = framebuffer_get_readable(fb);
+
+    framebuffer_statistics_t total;
+    memset(&total, 0, sizeof(total));
+
+    for (int32_t block_i = 0; block_i < fb->total_num_tiles * fb->coarse_blocks_per_tile; block_i++)
+    {
+        const uint64_t* block_stats = (const uint64_t*)&fb->coarse_block_statistics[block_i].statistics;
+        uint64_t* total_stats = (uint64_t*)&total;
+        for (int32_t i = 0; i < (int32_t)(sizeof(framebuffer_statistics_t) / sizeof(uint64_t)); i++)
+        {
+            total_stats[i] += block_stats[i];
+        }
+    }
+
+    memcpy(stats, &total, sizeof(framebuffer_statistics_t));
+}
+
+void framebuffer_get_statistic_names(framebuffer_t* fb, const char** names)
+{
+    assert(fb);
+    assert(names);
+
+    memcpy(names, kFramebufferStatisticNames, sizeof(kFramebufferStatisticNames));
+}
+
+void rasterizer_run_jobs(int32_t num_jobs, rasterizer_job_t job, void* userdata)
+{
+    assert(num_jobs >= 0);
+    assert(job);
+
+    thread_pool_run(num_jobs, job, userdata);
+}
+
+int32_t rasterizer_get_num_threads()
+{
+    return thread_pool_get_num_threads();
 }
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include <rasterizer.h>
+
+#include "texture.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+static int32_t log2_of_power_of_two(int32_t x)
+{
+    assert(x > 0 && (x & (x - 1)) == 0);
+
+    int32_t log2 = 0;
+    while ((1 << log2) < x)
+    {
+        log2++;
+    }
+    return log2;
+}
+
+// Averages 2x2 texels (or 2x1/1x2 once a side is down to 1) of a row major level into the next one
+static void downsample_level(const uint32_t* src, int32_t src_width, int32_t src_height, uint32_t* dst, int32_t dst_width, int32_t dst_height)
+{
+    int32_t step_x = src_width > dst_width ? 2 : 1;
+    int32_t step_y = src_height > dst_height ? 2 : 1;
+
+    for (int32_t y = 0; y < dst_height; y++)
+    {
+        for (int32_t x = 0; x < dst_width; x++)
+        {
+            uint32_t sums[4] = { 0, 0, 0, 0 };
+            for (int32_t sy = 0; sy < step_y; sy++)
+            {
+                for (int32_t sx = 0; sx < step_x; sx++)
+                {
+                    uint32_t texel = src[(y * step_y + sy) * src_width + (x * step_x + sx)];
+                    for (int32_t c = 0; c < 4; c++)
+                    {
+                        sums[c] += (texel >> (c * 8)) & 0xFF;
+                    }
+                }
+            }
+
+            int32_t count = step_x * step_y;
+            uint32_t texel = 0;
+            for (int32_t c = 0; c < 4; c++)
+            {
+                texel |= ((sums[c] + count / 2) / count) << (c * 8);
+            }
+            dst[y * dst_width + x] = texel;
+        }
+    }
+}
+
+texture_t* new_texture(int32_t width, int32_t height, const uint32_t* texels)
+{
+    assert(texels);
+
+    texture_t* tex = (texture_t*)malloc(sizeof(texture_t));
+    assert(tex);
+
+    tex->log2_width = log2_of_power_of_two(width);
+    tex->log2_height = log2_of_power_of_two(height);
+
+    int32_t max_log2 = tex->log2_width > tex->log2_height ? tex->log2_width : tex->log2_height;
+    tex->num_levels = max_log2 + 1;
+    assert(tex->num_levels <= TEXTURE_MAX_NUM_LEVELS);
+
+    int32_t total_num_texels = 0;
+    for (int32_t level = 0; level < tex->num_levels; level++)
+    {
+        int32_t level_width = width >> level > 0 ? width >> level : 1;
+        int32_t level_height = height >> level > 0 ? height >> level : 1;
+        tex->level_offsets[level] = total_num_texels;
+        total_num_texels += level_width * level_height;
+    }
+
+    tex->texels = (uint32_t*)_aligned_malloc(total_num_texels * sizeof(uint32_t), 32);
+    assert(tex->texels);
+
+    // the mips are built row major, then swizzled into place
+    uint32_t* level_texels = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+    assert(level_texels);
+    memcpy(level_texels, texels, width * height * sizeof(uint32_t));
+
+    uint32_t* next_level_texels = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+    assert(next_level_texels);
+
+    for (int32_t level = 0; level < tex->num_levels; level++)
+    {
+        int32_t level_log2_width = tex->log2_width - level > 0 ? tex->log2_width - level : 0;
+        int32_t level_log2_height = tex->log2_height - level > 0 ? tex->log2_height - level : 0;
+        int32_t level_width = 1 << level_log2_width;
+        int32_t level_height = 1 << level_log2_height;
+
+        uint32_t* dst = &tex->texels[tex->level_offsets[level]];
+        for (int32_t y = 0; y < level_height; y++)
+        {
+            for (int32_t x = 0; x < level_width; x++)
+            {
+                dst[texture_texel_index(level_log2_width, level_log2_height, x, y)] = level_texels[y * level_width + x];
+            }
+        }
+
+        if (level + 1 < tex->num_levels)
+        {
+            int32_t next_width = level_width > 1 ? level_width / 2 : 1;
+            int32_t next_height = level_height > 1 ? level_height / 2 : 1;
+            downsample_level(level_texels, level_width, level_height, next_level_texels, next_width, next_height);
+
+            uint32_t* tmp = level_texels;
+            level_texels = next_level_texels;
+            next_level_texels = tmp;
+        }
+    }
+
+    free(next_level_texels);
+    free(level_texels);
+
+    return tex;
+}
+
+void delete_texture(texture_t* tex)
+{
+    if (!tex)
+        return;
+
+    _aligned_free(tex->texels);
+    free(tex);
+}
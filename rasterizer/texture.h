@@ -0,0 +1,212 @@
+#pragma once
+
+// Texture storage and sampling, used by the pixel stages of the rasterizer.
+// Like the framebuffer, texels are stored in morton order so that bilinear footprints and neighboring pixels
+// tend to land in the same cache lines, whatever the orientation of the triangle.
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+
+// enough for a 32768x32768 texture
+#define TEXTURE_MAX_NUM_LEVELS 16
+
+typedef struct texture_t
+{
+    int32_t log2_width;
+    int32_t log2_height;
+
+    // the mip chain goes down to 1x1
+    int32_t num_levels;
+
+    // offset of the first texel of each level in texels
+    int32_t level_offsets[TEXTURE_MAX_NUM_LEVELS];
+
+    // 0xAARRGGBB, all levels back to back.
+    // Within a level, the low bits of x and y are interleaved (x in even bits, y in odd bits),
+    // and the remaining bits of the longer side (if any) go on top. Non-square levels are a row or column of morton squares.
+    uint32_t* texels;
+} texture_t;
+
+// Spreads the low 16 bits of x to the even bits
+static __forceinline uint32_t texture_spread_bits(uint32_t x)
+{
+    x &= 0x0000FFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// Index of a texel relative to the start of its level. x and y must be inside the level.
+static __forceinline uint32_t texture_texel_index(int32_t level_log2_width, int32_t level_log2_height, uint32_t x, uint32_t y)
+{
+    int32_t log2_min = level_log2_width < level_log2_height ? level_log2_width : level_log2_height;
+    uint32_t low_mask = (1 << log2_min) - 1;
+    return texture_spread_bits(x & low_mask) | (texture_spread_bits(y & low_mask) << 1) | (((x | y) >> log2_min) << (2 * log2_min));
+}
+
+// Lerps the 4 channels of two texels, f is the weight of b in [0,256]
+static __forceinline uint32_t texture_lerp_texels(uint32_t a, uint32_t b, uint32_t f)
+{
+    // two channels per 32 bits, each with 16 bits of room for the products
+    uint32_t rb = (((a & 0x00FF00FF) * (256 - f) + (b & 0x00FF00FF) * f) >> 8) & 0x00FF00FF;
+    uint32_t ag = (((a >> 8) & 0x00FF00FF) * (256 - f) + ((b >> 8) & 0x00FF00FF) * f) & 0xFF00FF00;
+    return rb | ag;
+}
+
+// Mip level from the derivatives of the texture coordinates along x and y (in pixels).
+// Uses the larger footprint side, rounded to the nearest level.
+static __forceinline int32_t texture_select_level(const texture_t* tex, float dsdx, float dtdx, float dsdy, float dtdy)
+{
+    float width = (float)(1 << tex->log2_width);
+    float height = (float)(1 << tex->log2_height);
+
+    float rho_x = fabsf(dsdx) * width > fabsf(dtdx) * height ? fabsf(dsdx) * width : fabsf(dtdx) * height;
+    float rho_y = fabsf(dsdy) * width > fabsf(dtdy) * height ? fabsf(dsdy) * width : fabsf(dtdy) * height;
+    float rho = rho_x > rho_y ? rho_x : rho_y;
+
+    // floor(log2(rho) + 0.5), straight from the exponent
+    rho *= 1.41421356f;
+    int32_t rho_bits;
+    memcpy(&rho_bits, &rho, sizeof(rho_bits));
+    int32_t level = (rho_bits >> 23) - 127;
+
+    if (level < 0) level = 0;
+    if (level > tex->num_levels - 1) level = tex->num_levels - 1;
+    return level;
+}
+
+// Bilinear sample of a level, with wrapping. s and t are normalized texture coordinates.
+static __forceinline uint32_t texture_sample_bilinear(const texture_t* tex, int32_t level, float s, float t)
+{
+    int32_t log2_width = tex->log2_width - level > 0 ? tex->log2_width - level : 0;
+    int32_t log2_height = tex->log2_height - level > 0 ? tex->log2_height - level : 0;
+
+    // texel centers are at half coordinates
+    float x = s * (float)(1 << log2_width) - 0.5f;
+    float y = t * (float)(1 << log2_height) - 0.5f;
+    float floor_x = floorf(x);
+    float floor_y = floorf(y);
+    uint32_t fx = (uint32_t)((x - floor_x) * 256.0f);
+    uint32_t fy = (uint32_t)((y - floor_y) * 256.0f);
+
+    // power of two sizes wrap with a mask, also for negative coordinates
+    uint32_t width_mask = (1 << log2_width) - 1;
+    uint32_t height_mask = (1 << log2_height) - 1;
+    uint32_t x0 = (uint32_t)(int32_t)floor_x & width_mask;
+    uint32_t y0 = (uint32_t)(int32_t)floor_y & height_mask;
+    uint32_t x1 = (x0 + 1) & width_mask;
+    uint32_t y1 = (y0 + 1) & height_mask;
+
+    const uint32_t* texels = &tex->texels[tex->level_offsets[level]];
+    uint32_t t00 = texels[texture_texel_index(log2_width, log2_height, x0, y0)];
+    uint32_t t10 = texels[texture_texel_index(log2_width, log2_height, x1, y0)];
+    uint32_t t01 = texels[texture_texel_index(log2_width, log2_height, x0, y1)];
+    uint32_t t11 = texels[texture_texel_index(log2_width, log2_height, x1, y1)];
+
+    return texture_lerp_texels(texture_lerp_texels(t00, t10, fx), texture_lerp_texels(t01, t11, fx), fy);
+}
+
+#ifdef USE_HSWni
+static __forceinline __m256i texture_spread_bits_avx2(__m256i x)
+{
+    x = _mm256_and_si256(x, _mm256_set1_epi32(0x0000FFFF));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 8)), _mm256_set1_epi32(0x00FF00FF));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 4)), _mm256_set1_epi32(0x0F0F0F0F));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 2)), _mm256_set1_epi32(0x33333333));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 1)), _mm256_set1_epi32(0x55555555));
+    return x;
+}
+
+static __forceinline __m256i texture_texel_index_avx2(__m256i level_log2_width, __m256i level_log2_height, __m256i x, __m256i y)
+{
+    __m256i log2_min = _mm256_min_epi32(level_log2_width, level_log2_height);
+    __m256i low_mask = _mm256_sub_epi32(_mm256_sllv_epi32(_mm256_set1_epi32(1), log2_min), _mm256_set1_epi32(1));
+    __m256i index = texture_spread_bits_avx2(_mm256_and_si256(x, low_mask));
+    index = _mm256_or_si256(index, _mm256_slli_epi32(texture_spread_bits_avx2(_mm256_and_si256(y, low_mask)), 1));
+    index = _mm256_or_si256(index, _mm256_sllv_epi32(_mm256_srlv_epi32(_mm256_or_si256(x, y), log2_min), _mm256_add_epi32(log2_min, log2_min)));
+    return index;
+}
+
+// f is the weight of b in [0,256], in both 16 bit halves of each lane
+static __forceinline __m256i texture_lerp_texels_avx2(__m256i a, __m256i b, __m256i f)
+{
+    const __m256i kChannelMask = _mm256_set1_epi32(0x00FF00FF);
+    __m256i one_minus_f = _mm256_sub_epi16(_mm256_set1_epi16(256), f);
+
+    __m256i rb = _mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_and_si256(a, kChannelMask), one_minus_f),
+        _mm256_mullo_epi16(_mm256_and_si256(b, kChannelMask), f));
+    rb = _mm256_and_si256(_mm256_srli_epi32(rb, 8), kChannelMask);
+
+    __m256i ag = _mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(a, 8), kChannelMask), one_minus_f),
+        _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(b, 8), kChannelMask), f));
+    ag = _mm256_and_si256(ag, _mm256_set1_epi32(0xFF00FF00));
+
+    return _mm256_or_si256(rb, ag);
+}
+
+// 8-wide texture_select_level
+static __forceinline __m256i texture_select_level_avx2(const texture_t* tex, __m256 dsdx, __m256 dtdx, __m256 dsdy, __m256 dtdy)
+{
+    const __m256 kAbsMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 width = _mm256_set1_ps((float)(1 << tex->log2_width));
+    __m256 height = _mm256_set1_ps((float)(1 << tex->log2_height));
+
+    __m256 rho_x = _mm256_max_ps(_mm256_mul_ps(_mm256_and_ps(dsdx, kAbsMask), width), _mm256_mul_ps(_mm256_and_ps(dtdx, kAbsMask), height));
+    __m256 rho_y = _mm256_max_ps(_mm256_mul_ps(_mm256_and_ps(dsdy, kAbsMask), width), _mm256_mul_ps(_mm256_and_ps(dtdy, kAbsMask), height));
+    __m256 rho = _mm256_mul_ps(_mm256_max_ps(rho_x, rho_y), _mm256_set1_ps(1.41421356f));
+
+    __m256i level = _mm256_sub_epi32(_mm256_srai_epi32(_mm256_castps_si256(rho), 23), _mm256_set1_epi32(127));
+    level = _mm256_max_epi32(level, _mm256_setzero_si256());
+    level = _mm256_min_epi32(level, _mm256_set1_epi32(tex->num_levels - 1));
+    return level;
+}
+
+// 8-wide texture_sample_bilinear, each lane with its own level
+static __forceinline __m256i texture_sample_bilinear_avx2(const texture_t* tex, __m256i level, __m256 s, __m256 t)
+{
+    __m256i log2_width = _mm256_max_epi32(_mm256_sub_epi32(_mm256_set1_epi32(tex->log2_width), level), _mm256_setzero_si256());
+    __m256i log2_height = _mm256_max_epi32(_mm256_sub_epi32(_mm256_set1_epi32(tex->log2_height), level), _mm256_setzero_si256());
+    __m256i width = _mm256_sllv_epi32(_mm256_set1_epi32(1), log2_width);
+    __m256i height = _mm256_sllv_epi32(_mm256_set1_epi32(1), log2_height);
+
+    // texel centers are at half coordinates
+    __m256 x = _mm256_fmsub_ps(s, _mm256_cvtepi32_ps(width), _mm256_set1_ps(0.5f));
+    __m256 y = _mm256_fmsub_ps(t, _mm256_cvtepi32_ps(height), _mm256_set1_ps(0.5f));
+    __m256 floor_x = _mm256_floor_ps(x);
+    __m256 floor_y = _mm256_floor_ps(y);
+    __m256i fx = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(x, floor_x), _mm256_set1_ps(256.0f)));
+    __m256i fy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(y, floor_y), _mm256_set1_ps(256.0f)));
+
+    // replicate the weights to both 16 bit halves for the lerps
+    fx = _mm256_or_si256(fx, _mm256_slli_epi32(fx, 16));
+    fy = _mm256_or_si256(fy, _mm256_slli_epi32(fy, 16));
+
+    // power of two sizes wrap with a mask, also for negative coordinates
+    __m256i width_mask = _mm256_sub_epi32(width, _mm256_set1_epi32(1));
+    __m256i height_mask = _mm256_sub_epi32(height, _mm256_set1_epi32(1));
+    __m256i x0 = _mm256_and_si256(_mm256_cvttps_epi32(floor_x), width_mask);
+    __m256i y0 = _mm256_and_si256(_mm256_cvttps_epi32(floor_y), height_mask);
+    __m256i x1 = _mm256_and_si256(_mm256_add_epi32(x0, _mm256_set1_epi32(1)), width_mask);
+    __m256i y1 = _mm256_and_si256(_mm256_add_epi32(y0, _mm256_set1_epi32(1)), height_mask);
+
+    __m256i level_offset = _mm256_i32gather_epi32((const int*)tex->level_offsets, level, 4);
+    const int* texels = (const int*)tex->texels;
+    __m256i t00 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(level_offset, texture_texel_index_avx2(log2_width, log2_height, x0, y0)), 4);
+    __m256i t10 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(level_offset, texture_texel_index_avx2(log2_width, log2_height, x1, y0)), 4);
+    __m256i t01 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(level_offset, texture_texel_index_avx2(log2_width, log2_height, x0, y1)), 4);
+    __m256i t11 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(level_offset, texture_texel_index_avx2(log2_width, log2_height, x1, y1)), 4);
+
+    return texture_lerp_texels_avx2(texture_lerp_texels_avx2(t00, t10, fx), texture_lerp_texels_avx2(t01, t11, fx), fy);
+}
+#endif
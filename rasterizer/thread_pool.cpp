@@ -0,0 +1,459 @@
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#endif
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// where a thread of the pool runs
+typedef struct thread_pool_core_t
+{
+    int32_t node;
+
+#ifdef _WIN32
+    // the single core the thread is pinned to, or a Mask of 0 when it isn't pinned
+    GROUP_AFFINITY affinity;
+#endif
+} thread_pool_core_t;
+
+typedef struct thread_pool_t
+{
+    std::vector<std::thread> workers;
+
+    // one per thread id, grouped by node. The calling thread (id 0) isn't pinned, it's just counted as part of node 0.
+    std::vector<thread_pool_core_t> cores;
+    int32_t num_nodes;
+
+    // workers of each node, which doesn't count the calling thread
+    int32_t node_num_workers[THREAD_POOL_MAX_NODES];
+
+    // guards the list of batches, and their num_workers
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+
+    // oldest first
+    thread_pool_batch_t* first_batch;
+    thread_pool_batch_t* last_batch;
+} thread_pool_t;
+
+// set while the thread runs jobs, so that calls from inside them don't wait on themselves
+static thread_local bool tls_running_jobs = false;
+static thread_local int32_t tls_thread_id = 0;
+
+// Takes the next job of a node, or returns -1 if the node has none left
+static int32_t take_node_job(thread_pool_batch_t* batch, int32_t node)
+{
+    // checked first so that threads looking for jobs to steal don't keep bumping the ids of nodes that ran dry
+    if (batch->node_next_job_id[node].load() >= batch->node_first_job[node + 1])
+    {
+        return -1;
+    }
+
+    int32_t job_id = batch->node_next_job_id[node].fetch_add(1);
+    if (job_id >= batch->node_first_job[node + 1])
+    {
+        return -1;
+    }
+
+    return job_id;
+}
+
+static bool has_jobs_left(const thread_pool_batch_t* batch, int32_t node, bool steal)
+{
+    for (int32_t i = 0; i < batch->num_nodes; i++)
+    {
+        int32_t other_node = (node + i) % batch->num_nodes;
+        if (batch->node_next_job_id[other_node].load() < batch->node_first_job[other_node + 1])
+        {
+            return true;
+        }
+
+        if (!steal)
+        {
+            break;
+        }
+    }
+
+    return false;
+}
+
+static void run_jobs(thread_pool_batch_t* batch, int32_t thread_id, int32_t node, bool steal)
+{
+    bool was_running_jobs = tls_running_jobs;
+    int32_t prev_thread_id = tls_thread_id;
+    tls_running_jobs = true;
+    tls_thread_id = thread_id;
+
+    // the jobs of the thread's own node first, then the nodes after it
+    for (int32_t i = 0; i < batch->num_nodes; i++)
+    {
+        int32_t job_node = (node + i) % batch->num_nodes;
+
+        for (;;)
+        {
+            int32_t job_id = take_node_job(batch, job_node);
+            if (job_id < 0)
+            {
+                break;
+            }
+
+            batch->job(batch->userdata, job_id, thread_id);
+
+            batch->num_finished_jobs.fetch_add(1);
+        }
+
+        if (!steal)
+        {
+            break;
+        }
+    }
+
+    tls_running_jobs = was_running_jobs;
+    tls_thread_id = prev_thread_id;
+}
+
+// the oldest batch with jobs that the threads of the node can take
+static thread_pool_batch_t* find_batch_with_jobs_left(thread_pool_t* pool, int32_t node)
+{
+    for (thread_pool_batch_t* batch = pool->first_batch; batch; batch = batch->next)
+    {
+        if (has_jobs_left(batch, node, batch->allow_stealing))
+        {
+            return batch;
+        }
+    }
+
+    return nullptr;
+}
+
+static void worker_main(thread_pool_t* pool, int32_t thread_id)
+{
+    const thread_pool_core_t* core = &pool->cores[thread_id];
+
+#ifdef _WIN32
+    // so the memory the worker touches first stays on its node, and its tiles stay in its caches
+    if (core->affinity.Mask != 0)
+    {
+        SetThreadGroupAffinity(GetCurrentThread(), &core->affinity, NULL);
+    }
+#endif
+
+    for (;;)
+    {
+        thread_pool_batch_t* batch;
+
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->work_cv.wait(lock, [&] { return (batch = find_batch_with_jobs_left(pool, core->node)) != nullptr; });
+            batch->num_workers++;
+        }
+
+        run_jobs(batch, thread_id, core->node, batch->allow_stealing);
+
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            batch->num_workers--;
+            if (batch->num_workers == 0)
+            {
+                pool->done_cv.notify_all();
+            }
+        }
+    }
+}
+
+// Lists the cores of the machine grouped by NUMA node, one thread being run on each.
+static std::vector<thread_pool_core_t> find_cores()
+{
+    std::vector<thread_pool_core_t> cores;
+
+#ifdef _WIN32
+    ULONG highest_numa_node;
+    if (GetNumaHighestNodeNumber(&highest_numa_node))
+    {
+        int32_t node = 0;
+        for (ULONG numa_node = 0; numa_node <= highest_numa_node; numa_node++)
+        {
+            // nodes can have memory but no cores
+            GROUP_AFFINITY node_affinity;
+            if (!GetNumaNodeProcessorMaskEx((USHORT)numa_node, &node_affinity) || node_affinity.Mask == 0)
+            {
+                continue;
+            }
+
+            for (uint32_t bit = 0; bit < sizeof(KAFFINITY) * 8; bit++)
+            {
+                if (node_affinity.Mask & ((KAFFINITY)1 << bit))
+                {
+                    thread_pool_core_t core;
+                    memset(&core, 0, sizeof(core));
+                    core.node = node < THREAD_POOL_MAX_NODES ? node : THREAD_POOL_MAX_NODES - 1;
+                    core.affinity.Group = node_affinity.Group;
+                    core.affinity.Mask = (KAFFINITY)1 << bit;
+                    cores.push_back(core);
+                }
+            }
+
+            node++;
+        }
+    }
+#endif
+
+    // without NUMA information, the threads are left for the OS to place
+    if (cores.empty())
+    {
+        uint32_t num_hardware_threads = std::thread::hardware_concurrency();
+        for (uint32_t i = 0; i < num_hardware_threads || i == 0; i++)
+        {
+            thread_pool_core_t core;
+            memset(&core, 0, sizeof(core));
+            cores.push_back(core);
+        }
+    }
+
+    return cores;
+}
+
+// The node the calling thread happens to be running on, or -1 if it isn't on any of the pool's cores.
+// Only for threads that aren't pinned, since they can move to another node right after.
+static int32_t get_current_node(const thread_pool_t* pool)
+{
+#ifdef _WIN32
+    PROCESSOR_NUMBER processor;
+    GetCurrentProcessorNumberEx(&processor);
+
+    for (size_t i = 0; i < pool->cores.size(); i++)
+    {
+        const thread_pool_core_t* core = &pool->cores[i];
+        if (core->affinity.Mask != 0 && core->affinity.Group == processor.Group && (core->affinity.Mask & ((KAFFINITY)1 << processor.Number)))
+        {
+            return core->node;
+        }
+    }
+
+    return pool->num_nodes == 1 ? 0 : -1;
+#else
+    // without NUMA information, everything is node 0
+    return 0;
+#endif
+}
+
+static thread_pool_t* get_thread_pool()
+{
+    // Never deleted: the workers sleep until the process exits, since joining threads while a DLL unloads can deadlock.
+    static thread_pool_t* pool = []
+    {
+        thread_pool_t* p = new thread_pool_t();
+        p->first_batch = nullptr;
+        p->last_batch = nullptr;
+
+        p->cores = find_cores();
+        p->num_nodes = p->cores.back().node + 1;
+
+        memset(p->node_num_workers, 0, sizeof(p->node_num_workers));
+        for (size_t i = 1; i < p->cores.size(); i++)
+        {
+            p->node_num_workers[p->cores[i].node]++;
+        }
+
+        // the calling thread is the first one
+        for (size_t i = 1; i < p->cores.size(); i++)
+        {
+            p->workers.emplace_back(worker_main, p, (int32_t)i);
+        }
+
+        return p;
+    }();
+
+    return pool;
+}
+
+void thread_pool_start_on_nodes(thread_pool_batch_t* batch, const int32_t* node_first_job, int32_t allow_stealing, thread_pool_job_t job, void* userdata)
+{
+    assert(batch);
+    assert(node_first_job);
+    assert(node_first_job[0] == 0);
+    assert(job);
+
+    thread_pool_t* pool = get_thread_pool();
+
+    batch->job = job;
+    batch->userdata = userdata;
+    batch->num_nodes = pool->num_nodes;
+    for (int32_t node = 0; node < pool->num_nodes; node++)
+    {
+        assert(node_first_job[node] <= node_first_job[node + 1]);
+        batch->node_first_job[node] = node_first_job[node];
+        batch->node_next_job_id[node] = node_first_job[node];
+    }
+    batch->node_first_job[pool->num_nodes] = node_first_job[pool->num_nodes];
+    batch->num_jobs = node_first_job[pool->num_nodes];
+    batch->allow_stealing = allow_stealing != 0;
+    batch->num_finished_jobs = 0;
+    batch->num_workers = 0;
+    batch->next = nullptr;
+
+    // nobody to hand the jobs to, they'll run in thread_pool_finish
+    if (pool->workers.empty() || batch->num_jobs == 0)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (pool->last_batch)
+            pool->last_batch->next = batch;
+        else
+            pool->first_batch = batch;
+        pool->last_batch = batch;
+    }
+    pool->work_cv.notify_all();
+}
+
+// Jobs that don't belong to any node all go to node 0, and the other nodes steal them
+static void put_jobs_on_first_node(int32_t num_jobs, int32_t* node_first_job)
+{
+    node_first_job[0] = 0;
+    for (int32_t node = 1; node <= THREAD_POOL_MAX_NODES; node++)
+    {
+        node_first_job[node] = num_jobs;
+    }
+}
+
+void thread_pool_start(thread_pool_batch_t* batch, int32_t num_jobs, thread_pool_job_t job, void* userdata)
+{
+    assert(num_jobs >= 0);
+
+    int32_t node_first_job[THREAD_POOL_MAX_NODES + 1];
+    put_jobs_on_first_node(num_jobs, node_first_job);
+
+    thread_pool_start_on_nodes(batch, node_first_job, 1, job, userdata);
+}
+
+void thread_pool_finish(thread_pool_batch_t* batch)
+{
+    assert(batch);
+
+    thread_pool_t* pool = get_thread_pool();
+
+    // nested calls stay on the thread, which keeps the id it was given by the outer call.
+    // they also help every node, since the threads of the other nodes might be stuck in the outer jobs.
+    if (batch->allow_stealing || tls_running_jobs)
+    {
+        run_jobs(batch, tls_thread_id, pool->cores[tls_thread_id].node, true);
+    }
+    else
+    {
+        // Jobs that must stay on their node are left to the pinned workers, since the calling thread isn't pinned.
+        // It only helps with the node it's running on, and with the nodes that have no workers (with a single core, or a single hardware thread).
+        int32_t current_node = get_current_node(pool);
+        for (int32_t node = 0; node < batch->num_nodes; node++)
+        {
+            if (node == current_node || pool->node_num_workers[node] == 0)
+            {
+                run_jobs(batch, tls_thread_id, node, false);
+            }
+        }
+    }
+
+    if (pool->workers.empty() || batch->num_jobs == 0)
+    {
+        return;
+    }
+
+    // the jobs were all taken, but some might still be running
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->done_cv.wait(lock, [&] { return batch->num_workers == 0 && batch->num_finished_jobs.load() == batch->num_jobs; });
+
+    thread_pool_batch_t* prev = nullptr;
+    for (thread_pool_batch_t* b = pool->first_batch; b != batch; b = b->next)
+    {
+        assert(b);
+        prev = b;
+    }
+
+    if (prev)
+        prev->next = batch->next;
+    else
+        pool->first_batch = batch->next;
+
+    if (pool->last_batch == batch)
+        pool->last_batch = prev;
+}
+
+bool thread_pool_is_finished(const thread_pool_batch_t* batch)
+{
+    assert(batch);
+
+    return batch->num_finished_jobs.load() == batch->num_jobs;
+}
+
+void thread_pool_run_on_nodes(const int32_t* node_first_job, int32_t allow_stealing, thread_pool_job_t job, void* userdata)
+{
+    assert(node_first_job);
+    assert(job);
+
+    int32_t num_jobs = node_first_job[thread_pool_get_num_nodes()];
+    if (num_jobs <= 0)
+    {
+        return;
+    }
+
+    // not worth waking anyone up, unless the job has to run on a node's workers
+    if (tls_running_jobs || (num_jobs == 1 && allow_stealing))
+    {
+        for (int32_t job_id = 0; job_id < num_jobs; job_id++)
+        {
+            job(userdata, job_id, tls_thread_id);
+        }
+        return;
+    }
+
+    thread_pool_batch_t batch;
+    thread_pool_start_on_nodes(&batch, node_first_job, allow_stealing, job, userdata);
+    thread_pool_finish(&batch);
+}
+
+void thread_pool_run(int32_t num_jobs, thread_pool_job_t job, void* userdata)
+{
+    int32_t node_first_job[THREAD_POOL_MAX_NODES + 1];
+    put_jobs_on_first_node(num_jobs > 0 ? num_jobs : 0, node_first_job);
+
+    thread_pool_run_on_nodes(node_first_job, 1, job, userdata);
+}
+
+int32_t thread_pool_get_num_threads()
+{
+    return (int32_t)get_thread_pool()->workers.size() + 1;
+}
+
+int32_t thread_pool_get_num_nodes()
+{
+    return get_thread_pool()->num_nodes;
+}
+
+int32_t thread_pool_get_num_node_threads(int32_t node)
+{
+    thread_pool_t* pool = get_thread_pool();
+    assert(node >= 0 && node < pool->num_nodes);
+
+    int32_t num_node_threads = 0;
+    for (size_t i = 0; i < pool->cores.size(); i++)
+    {
+        if (pool->cores[i].node == node)
+        {
+            num_node_threads++;
+        }
+    }
+
+    return num_node_threads;
+}
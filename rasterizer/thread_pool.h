@@ -0,0 +1,71 @@
+#pragma once
+
+// Worker threads shared by all the framebuffers, used to resolve tiles in parallel.
+// Tiles own their pixels and their command buffers, so the jobs of a resolve never write to the same memory.
+// Each worker is pinned to a core, and the threads are grouped by the NUMA node of their core,
+// so that jobs can be kept on the node that owns their memory.
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Runs job(userdata, job_id, thread_id) for every job_id in [0, num_jobs), then returns once they're all done.
+// Jobs are handed out in order, to the workers and to the calling thread.
+// thread_id is in [0, thread_pool_get_num_threads()), 0 being the calling thread. No two jobs of a call run with the same thread_id at once,
+// so jobs can keep per thread scratch memory.
+typedef void(*thread_pool_job_t)(void* userdata, int32_t job_id, int32_t thread_id);
+
+// NUMA nodes past this are handled as if they were the last one
+#define THREAD_POOL_MAX_NODES 16
+
+// A set of jobs handed to the pool. Several batches can be in the pool at once (eg. from different threads),
+// in which case the workers finish taking the jobs of the oldest one before moving on to the next.
+typedef struct thread_pool_batch_t
+{
+    thread_pool_job_t job;
+    void* userdata;
+    int32_t num_jobs;
+
+    // the jobs of node i are [node_first_job[i], node_first_job[i + 1]), and node_next_job_id[i] is the next one to take
+    int32_t num_nodes;
+    int32_t node_first_job[THREAD_POOL_MAX_NODES + 1];
+    std::atomic<int32_t> node_next_job_id[THREAD_POOL_MAX_NODES];
+
+    // whether threads help with the jobs of other nodes once their own node has none left
+    bool allow_stealing;
+
+    std::atomic<int32_t> num_finished_jobs;
+
+    // workers running jobs of the batch, which can't go away before they're done with it
+    int32_t num_workers;
+
+    thread_pool_batch_t* next;
+} thread_pool_batch_t;
+
+// The pool is created by the first call, with one worker less than there are hardware threads since the caller helps.
+// With a single hardware thread, the jobs simply run on the calling thread.
+// Calls made from inside a job also run on the calling thread, since the other threads are already busy.
+void thread_pool_run(int32_t num_jobs, thread_pool_job_t job, void* userdata);
+
+// Asynchronous version of thread_pool_run: the workers start on the jobs, and the caller carries on.
+// thread_pool_finish must be called before the batch goes away. It helps with the jobs that are left, and returns once they're all done.
+void thread_pool_start(thread_pool_batch_t* batch, int32_t num_jobs, thread_pool_job_t job, void* userdata);
+void thread_pool_finish(thread_pool_batch_t* batch);
+
+// Versions of thread_pool_start and thread_pool_run for jobs that belong to NUMA nodes. node_first_job has thread_pool_get_num_nodes() + 1 entries,
+// the jobs of node i being [node_first_job[i], node_first_job[i + 1]). The threads of a node take its jobs first.
+// Once a node has no jobs left, its threads steal the jobs of other nodes, unless allow_stealing is 0.
+// The calling thread counts as part of node 0. It isn't pinned, so when allow_stealing is 0 it only runs the jobs of the node it's running on
+// (and of the nodes that have no workers), and otherwise waits for the workers.
+void thread_pool_start_on_nodes(thread_pool_batch_t* batch, const int32_t* node_first_job, int32_t allow_stealing, thread_pool_job_t job, void* userdata);
+void thread_pool_run_on_nodes(const int32_t* node_first_job, int32_t allow_stealing, thread_pool_job_t job, void* userdata);
+
+// Whether all the jobs of a started batch are done (their results can then be read), without waiting
+bool thread_pool_is_finished(const thread_pool_batch_t* batch);
+
+// Number of threads that run jobs, counting the calling thread
+int32_t thread_pool_get_num_threads();
+
+// Number of NUMA nodes with threads in the pool (1 on machines that aren't NUMA), and how many of the threads are on a node
+int32_t thread_pool_get_num_nodes();
+int32_t thread_pool_get_num_node_threads(int32_t node);
@@ -0,0 +1,139 @@
+#include "image_loader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <vector>
+
+// TGA image types
+#define TGA_TYPE_TRUECOLOR 2
+#define TGA_TYPE_GRAYSCALE 3
+#define TGA_TYPE_RLE_TRUECOLOR 10
+#define TGA_TYPE_RLE_GRAYSCALE 11
+
+// image descriptor bit set when rows are stored from the top
+#define TGA_DESCRIPTOR_TOP_TO_BOTTOM 0x20
+
+static uint32_t tga_pixel_to_argb(const uint8_t* pixel, int32_t bytes_per_pixel)
+{
+    // truecolor pixels are stored as BGR(A)
+    if (bytes_per_pixel == 1)
+        return 0xFF000000 | (pixel[0] << 16) | (pixel[0] << 8) | pixel[0];
+    else if (bytes_per_pixel == 3)
+        return 0xFF000000 | (pixel[2] << 16) | (pixel[1] << 8) | pixel[0];
+    else
+        return (pixel[3] << 24) | (pixel[2] << 16) | (pixel[1] << 8) | pixel[0];
+}
+
+uint32_t* load_tga(const char* filename, int32_t* width, int32_t* height)
+{
+    assert(filename);
+    assert(width && height);
+
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Error opening image file %s\n", filename);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    std::vector<uint8_t> file_data(file_size > 0 ? file_size : 1);
+    size_t num_read = fread(file_data.data(), 1, file_size, f);
+    fclose(f);
+
+    const uint8_t* data = file_data.data();
+    const uint8_t* data_end = data + num_read;
+
+    if (num_read < 18)
+    {
+        fprintf(stderr, "Error loading image file %s: truncated header\n", filename);
+        return NULL;
+    }
+
+    int32_t id_length = data[0];
+    int32_t colormap_type = data[1];
+    int32_t image_type = data[2];
+    int32_t w = data[12] | (data[13] << 8);
+    int32_t h = data[14] | (data[15] << 8);
+    int32_t bits_per_pixel = data[16];
+    int32_t descriptor = data[17];
+
+    int32_t is_grayscale = image_type == TGA_TYPE_GRAYSCALE || image_type == TGA_TYPE_RLE_GRAYSCALE;
+    int32_t is_rle = image_type == TGA_TYPE_RLE_TRUECOLOR || image_type == TGA_TYPE_RLE_GRAYSCALE;
+    int32_t bytes_per_pixel = bits_per_pixel / 8;
+
+    if (colormap_type != 0 ||
+        (image_type != TGA_TYPE_TRUECOLOR && image_type != TGA_TYPE_GRAYSCALE && !is_rle) ||
+        (is_grayscale && bits_per_pixel != 8) ||
+        (!is_grayscale && bits_per_pixel != 24 && bits_per_pixel != 32) ||
+        w <= 0 || h <= 0)
+    {
+        fprintf(stderr, "Error loading image file %s: unsupported TGA format (type %d, %d bits per pixel)\n", filename, image_type, bits_per_pixel);
+        return NULL;
+    }
+
+    const uint8_t* src = data + 18 + id_length;
+
+    uint32_t* pixels = (uint32_t*)malloc(sizeof(uint32_t) * w * h);
+    assert(pixels);
+
+    // decode in file order, flipping rows as needed to end up top to bottom
+    int32_t num_pixels = w * h;
+    int32_t pixel_i = 0;
+    while (pixel_i < num_pixels)
+    {
+        int32_t run_length = 1;
+        int32_t is_repeat = 0;
+        if (is_rle)
+        {
+            if (src >= data_end)
+                break;
+
+            // high bit: the next pixel is repeated, otherwise the next pixels are raw
+            run_length = (*src & 0x7F) + 1;
+            is_repeat = (*src & 0x80) != 0;
+            src++;
+        }
+
+        for (int32_t i = 0; i < run_length && pixel_i < num_pixels; i++, pixel_i++)
+        {
+            const uint8_t* pixel = is_repeat ? src : src + i * bytes_per_pixel;
+            if (pixel + bytes_per_pixel > data_end)
+            {
+                pixel_i = -1;
+                break;
+            }
+
+            int32_t x = pixel_i % w;
+            int32_t y = pixel_i / w;
+            if (!(descriptor & TGA_DESCRIPTOR_TOP_TO_BOTTOM))
+            {
+                y = h - 1 - y;
+            }
+
+            pixels[y * w + x] = tga_pixel_to_argb(pixel, bytes_per_pixel);
+        }
+
+        if (pixel_i < 0)
+            break;
+
+        src += (is_repeat ? 1 : run_length) * bytes_per_pixel;
+    }
+
+    if (pixel_i != num_pixels)
+    {
+        fprintf(stderr, "Error loading image file %s: truncated pixel data\n", filename);
+        free(pixels);
+        return NULL;
+    }
+
+    *width = w;
+    *height = h;
+    return pixels;
+}
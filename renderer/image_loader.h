@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+// Load-time image decoding, for the textures of models.
+
+// Loads a truecolor or grayscale TGA file (uncompressed or RLE, 8, 24 or 32 bits per pixel).
+// Returns 0xAARRGGBB pixels, row major from the top left, allocated with malloc. Returns NULL on failure.
+uint32_t* load_tga(const char* filename, int32_t* width, int32_t* height);
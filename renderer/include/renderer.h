@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 
+#include <rasterizer.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,25 +22,107 @@ struct renderer_t;
 struct scene_t;
 struct framebuffer_t;
 
+typedef enum draw_order_t
+{
+    draw_order_scene, // instances in the order they were added
+    draw_order_instances_front_to_back,
+    draw_order_clusters_front_to_back // clusters of all instances are interleaved
+} draw_order_t;
+
 RENDERER_API renderer_t* new_renderer(int32_t fbwidth, int32_t fbheight);
 RENDERER_API void delete_renderer(renderer_t* rd);
 RENDERER_API void renderer_render_scene(renderer_t* rd, scene_t* sc);
 RENDERER_API framebuffer_t* renderer_get_framebuffer(renderer_t* rd);
 
+#define RENDERER_MAX_VIEWS 8
+
+// Multi-view: renders the scene from several cameras (eg. a stereo pair) into framebuffers owned by the caller, in one pass over the geometry.
+// Clusters are culled against all the views at once, the vertices of clusters are read once and transformed for every view that sees them,
+// and the tiles of all the framebuffers are resolved together. views and projs hold 16 s15.16 values per view, like scene_set_view and scene_set_projection.
+// Instances are drawn in scene order, without occlusion culling, depth prepass or visibility shading, and the projections are used as given.
+// With texturing enabled, the framebuffers need a color buffer. Their pixel stages are left as they were.
+RENDERER_API void renderer_render_scene_views(renderer_t* rd, scene_t* sc, int32_t num_views, const int32_t* views, const int32_t* projs, framebuffer_t* const* fbs);
+
+// Batch rendering: renders the scene from many cameras into small images, for throughput rather than latency.
+// Each thread of the rasterizer's pool renders whole views into its own width x height framebuffer, which stays in cache,
+// and views are handed out to the threads as they finish the previous ones. The scene is only read, and rd's settings are used.
+// views and projs hold 16 s15.16 values per view. images receives one row major width x height image per view, one after the other.
+RENDERER_API void renderer_render_scene_batch(renderer_t* rd, scene_t* sc, int32_t num_views, const int32_t* views, const int32_t* projs, int32_t width, int32_t height, pixelformat_t format, void* images);
+
+// Occlusion culling: occluder instances are first rendered into a reduced resolution depth buffer,
+// then instances whose bounding box is hidden behind them are skipped. Disabled by default.
+RENDERER_API void renderer_set_occlusion_culling(renderer_t* rd, int32_t enabled);
+
+// Visibility buffer: triangles are rasterized into a buffer of triangle ids, then each visible pixel is shaded once.
+// This recreates the renderer's framebuffer, so renderer_get_framebuffer must be called again. Disabled by default.
+RENDERER_API void renderer_set_visibility_buffer(renderer_t* rd, int32_t enabled);
+
+// Reversed-Z: the depth range of the projection is flipped, so that the near plane maps to 1 and the far plane to 0.
+// This recreates the renderer's framebuffer, so renderer_get_framebuffer must be called again. Disabled by default.
+RENDERER_API void renderer_set_reversed_z(renderer_t* rd, int32_t enabled);
+
+// Pipelining: renderer_render_scene returns once the frame is drawn, and its tiles are resolved in the background while the next frame is drawn.
+// Readbacks of the framebuffer return the last frame that's done, so they lag a frame behind unless they wait for the fence of the last frame
+// (framebuffer_wait with renderer_get_frame_fence). This recreates the renderer's framebuffer, so renderer_get_framebuffer must be called again.
+// Disabled by default.
+RENDERER_API void renderer_set_pipelining(renderer_t* rd, int32_t enabled);
+// Fence of the last frame rendered by renderer_render_scene, in the renderer's framebuffer
+RENDERER_API uint64_t renderer_get_frame_fence(renderer_t* rd);
+
+// Width in pixels of the tiles the framebuffer is split into: 32, 64 (the default) or 128.
+// This recreates the renderer's framebuffer, so renderer_get_framebuffer must be called again.
+RENDERER_API void renderer_set_tile_width(renderer_t* rd, int32_t width);
+
+// Large pages for the framebuffer (see framebuffer_flag_large_pages), which enables the "Lock pages in memory" privilege of the process.
+// This recreates the renderer's framebuffer, so renderer_get_framebuffer must be called again. Disabled by default.
+RENDERER_API void renderer_set_large_pages(renderer_t* rd, int32_t enabled);
+
+// Incremental rendering: while the camera stays the same, renderer_render_scene only clears and redraws the tiles covered by the instances
+// that were added, removed or made occluders since the last frame (by their bounds), with the instances that overlap them.
+// The rest of the framebuffer keeps the last frame, so only the renderer should draw to it. A new camera or other settings redraw everything,
+// and so do pipelined framebuffers, whose frames start over older ones. Disabled by default.
+RENDERER_API void renderer_set_incremental(renderer_t* rd, int32_t enabled);
+
+// Texturing: models are drawn with the diffuse texture of their material (TGA only), when they have one. Disabled by default.
+RENDERER_API void renderer_set_texturing(renderer_t* rd, int32_t enabled);
+
+// Depth prepass: everything is first drawn depth-only, then drawn again with an equal depth test, so that each pixel is shaded once.
+// Doubles the rasterization work, which pays off when shading is expensive. Disabled by default.
+RENDERER_API void renderer_set_depth_prepass(renderer_t* rd, int32_t enabled);
+
+// Drawing near geometry first lets the depth test reject more of the far geometry before it's shaded.
+// Instances or clusters are sorted by view depth every frame. Defaults to draw_order_scene.
+RENDERER_API void renderer_set_draw_order(renderer_t* rd, draw_order_t order);
+
 RENDERER_API uint64_t renderer_get_perfcounter_frequency(renderer_t* rd);
 RENDERER_API void renderer_reset_perfcounters(renderer_t* rd);
 RENDERER_API int32_t renderer_get_num_perfcounters(renderer_t* rd);
 RENDERER_API void renderer_get_perfcounters(renderer_t* rd, uint64_t* pcs);
 RENDERER_API void renderer_get_perfcounter_names(renderer_t* rd, const char** names);
 
+// Counts (eg. of culled clusters) from the last call to renderer_render_scene
+RENDERER_API int32_t renderer_get_num_statistics(renderer_t* rd);
+RENDERER_API void renderer_get_statistics(renderer_t* rd, uint64_t* stats);
+RENDERER_API void renderer_get_statistic_names(renderer_t* rd, const char** names);
+
 RENDERER_API scene_t* new_scene();
 RENDERER_API void delete_scene(scene_t* sc);
 RENDERER_API int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_basepath, uint32_t* first_model_id, uint32_t* num_added_models);
 RENDERER_API void scene_add_instance(scene_t* sc, uint32_t model_id, uint32_t* instance_id);
 RENDERER_API void scene_remove_instance(scene_t* sc, uint32_t instance_id);
+RENDERER_API void scene_set_instance_occluder(scene_t* sc, uint32_t instance_id, int32_t is_occluder);
+RENDERER_API void scene_get_model_bounds(scene_t* sc, uint32_t model_id, int32_t bbox_min[3], int32_t bbox_max[3]);
 RENDERER_API void scene_set_view(scene_t* sc, int32_t view[16]);
 RENDERER_API void scene_set_projection(scene_t* sc, int32_t proj[16]);
 
+// Mesh optimization (vertex cache, overdraw and vertex fetch order) of models added with scene_add_models. Enabled by default.
+RENDERER_API void scene_set_optimize_meshes(scene_t* sc, int32_t enabled);
+
+// Statistics about the mesh of each model, measured at load time (eg. ACMR and overdraw before and after optimization)
+RENDERER_API int32_t scene_get_num_model_statistics(scene_t* sc);
+RENDERER_API void scene_get_model_statistics(scene_t* sc, uint32_t model_id, float* stats);
+RENDERER_API void scene_get_model_statistic_names(scene_t* sc, const char** names);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,887 @@
+#include "mesh_optimizer.h"
+
+#include <s1516.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+
+#include <algorithm>
+#include <vector>
+
+// Forsyth's tuning values
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_CACHE_DECAY_POWER 1.5f
+#define FORSYTH_LAST_TRI_SCORE 0.75f
+#define FORSYTH_VALENCE_BOOST_SCALE 2.0f
+#define FORSYTH_VALENCE_BOOST_POWER 0.5f
+#define FORSYTH_MAX_VALENCE 32
+
+// Resolution of the grid used to measure overdraw
+#define OVERDRAW_GRID_SIZE 256
+
+static float forsyth_vertex_score(int32_t cache_position, uint32_t remaining_valence)
+{
+    if (remaining_valence == 0)
+    {
+        // no triangle needs this vertex anymore
+        return -1.0f;
+    }
+
+    float score = 0.0f;
+
+    if (cache_position >= 0)
+    {
+        if (cache_position < 3)
+        {
+            // the vertex was used by the last triangle. fixed score so that the
+            // strip-like behavior doesn't dominate (which tends to leave holes behind).
+            score = FORSYTH_LAST_TRI_SCORE;
+        }
+        else
+        {
+            const float scaler = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+            score = powf(1.0f - (cache_position - 3) * scaler, FORSYTH_CACHE_DECAY_POWER);
+        }
+    }
+
+    // bonus for vertices with few triangles left, to get rid of lone triangles early
+    uint32_t valence = remaining_valence < FORSYTH_MAX_VALENCE ? remaining_valence : FORSYTH_MAX_VALENCE;
+    score += FORSYTH_VALENCE_BOOST_SCALE * powf((float)valence, -FORSYTH_VALENCE_BOOST_POWER);
+
+    return score;
+}
+
+void optimize_vertex_cache(uint32_t* indices, uint32_t index_count, uint32_t vertex_count)
+{
+    assert(indices);
+    assert(index_count % 3 == 0);
+
+    uint32_t tri_count = index_count / 3;
+    if (tri_count == 0)
+    {
+        return;
+    }
+
+    // vertex -> triangles adjacency
+    std::vector<uint32_t> valence(vertex_count, 0);
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        assert(indices[i] < vertex_count);
+        valence[indices[i]]++;
+    }
+
+    std::vector<uint32_t> adjacency_offsets(vertex_count + 1);
+    adjacency_offsets[0] = 0;
+    for (uint32_t v = 0; v < vertex_count; v++)
+    {
+        adjacency_offsets[v + 1] = adjacency_offsets[v] + valence[v];
+    }
+
+    // remaining_valence doubles as the fill counter, then as the count of not-yet-emitted adjacent triangles
+    std::vector<uint32_t> remaining_valence(vertex_count, 0);
+    std::vector<uint32_t> adjacency(index_count);
+    for (uint32_t t = 0; t < tri_count; t++)
+    {
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            uint32_t v = indices[t * 3 + c];
+            adjacency[adjacency_offsets[v] + remaining_valence[v]] = t;
+            remaining_valence[v]++;
+        }
+    }
+
+    std::vector<int32_t> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (uint32_t v = 0; v < vertex_count; v++)
+    {
+        vertex_score[v] = forsyth_vertex_score(-1, remaining_valence[v]);
+    }
+
+    std::vector<float> tri_score(tri_count);
+    std::vector<uint8_t> tri_emitted(tri_count, 0);
+    for (uint32_t t = 0; t < tri_count; t++)
+    {
+        tri_score[t] = vertex_score[indices[t * 3 + 0]] + vertex_score[indices[t * 3 + 1]] + vertex_score[indices[t * 3 + 2]];
+    }
+
+    std::vector<uint32_t> output(index_count);
+
+    // cache contents. one triangle's worth of extra room for the vertices being pushed out.
+    uint32_t cache[FORSYTH_CACHE_SIZE + 3];
+    uint32_t cache_count = 0;
+
+    // the very first triangle is picked with a full scan
+    int32_t best_tri = 0;
+    for (uint32_t t = 1; t < tri_count; t++)
+    {
+        if (tri_score[t] > tri_score[best_tri])
+        {
+            best_tri = t;
+        }
+    }
+
+    // fallback scan position, for when no triangle in the cache is left
+    uint32_t next_unemitted_tri = 0;
+
+    for (uint32_t output_tri = 0; output_tri < tri_count; output_tri++)
+    {
+        if (best_tri < 0)
+        {
+            while (tri_emitted[next_unemitted_tri])
+            {
+                next_unemitted_tri++;
+            }
+            best_tri = next_unemitted_tri;
+        }
+
+        const uint32_t* tri_verts = &indices[best_tri * 3];
+        output[output_tri * 3 + 0] = tri_verts[0];
+        output[output_tri * 3 + 1] = tri_verts[1];
+        output[output_tri * 3 + 2] = tri_verts[2];
+        tri_emitted[best_tri] = 1;
+
+        // remove the triangle from the adjacency of its vertices
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            uint32_t v = tri_verts[c];
+            uint32_t* adj = &adjacency[adjacency_offsets[v]];
+            for (uint32_t i = 0; i < remaining_valence[v]; i++)
+            {
+                if (adj[i] == (uint32_t)best_tri)
+                {
+                    adj[i] = adj[remaining_valence[v] - 1];
+                    break;
+                }
+            }
+            remaining_valence[v]--;
+        }
+
+        // move the triangle's vertices to the front of the LRU cache
+        uint32_t new_cache[FORSYTH_CACHE_SIZE + 3];
+        uint32_t new_cache_count = 0;
+        new_cache[new_cache_count++] = tri_verts[0];
+        new_cache[new_cache_count++] = tri_verts[1];
+        new_cache[new_cache_count++] = tri_verts[2];
+        for (uint32_t i = 0; i < cache_count; i++)
+        {
+            uint32_t v = cache[i];
+            if (v != tri_verts[0] && v != tri_verts[1] && v != tri_verts[2])
+            {
+                new_cache[new_cache_count++] = v;
+            }
+        }
+
+        // vertices past the end of the cache get evicted, but their score still has to drop
+        for (uint32_t i = 0; i < new_cache_count; i++)
+        {
+            uint32_t v = new_cache[i];
+            cache_position[v] = i < FORSYTH_CACHE_SIZE ? (int32_t)i : -1;
+            vertex_score[v] = forsyth_vertex_score(cache_position[v], remaining_valence[v]);
+        }
+
+        cache_count = new_cache_count < FORSYTH_CACHE_SIZE ? new_cache_count : FORSYTH_CACHE_SIZE;
+        memcpy(cache, new_cache, sizeof(uint32_t) * cache_count);
+
+        // rescore the triangles touched by the cache and pick the next one among them
+        best_tri = -1;
+        float best_score = -FLT_MAX;
+        for (uint32_t i = 0; i < new_cache_count; i++)
+        {
+            uint32_t v = new_cache[i];
+            const uint32_t* adj = &adjacency[adjacency_offsets[v]];
+            for (uint32_t j = 0; j < remaining_valence[v]; j++)
+            {
+                uint32_t t = adj[j];
+                float score = vertex_score[indices[t * 3 + 0]] + vertex_score[indices[t * 3 + 1]] + vertex_score[indices[t * 3 + 2]];
+                tri_score[t] = score;
+
+                if (score > best_score && i < FORSYTH_CACHE_SIZE)
+                {
+                    best_score = score;
+                    best_tri = t;
+                }
+            }
+        }
+    }
+
+    memcpy(indices, output.data(), sizeof(uint32_t) * index_count);
+}
+
+// number of cache misses of each triangle, using a FIFO cache starting from empty.
+static void simulate_fifo_cache(const uint32_t* indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size, uint8_t* tri_misses)
+{
+    // a vertex is in the cache if it was inserted less than cache_size insertions ago.
+    std::vector<uint32_t> insertion_time(vertex_count, 0);
+    uint32_t time = cache_size + 1;
+
+    for (uint32_t i = 0; i < index_count; i += 3)
+    {
+        uint8_t misses = 0;
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            uint32_t v = indices[i + c];
+            if (time - insertion_time[v] > cache_size)
+            {
+                insertion_time[v] = time;
+                time++;
+                misses++;
+            }
+        }
+
+        if (tri_misses)
+        {
+            tri_misses[i / 3] = misses;
+        }
+    }
+}
+
+float analyze_acmr(const uint32_t* indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size)
+{
+    assert(indices);
+    assert(index_count % 3 == 0);
+
+    uint32_t tri_count = index_count / 3;
+    if (tri_count == 0)
+    {
+        return 0.0f;
+    }
+
+    std::vector<uint8_t> tri_misses(tri_count);
+    simulate_fifo_cache(indices, index_count, vertex_count, cache_size, tri_misses.data());
+
+    uint64_t total_misses = 0;
+    for (uint32_t t = 0; t < tri_count; t++)
+    {
+        total_misses += tri_misses[t];
+    }
+
+    return (float)total_misses / tri_count;
+}
+
+typedef struct overdraw_cluster_t
+{
+    uint32_t first_tri;
+    uint32_t tri_count;
+    float sort_key;
+} overdraw_cluster_t;
+
+void optimize_overdraw(uint32_t* indices, uint32_t index_count, const int32_t* positions, uint32_t vertex_count, float threshold)
+{
+    assert(indices);
+    assert(positions);
+    assert(index_count % 3 == 0);
+
+    const uint32_t kCacheSize = 16;
+
+    uint32_t tri_count = index_count / 3;
+    if (tri_count == 0)
+    {
+        return;
+    }
+
+    std::vector<uint8_t> tri_misses(tri_count);
+    simulate_fifo_cache(indices, index_count, vertex_count, kCacheSize, tri_misses.data());
+
+    // Hard boundaries: triangles that miss on all 3 vertices. The cache is effectively flushed there, so
+    // cutting the index buffer at these points doesn't cost any vertex reuse.
+    std::vector<uint32_t> hard_boundaries;
+    for (uint32_t t = 0; t < tri_count; t++)
+    {
+        if (t == 0 || tri_misses[t] == 3)
+        {
+            hard_boundaries.push_back(t);
+        }
+    }
+    hard_boundaries.push_back(tri_count);
+
+    // Soft boundaries: split hard clusters further when the prefix of the cluster is already
+    // about as cache efficient as the whole cluster.
+    // The cache is simulated again from empty for each cluster, since a cluster can end up anywhere after sorting.
+    std::vector<uint32_t> insertion_time(vertex_count, 0);
+    uint32_t time = kCacheSize + 1;
+
+    std::vector<overdraw_cluster_t> clusters;
+    for (size_t hard_i = 0; hard_i + 1 < hard_boundaries.size(); hard_i++)
+    {
+        uint32_t hard_start = hard_boundaries[hard_i];
+        uint32_t hard_end = hard_boundaries[hard_i + 1];
+
+        uint32_t hard_misses = 0;
+        for (uint32_t t = hard_start; t < hard_end; t++)
+        {
+            hard_misses += tri_misses[t];
+        }
+        float cluster_threshold = threshold * hard_misses / (hard_end - hard_start);
+
+        uint32_t cluster_start = hard_start;
+        uint32_t running_misses = 0;
+
+        // flush the cache
+        time += kCacheSize + 1;
+
+        for (uint32_t t = hard_start; t < hard_end; t++)
+        {
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                uint32_t v = indices[t * 3 + c];
+                if (time - insertion_time[v] > kCacheSize)
+                {
+                    insertion_time[v] = time;
+                    time++;
+                    running_misses++;
+                }
+            }
+
+            uint32_t running_tris = t - cluster_start + 1;
+
+            // don't make tiny clusters, they would ruin the cache for no overdraw gain
+            bool split = running_tris >= kCacheSize && (float)running_misses / running_tris <= cluster_threshold;
+
+            if (split || t + 1 == hard_end)
+            {
+                overdraw_cluster_t cluster;
+                cluster.first_tri = cluster_start;
+                cluster.tri_count = t + 1 - cluster_start;
+                cluster.sort_key = 0.0f;
+                clusters.push_back(cluster);
+
+                cluster_start = t + 1;
+                running_misses = 0;
+                time += kCacheSize + 1;
+            }
+        }
+    }
+
+    // area weighted centroid and normal of each cluster
+    std::vector<float> cluster_centroids(clusters.size() * 3);
+    std::vector<float> cluster_normals(clusters.size() * 3);
+    float mesh_centroid[3] = { 0.0f, 0.0f, 0.0f };
+    float mesh_area = 0.0f;
+
+    for (size_t cluster_i = 0; cluster_i < clusters.size(); cluster_i++)
+    {
+        const overdraw_cluster_t* cluster = &clusters[cluster_i];
+
+        float centroid[3] = { 0.0f, 0.0f, 0.0f };
+        float normal[3] = { 0.0f, 0.0f, 0.0f };
+        float cluster_area = 0.0f;
+
+        for (uint32_t t = cluster->first_tri; t < cluster->first_tri + cluster->tri_count; t++)
+        {
+            float p[3][3];
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                const int32_t* pos = &positions[indices[t * 3 + c] * 3];
+                p[c][0] = (float)pos[0] / (1 << 16);
+                p[c][1] = (float)pos[1] / (1 << 16);
+                p[c][2] = (float)pos[2] / (1 << 16);
+            }
+
+            float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+            float e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+
+            // with the winding the indices are stored in (the one the rasterizer keeps), e1 x e2 points outward
+            float n[3] = {
+                e1[1] * e2[2] - e1[2] * e2[1],
+                e1[2] * e2[0] - e1[0] * e2[2],
+                e1[0] * e2[1] - e1[1] * e2[0]
+            };
+            float area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                centroid[k] += (p[0][k] + p[1][k] + p[2][k]) * (area / 3.0f);
+                normal[k] += n[k];
+            }
+            cluster_area += area;
+        }
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            mesh_centroid[k] += centroid[k];
+        }
+        mesh_area += cluster_area;
+
+        float inv_area = cluster_area == 0.0f ? 0.0f : 1.0f / cluster_area;
+        float normal_length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        float inv_normal_length = normal_length == 0.0f ? 0.0f : 1.0f / normal_length;
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            cluster_centroids[cluster_i * 3 + k] = centroid[k] * inv_area;
+            cluster_normals[cluster_i * 3 + k] = normal[k] * inv_normal_length;
+        }
+    }
+
+    float inv_mesh_area = mesh_area == 0.0f ? 0.0f : 1.0f / mesh_area;
+    for (uint32_t k = 0; k < 3; k++)
+    {
+        mesh_centroid[k] *= inv_mesh_area;
+    }
+
+    // clusters on the outside of the mesh, facing away from its center, are likely to occlude the others. draw them first.
+    for (size_t cluster_i = 0; cluster_i < clusters.size(); cluster_i++)
+    {
+        float sort_key = 0.0f;
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            sort_key += (cluster_centroids[cluster_i * 3 + k] - mesh_centroid[k]) * cluster_normals[cluster_i * 3 + k];
+        }
+        clusters[cluster_i].sort_key = sort_key;
+    }
+
+    std::stable_sort(clusters.begin(), clusters.end(), [](const overdraw_cluster_t& a, const overdraw_cluster_t& b) {
+        return a.sort_key > b.sort_key;
+    });
+
+    std::vector<uint32_t> output;
+    output.reserve(index_count);
+    for (const overdraw_cluster_t& cluster : clusters)
+    {
+        output.insert(output.end(), &indices[cluster.first_tri * 3], &indices[(cluster.first_tri + cluster.tri_count) * 3]);
+    }
+
+    memcpy(indices, output.data(), sizeof(uint32_t) * index_count);
+}
+
+uint32_t optimize_vertex_fetch(int32_t* positions, float* texcoords, uint32_t* indices, uint32_t index_count, uint32_t vertex_count)
+{
+    assert(positions);
+    assert(indices);
+
+    const uint32_t kUnused = 0xFFFFFFFF;
+    std::vector<uint32_t> remap(vertex_count, kUnused);
+    std::vector<int32_t> new_positions;
+    new_positions.reserve(vertex_count * 3);
+    std::vector<float> new_texcoords;
+    new_texcoords.reserve(texcoords ? vertex_count * 2 : 0);
+
+    uint32_t new_vertex_count = 0;
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        uint32_t v = indices[i];
+        assert(v < vertex_count);
+
+        if (remap[v] == kUnused)
+        {
+            remap[v] = new_vertex_count;
+            new_vertex_count++;
+            new_positions.insert(new_positions.end(), &positions[v * 3], &positions[v * 3 + 3]);
+            if (texcoords)
+            {
+                new_texcoords.insert(new_texcoords.end(), &texcoords[v * 2], &texcoords[v * 2 + 2]);
+            }
+        }
+
+        indices[i] = remap[v];
+    }
+
+    memcpy(positions, new_positions.data(), sizeof(int32_t) * 3 * new_vertex_count);
+    if (texcoords)
+    {
+        memcpy(texcoords, new_texcoords.data(), sizeof(float) * 2 * new_vertex_count);
+    }
+
+    return new_vertex_count;
+}
+
+float analyze_overdraw(const uint32_t* indices, uint32_t index_count, const int32_t* positions, uint32_t vertex_count)
+{
+    assert(indices);
+    assert(positions);
+
+    if (index_count == 0 || vertex_count == 0)
+    {
+        return 0.0f;
+    }
+
+    float bbox_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float bbox_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        const int32_t* pos = &positions[indices[i] * 3];
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            float f = (float)pos[k] / (1 << 16);
+            bbox_min[k] = f < bbox_min[k] ? f : bbox_min[k];
+            bbox_max[k] = f > bbox_max[k] ? f : bbox_max[k];
+        }
+    }
+
+    float extent = std::max(bbox_max[0] - bbox_min[0], std::max(bbox_max[1] - bbox_min[1], bbox_max[2] - bbox_min[2]));
+    float scale = extent == 0.0f ? 0.0f : (OVERDRAW_GRID_SIZE - 1) / extent;
+
+    std::vector<float> depthbuffer(OVERDRAW_GRID_SIZE * OVERDRAW_GRID_SIZE);
+
+    uint64_t pixels_covered = 0;
+    uint64_t pixels_shaded = 0;
+
+    // looking down each axis, from both sides
+    for (uint32_t axis = 0; axis < 3; axis++)
+    {
+        uint32_t u_axis = (axis + 1) % 3;
+        uint32_t v_axis = (axis + 2) % 3;
+
+        for (int32_t dir = -1; dir <= 1; dir += 2)
+        {
+            std::fill(depthbuffer.begin(), depthbuffer.end(), FLT_MAX);
+
+            for (uint32_t i = 0; i < index_count; i += 3)
+            {
+                float p[3][3];
+                for (uint32_t c = 0; c < 3; c++)
+                {
+                    const int32_t* pos = &positions[indices[i + c] * 3];
+                    for (uint32_t k = 0; k < 3; k++)
+                    {
+                        p[c][k] = ((float)pos[k] / (1 << 16) - bbox_min[k]) * scale;
+                    }
+                }
+
+                // back-face culling (e1 x e2 points outward)
+                float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+                float e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+                float n_axis = e1[(axis + 1) % 3] * e2[(axis + 2) % 3] - e1[(axis + 2) % 3] * e2[(axis + 1) % 3];
+                if (n_axis * dir >= 0.0f)
+                {
+                    continue;
+                }
+
+                float u[3], v[3], z[3];
+                for (uint32_t c = 0; c < 3; c++)
+                {
+                    u[c] = p[c][u_axis];
+                    v[c] = p[c][v_axis];
+                    z[c] = p[c][axis] * dir;
+                }
+
+                float area = (u[1] - u[0]) * (v[2] - v[0]) - (u[2] - u[0]) * (v[1] - v[0]);
+                if (area == 0.0f)
+                {
+                    continue;
+                }
+                float inv_area = 1.0f / area;
+
+                int32_t min_x = std::max((int32_t)floorf(std::min(u[0], std::min(u[1], u[2]))), 0);
+                int32_t max_x = std::min((int32_t)ceilf(std::max(u[0], std::max(u[1], u[2]))), OVERDRAW_GRID_SIZE - 1);
+                int32_t min_y = std::max((int32_t)floorf(std::min(v[0], std::min(v[1], v[2]))), 0);
+                int32_t max_y = std::min((int32_t)ceilf(std::max(v[0], std::max(v[1], v[2]))), OVERDRAW_GRID_SIZE - 1);
+
+                for (int32_t y = min_y; y <= max_y; y++)
+                {
+                    for (int32_t x = min_x; x <= max_x; x++)
+                    {
+                        float px = x + 0.5f;
+                        float py = y + 0.5f;
+
+                        // barycentrics, normalized so the sign of the area doesn't matter
+                        float b0 = ((u[1] - px) * (v[2] - py) - (u[2] - px) * (v[1] - py)) * inv_area;
+                        float b1 = ((u[2] - px) * (v[0] - py) - (u[0] - px) * (v[2] - py)) * inv_area;
+                        float b2 = 1.0f - b0 - b1;
+                        if (b0 < 0.0f || b1 < 0.0f || b2 < 0.0f)
+                        {
+                            continue;
+                        }
+
+                        float depth = b0 * z[0] + b1 * z[1] + b2 * z[2];
+                        float* dst = &depthbuffer[y * OVERDRAW_GRID_SIZE + x];
+                        if (*dst == FLT_MAX)
+                        {
+                            pixels_covered++;
+                        }
+                        if (depth < *dst)
+                        {
+                            *dst = depth;
+                            pixels_shaded++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return pixels_covered == 0 ? 0.0f : (float)pixels_shaded / pixels_covered;
+}
+
+// zero for degenerate triangles
+static void triangle_unit_normal(const int32_t* positions, const uint32_t* tri, float* normal)
+{
+    float p[3][3];
+    for (uint32_t c = 0; c < 3; c++)
+    {
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            p[c][k] = (float)positions[tri[c] * 3 + k] / (1 << 16);
+        }
+    }
+
+    float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+    float e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+
+    // with the winding the indices are stored in (the one the rasterizer keeps), e1 x e2 points outward
+    normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+
+    float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+    float inv_length = length == 0.0f ? 0.0f : 1.0f / length;
+    normal[0] *= inv_length;
+    normal[1] *= inv_length;
+    normal[2] *= inv_length;
+}
+
+// Perimeter over area of a triangle that isn't degenerate
+static float triangle_perimeter_over_area(const int32_t* positions, const uint32_t* tri)
+{
+    float p[3][3];
+    for (uint32_t c = 0; c < 3; c++)
+    {
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            p[c][k] = (float)positions[tri[c] * 3 + k] / (1 << 16);
+        }
+    }
+
+    float perimeter = 0.0f;
+    for (uint32_t c = 0; c < 3; c++)
+    {
+        const float* a = p[c];
+        const float* b = p[(c + 1) % 3];
+        perimeter += sqrtf((b[0] - a[0]) * (b[0] - a[0]) + (b[1] - a[1]) * (b[1] - a[1]) + (b[2] - a[2]) * (b[2] - a[2]));
+    }
+
+    float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+    float e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+    float cross[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+    float area = 0.5f * sqrtf(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+
+    return perimeter / area;
+}
+
+static void compute_cluster_bounds(mesh_cluster_t* cluster, const int32_t* positions, const uint32_t* indices)
+{
+    // bounding sphere centered on the bounding box
+    float bbox_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float bbox_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (uint32_t v = cluster->first_vertex; v < cluster->first_vertex + cluster->vertex_count; v++)
+    {
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            float f = (float)positions[v * 3 + k] / (1 << 16);
+            bbox_min[k] = f < bbox_min[k] ? f : bbox_min[k];
+            bbox_max[k] = f > bbox_max[k] ? f : bbox_max[k];
+        }
+    }
+
+    float center[3];
+    for (uint32_t k = 0; k < 3; k++)
+    {
+        center[k] = (bbox_min[k] + bbox_max[k]) * 0.5f;
+    }
+
+    float radius_sq = 0.0f;
+    for (uint32_t v = cluster->first_vertex; v < cluster->first_vertex + cluster->vertex_count; v++)
+    {
+        float d_sq = 0.0f;
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            float d = (float)positions[v * 3 + k] / (1 << 16) - center[k];
+            d_sq += d * d;
+        }
+        radius_sq = d_sq > radius_sq ? d_sq : radius_sq;
+    }
+
+    cluster->bounding_sphere[0] = center[0];
+    cluster->bounding_sphere[1] = center[1];
+    cluster->bounding_sphere[2] = center[2];
+    cluster->bounding_sphere[3] = sqrtf(radius_sq);
+
+    // normal cone. the axis is the average of the (unit) triangle normals.
+    std::vector<float> normals(cluster->index_count);
+    float axis[3] = { 0.0f, 0.0f, 0.0f };
+    uint32_t num_normals = 0;
+    uint32_t num_degenerate = 0;
+    cluster->max_perimeter_over_area = 0.0f;
+
+    for (uint32_t i = cluster->first_index; i < cluster->first_index + cluster->index_count; i += 3)
+    {
+        // triangles with a repeated index always have zero area, even after snapping, so they never produce pixels
+        if (indices[i + 0] == indices[i + 1] || indices[i + 1] == indices[i + 2] || indices[i + 2] == indices[i + 0])
+        {
+            continue;
+        }
+
+        float n[3];
+        triangle_unit_normal(positions, &indices[i], n);
+
+        // other degenerate triangles can still produce pixels once their vertices are snapped, with either orientation
+        if (n[0] == 0.0f && n[1] == 0.0f && n[2] == 0.0f)
+        {
+            num_degenerate++;
+            continue;
+        }
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            normals[num_normals * 3 + k] = n[k];
+            axis[k] += n[k];
+        }
+        num_normals++;
+
+        float perimeter_over_area = triangle_perimeter_over_area(positions, &indices[i]);
+        cluster->max_perimeter_over_area = perimeter_over_area > cluster->max_perimeter_over_area ? perimeter_over_area : cluster->max_perimeter_over_area;
+    }
+
+    float axis_length = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    if (axis_length == 0.0f || num_degenerate > 0)
+    {
+        cluster->cone_axis[0] = 0.0f;
+        cluster->cone_axis[1] = 0.0f;
+        cluster->cone_axis[2] = 0.0f;
+        cluster->cone_cutoff = 2.0f;
+        return;
+    }
+
+    float min_dp = 1.0f;
+    for (uint32_t n = 0; n < num_normals; n++)
+    {
+        float dp = (normals[n * 3 + 0] * axis[0] + normals[n * 3 + 1] * axis[1] + normals[n * 3 + 2] * axis[2]) / axis_length;
+        min_dp = dp < min_dp ? dp : min_dp;
+    }
+
+    cluster->cone_axis[0] = axis[0] / axis_length;
+    cluster->cone_axis[1] = axis[1] / axis_length;
+    cluster->cone_axis[2] = axis[2] / axis_length;
+
+    // the cone is only usable when all normals are within 90 degrees of the axis.
+    // cutoff = sin(angle) = cos(90 - angle), padded a bit to absorb the error of the rounded normals.
+    cluster->cone_cutoff = min_dp <= 0.0f ? 2.0f : sqrtf(1.0f - min_dp * min_dp) + 1e-3f;
+}
+
+uint32_t build_mesh_clusters(
+    const int32_t* positions, const float* texcoords, const uint32_t* indices, uint32_t index_count, uint32_t vertex_count,
+    int32_t** clustered_positions, float** clustered_texcoords, uint32_t** clustered_indices, uint32_t* clustered_vertex_count,
+    mesh_cluster_t** clusters)
+{
+    assert(positions);
+    assert(indices);
+    assert(index_count % 3 == 0);
+    assert(clustered_positions && clustered_indices && clustered_vertex_count && clusters);
+    assert(!texcoords || clustered_texcoords);
+
+    std::vector<int32_t> out_positions;
+    std::vector<float> out_texcoords;
+    std::vector<uint32_t> out_indices;
+    std::vector<mesh_cluster_t> out_clusters;
+    out_positions.reserve(vertex_count * 3);
+    out_indices.reserve(index_count);
+
+    // vertex -> index in the current cluster's vertices (valid only when cluster_of_vertex matches)
+    const uint32_t kNoCluster = 0xFFFFFFFF;
+    std::vector<uint32_t> cluster_of_vertex(vertex_count, kNoCluster);
+    std::vector<uint32_t> local_vertex(vertex_count);
+
+    mesh_cluster_t cluster;
+    memset(&cluster, 0, sizeof(cluster));
+
+    float cluster_normal[3] = { 0.0f, 0.0f, 0.0f };
+
+    for (uint32_t i = 0; i < index_count; i += 3)
+    {
+        uint32_t cluster_id = (uint32_t)out_clusters.size();
+
+        float normal[3];
+        triangle_unit_normal(positions, &indices[i], normal);
+        float cluster_normal_length = sqrtf(cluster_normal[0] * cluster_normal[0] + cluster_normal[1] * cluster_normal[1] + cluster_normal[2] * cluster_normal[2]);
+        float normal_dp = normal[0] * cluster_normal[0] + normal[1] * cluster_normal[1] + normal[2] * cluster_normal[2];
+
+        uint32_t new_vertices = 0;
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            uint32_t v = indices[i + c];
+            assert(v < vertex_count);
+
+            // count each new vertex only once, even if the triangle uses it twice
+            if (cluster_of_vertex[v] != cluster_id && (c < 1 || v != indices[i]) && (c < 2 || v != indices[i + 1]))
+            {
+                new_vertices++;
+            }
+        }
+
+        // a triangle facing too far from the rest of the cluster would make its normal cone useless for culling
+        bool degenerate = normal[0] == 0.0f && normal[1] == 0.0f && normal[2] == 0.0f;
+        bool diverging_normal = !degenerate && cluster.index_count / 3 >= MESH_CLUSTER_MIN_TRIANGLES && normal_dp < MESH_CLUSTER_MIN_NORMAL_DOT * cluster_normal_length;
+
+        if (cluster.vertex_count + new_vertices > MESH_CLUSTER_MAX_VERTICES || cluster.index_count / 3 + 1 > MESH_CLUSTER_MAX_TRIANGLES || diverging_normal)
+        {
+            out_clusters.push_back(cluster);
+            cluster_id++;
+
+            memset(&cluster, 0, sizeof(cluster));
+            cluster.first_index = (uint32_t)out_indices.size();
+            cluster.first_vertex = (uint32_t)(out_positions.size() / 3);
+
+            cluster_normal[0] = cluster_normal[1] = cluster_normal[2] = 0.0f;
+        }
+
+        cluster_normal[0] += normal[0];
+        cluster_normal[1] += normal[1];
+        cluster_normal[2] += normal[2];
+
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            uint32_t v = indices[i + c];
+            if (cluster_of_vertex[v] != cluster_id)
+            {
+                cluster_of_vertex[v] = cluster_id;
+                local_vertex[v] = cluster.vertex_count;
+                cluster.vertex_count++;
+                out_positions.insert(out_positions.end(), &positions[v * 3], &positions[v * 3 + 3]);
+                if (texcoords)
+                {
+                    out_texcoords.insert(out_texcoords.end(), &texcoords[v * 2], &texcoords[v * 2 + 2]);
+                }
+            }
+
+            out_indices.push_back(cluster.first_vertex + local_vertex[v]);
+        }
+
+        cluster.index_count += 3;
+    }
+
+    if (cluster.index_count > 0)
+    {
+        out_clusters.push_back(cluster);
+    }
+
+    for (mesh_cluster_t& c : out_clusters)
+    {
+        compute_cluster_bounds(&c, out_positions.data(), out_indices.data());
+    }
+
+    *clustered_vertex_count = (uint32_t)(out_positions.size() / 3);
+
+    *clustered_positions = (int32_t*)malloc(sizeof(int32_t) * (out_positions.size() > 0 ? out_positions.size() : 1));
+    assert(*clustered_positions);
+    memcpy(*clustered_positions, out_positions.data(), sizeof(int32_t) * out_positions.size());
+
+    if (texcoords)
+    {
+        *clustered_texcoords = (float*)malloc(sizeof(float) * (out_texcoords.size() > 0 ? out_texcoords.size() : 1));
+        assert(*clustered_texcoords);
+        memcpy(*clustered_texcoords, out_texcoords.data(), sizeof(float) * out_texcoords.size());
+    }
+
+    *clustered_indices = (uint32_t*)malloc(sizeof(uint32_t) * (out_indices.size() > 0 ? out_indices.size() : 1));
+    assert(*clustered_indices);
+    memcpy(*clustered_indices, out_indices.data(), sizeof(uint32_t) * out_indices.size());
+
+    *clusters = (mesh_cluster_t*)malloc(sizeof(mesh_cluster_t) * (out_clusters.size() > 0 ? out_clusters.size() : 1));
+    assert(*clusters);
+    memcpy(*clusters, out_clusters.data(), sizeof(mesh_cluster_t) * out_clusters.size());
+
+    return (uint32_t)out_clusters.size();
+}
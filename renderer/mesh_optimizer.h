@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+// Load-time mesh optimizations.
+// All functions work on triangle lists with 32-bit indices and xyz s15.16 positions (as stored in model_t).
+
+// Reorders triangles to maximize post-transform vertex cache hits.
+// Tom Forsyth's "Linear-Speed Vertex Cache Optimisation", using a simulated LRU cache.
+void optimize_vertex_cache(uint32_t* indices, uint32_t index_count, uint32_t vertex_count);
+
+// Reorders clusters of triangles so that outward facing clusters are drawn first, reducing overdraw.
+// Expects indices that were already optimized for the vertex cache. Clusters are only split where doing so
+// doesn't raise the ACMR of the cluster by more than the threshold (eg. 1.05 allows 5% worse).
+// Based on Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw".
+void optimize_overdraw(uint32_t* indices, uint32_t index_count, const int32_t* positions, uint32_t vertex_count, float threshold);
+
+// Reorders vertices in the order they are first referenced by the indices, and updates the indices to match.
+// Vertices that are not referenced by any triangle are removed.
+// texcoords (2 floats per vertex) are reordered along with the positions, unless NULL.
+// Returns the new number of vertices.
+uint32_t optimize_vertex_fetch(int32_t* positions, float* texcoords, uint32_t* indices, uint32_t index_count, uint32_t vertex_count);
+
+// Average number of vertex cache misses per triangle, using a simulated FIFO cache.
+float analyze_acmr(const uint32_t* indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size);
+
+// Average number of times each covered pixel is written (depth test passes / covered pixels).
+// Measured by rasterizing the mesh from the 6 axis aligned directions, with back-face culling.
+float analyze_overdraw(const uint32_t* indices, uint32_t index_count, const int32_t* positions, uint32_t vertex_count);
+
+// Clusters are bounded both ways, so that a cluster's vertices are cheap to transform as a unit
+#define MESH_CLUSTER_MAX_VERTICES 64
+#define MESH_CLUSTER_MAX_TRIANGLES 124
+
+// Clusters are also cut short when a triangle's normal gets too far from the cluster's average normal (cosine of the angle).
+// This keeps the normal cones narrow enough for backface culling, but never below the minimum size.
+#define MESH_CLUSTER_MIN_NORMAL_DOT 0.5f
+#define MESH_CLUSTER_MIN_TRIANGLES 16
+
+typedef struct mesh_cluster_t
+{
+    uint32_t first_index;
+    uint32_t index_count;
+
+    // vertices used by the cluster's triangles, and only by them
+    uint32_t first_vertex;
+    uint32_t vertex_count;
+
+    // xyz center and radius, in model space
+    float bounding_sphere[4];
+
+    // all the triangles face away from any viewer inside the cone of directions around the (outward) axis.
+    // cone_cutoff is the sine of the angle between the axis and the most divergent normal, or > 1 if the cone is too wide to cull.
+    float cone_axis[3];
+    float cone_cutoff;
+
+    // largest perimeter over area of the triangles, in 1 / model space units.
+    // Snapping the vertices to subpixels can turn a triangle by up to about this many subpixel sizes, so the cone test has to leave that much room.
+    float max_perimeter_over_area;
+} mesh_cluster_t;
+
+// Splits the triangles into clusters of consecutive triangles, keeping their order.
+// Vertices shared between clusters are duplicated so that each cluster references its own contiguous range of vertices.
+// The new positions, texcoords (only if texcoords isn't NULL), indices and clusters are allocated with malloc.
+// Returns the number of clusters.
+uint32_t build_mesh_clusters(
+    const int32_t* positions, const float* texcoords, const uint32_t* indices, uint32_t index_count, uint32_t vertex_count,
+    int32_t** clustered_positions, float** clustered_texcoords, uint32_t** clustered_indices, uint32_t* clustered_vertex_count,
+    mesh_cluster_t** clusters);
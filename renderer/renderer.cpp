@@ -1,16 +1,50 @@
 #include <renderer.h>
 
 #include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <ctype.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
 
 #include <rasterizer.h>
 #include <s1516.h>
 #include <freelist.h>
 
+#include "mesh_optimizer.h"
+#include "image_loader.h"
+
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
+#include <algorithm>
+
+// Configuration
+// ------------------
+// Which instruction set to use
+// Haswell New Instructions (AVX2)
+#define USE_HSWni
+// ------------------
+
 #define SCENE_MAX_NUM_MODELS 512
 #define SCENE_MAX_NUM_INSTANCES 512
+#define SCENE_MAX_NUM_TEXTURES 512
+
+// Scenes remember the bounds of their last changes, for renderers that only redraw what changed (see renderer_set_incremental)
+#define SCENE_MAX_TRACKED_CHANGES 64
+
+// Occluders are rendered at 1/OCCLUSION_DOWNSCALE of the resolution of the framebuffer in each dimension
+#define OCCLUSION_DOWNSCALE 4
+#define OCCLUSION_MAX_NUM_LEVELS 16
+
+// Draws are sorted front to back by their view depth, quantized to DRAW_SORT_KEY_BITS bits.
+// The radix sort does one pass per DRAW_SORT_RADIX_BITS bits of the key.
+#define DRAW_SORT_KEY_BITS 16
+#define DRAW_SORT_RADIX_BITS 8
 
 #include <imgui.h>
 
@@ -38,187 +72,1849 @@ uint64_t qpf()
     QueryPerformanceFrequency(&pf);
     return pf.QuadPart;
 }
-#else
-"Missing QPF implementation for this platform!";
-#endif
+#else
+"Missing QPF implementation for this platform!";
+#endif
+
+// Vertex cache size used to report ACMR
+#define MODEL_STATISTICS_CACHE_SIZE 16
+
+// Allowed ACMR increase when splitting triangles into clusters for overdraw optimization
+#define MESH_OPTIMIZATION_OVERDRAW_THRESHOLD 1.05f
+
+// Measured once when the model is loaded, before and after mesh optimization
+typedef struct model_statistics_t
+{
+    float acmr_before;
+    float acmr_after;
+    float overdraw_before;
+    float overdraw_after;
+} model_statistics_t;
+
+const char* kModelStatisticNames[] = {
+    "acmr_before",
+    "acmr_after",
+    "overdraw_before",
+    "overdraw_after"
+};
+
+static_assert(sizeof(kModelStatisticNames) / sizeof(*kModelStatisticNames) == sizeof(model_statistics_t) / sizeof(float), "Model statistic names count");
+
+typedef struct model_t
+{
+    int32_t* positions;
+    uint32_t* indices;
+
+    // 2 per vertex, with t going down the image. NULL if the model has none.
+    float* texcoords;
+
+    // diffuse texture of the model's material, or -1
+    int32_t texture_id;
+
+    uint32_t vertex_count;
+    uint32_t index_count;
+
+    // the triangles are split into clusters, which are culled as a unit
+    mesh_cluster_t* clusters;
+    uint32_t cluster_count;
+
+    // s15.16 model space bounding box
+    int32_t bbox_min[3];
+    int32_t bbox_max[3];
+
+    model_statistics_t statistics;
+} model_t;
+
+typedef struct instance_t
+{
+    int32_t model_id;
+
+    // rendered in the occlusion pass, to hide other instances
+    int32_t is_occluder;
+} instance_t;
+
+// an instance that was added, removed or changed, by its world space bounding box
+typedef struct scene_change_t
+{
+    int32_t bbox_min[3];
+    int32_t bbox_max[3];
+} scene_change_t;
+
+typedef struct scene_t
+{
+    model_t* models;
+    uint32_t model_count;
+
+    texture_t** textures;
+    uint32_t texture_count;
+
+    freelist_t<instance_t>* instances;
+
+    // reorder indices and vertices of models as they are loaded
+    int32_t optimize_meshes;
+
+    int32_t view[16];
+    int32_t proj[16];
+
+    // the last changes to instances, in a ring indexed by the count of every change so far
+    scene_change_t changes[SCENE_MAX_TRACKED_CHANGES];
+    uint64_t num_changes;
+} scene_t;
+
+typedef struct renderer_perfcounters_t
+{
+    uint64_t mvptransform;
+    uint64_t renderinstance;
+    uint64_t occlusionculling;
+    uint64_t sorting;
+    uint64_t depthprepass;
+    uint64_t shading;
+} renderer_perfcounters_t;
+
+const char* kRendererPerfCounterNames[] =  {
+    "mvptransform",
+    "renderinstance",
+    "occlusionculling",
+    "sorting",
+    "depthprepass",
+    "shading"
+};
+
+static_assert(sizeof(kRendererPerfCounterNames) / sizeof(*kRendererPerfCounterNames) == sizeof(renderer_perfcounters_t) / sizeof(uint64_t), "Renderer names count");
+
+// counts of things that happened while rendering the last scene
+typedef struct renderer_statistics_t
+{
+    uint64_t clusters_drawn;
+    uint64_t clusters_frustum_culled;
+    uint64_t clusters_backface_culled;
+    uint64_t instances_drawn;
+    uint64_t instances_occlusion_culled;
+} renderer_statistics_t;
+
+const char* kRendererStatisticNames[] = {
+    "clusters_drawn",
+    "clusters_frustum_culled",
+    "clusters_backface_culled",
+    "instances_drawn",
+    "instances_occlusion_culled"
+};
+
+static_assert(sizeof(kRendererStatisticNames) / sizeof(*kRendererStatisticNames) == sizeof(renderer_statistics_t) / sizeof(uint64_t), "Renderer statistic names count");
+
+// cluster_id of draws of whole instances
+#define DRAW_ALL_CLUSTERS 0xFFFFFFFF
+
+// an instance or a single cluster of it, which is drawn in the order of the sort keys
+typedef struct draw_t
+{
+    uint32_t sort_key;
+
+    // view depth of the far side of the bounding sphere
+    float depth;
+
+    uint32_t instance_id;
+    uint32_t visibility_instance_id;
+    uint32_t cluster_id;
+} draw_t;
+
+// instances are identified in the visibility buffer by the order they're drawn in
+static_assert(SCENE_MAX_NUM_INSTANCES <= (1 << VISIBILITY_INSTANCE_ID_BITS), "Visibility ids can't identify every instance");
+
+typedef struct renderer_t
+{
+    framebuffer_t* fb;
+    int32_t fbwidth;
+    int32_t fbheight;
+
+    // Visibility buffer: fb stores the triangle visible at each pixel, and pixels are shaded after all instances are drawn.
+    // The model of each instance drawn in the current frame, indexed by the instance part of visibility ids.
+    int32_t visibility_buffer;
+    int32_t visibility_instance_models[SCENE_MAX_NUM_INSTANCES];
+
+    // draw models with their diffuse texture (when they have one) rather than their barycentrics
+    int32_t texturing;
+
+    // fb is a reversed-Z framebuffer, and draws to it flip the depth range of the projection
+    int32_t reversed_z;
+
+    // fb is pipelined: frames are resolved in the background while the next one is drawn.
+    // frame_fence is the fence of the last frame submitted to fb.
+    int32_t pipelining;
+    uint64_t frame_fence;
+
+    // width in pixels of the tiles of fb (see framebuffer_flag_tile_width_32)
+    int32_t tile_width;
+
+    // fb is created with framebuffer_flag_large_pages
+    int32_t large_pages;
+
+    // Incremental rendering: only the tiles covered by the instances that changed since the last frame are redrawn, when nothing else did.
+    // fb has the frame of incremental_scene seen from incremental_view and incremental_proj, with incremental_num_changes of its changes,
+    // unless incremental_valid was reset by a change of settings.
+    int32_t incremental;
+    int32_t incremental_valid;
+    const scene_t* incremental_scene;
+    uint64_t incremental_num_changes;
+    int32_t incremental_view[16];
+    int32_t incremental_proj[16];
+
+    // Depth prepass: the draws are rendered depth-only before being shaded with an equal depth test.
+    // drawing_depth_prepass is set during the depth-only pass.
+    int32_t depth_prepass;
+    int32_t drawing_depth_prepass;
+
+    // draws of the current frame, sorted unless the draw order is draw_order_scene
+    draw_order_t draw_order;
+    draw_t* draws;
+    draw_t* draws_scratch;
+    uint32_t num_draws;
+    uint32_t draws_capacity;
+
+    // clip space (xyzw) positions of the model currently being drawn
+    int32_t* xformed_positions;
+    uint32_t xformed_capacity;
+
+    // Occlusion culling: occluders are rendered into a small framebuffer, from which a depth pyramid is built.
+    // Level 0 is the size of occlusion_fb, and each following level halves it (rounding up).
+    int32_t occlusion_culling;
+    framebuffer_t* occlusion_fb;
+    int32_t occlusion_num_levels;
+    int32_t occlusion_level_widths[OCCLUSION_MAX_NUM_LEVELS];
+    int32_t occlusion_level_heights[OCCLUSION_MAX_NUM_LEVELS];
+    uint32_t* occlusion_min_depths[OCCLUSION_MAX_NUM_LEVELS];
+    uint32_t* occlusion_max_depths[OCCLUSION_MAX_NUM_LEVELS];
+    uint32_t* occlusion_readback;
+
+    // Batch rendering: a renderer per thread of the rasterizer's pool, with framebuffers of the last batch's size.
+    // They share nothing but the scene, so each can render whole views on its own.
+    renderer_t** batch_renderers;
+    int32_t num_batch_renderers;
+    int32_t batch_width;
+    int32_t batch_height;
+
+    uint64_t pc_frequency;
+    renderer_perfcounters_t perfcounters;
+
+    renderer_statistics_t statistics;
+} renderer_t;
+
+renderer_t* new_renderer(int32_t fbwidth, int32_t fbheight)
+{
+    renderer_t* rd = (renderer_t*)malloc(sizeof(renderer_t));
+    assert(rd);
+
+    rd->fb = new_framebuffer(fbwidth, fbheight);
+    assert(rd->fb);
+    rd->fbwidth = fbwidth;
+    rd->fbheight = fbheight;
+
+    rd->visibility_buffer = 0;
+    rd->texturing = 0;
+    rd->reversed_z = 0;
+    rd->pipelining = 0;
+    rd->frame_fence = 0;
+    rd->tile_width = framebuffer_get_tile_width(rd->fb);
+    rd->large_pages = 0;
+
+    rd->incremental = 0;
+    rd->incremental_valid = 0;
+    rd->incremental_scene = NULL;
+    rd->incremental_num_changes = 0;
+
+    rd->depth_prepass = 0;
+    rd->drawing_depth_prepass = 0;
+
+    rd->draw_order = draw_order_scene;
+    rd->draws = NULL;
+    rd->draws_scratch = NULL;
+    rd->num_draws = 0;
+    rd->draws_capacity = 0;
+
+    rd->xformed_positions = NULL;
+    rd->xformed_capacity = 0;
+
+    rd->occlusion_culling = 0;
+
+    rd->batch_renderers = NULL;
+    rd->num_batch_renderers = 0;
+    rd->batch_width = 0;
+    rd->batch_height = 0;
+
+    int32_t occlusion_width = (fbwidth + OCCLUSION_DOWNSCALE - 1) / OCCLUSION_DOWNSCALE;
+    int32_t occlusion_height = (fbheight + OCCLUSION_DOWNSCALE - 1) / OCCLUSION_DOWNSCALE;
+    rd->occlusion_fb = new_framebuffer_with_flags(occlusion_width, occlusion_height, framebuffer_flag_depth_only);
+    assert(rd->occlusion_fb);
+
+    rd->occlusion_readback = (uint32_t*)malloc(sizeof(uint32_t) * occlusion_width * occlusion_height);
+    assert(rd->occlusion_readback);
+
+    rd->occlusion_num_levels = 0;
+    for (int32_t level_width = occlusion_width, level_height = occlusion_height;
+        rd->occlusion_num_levels < OCCLUSION_MAX_NUM_LEVELS;
+        level_width = (level_width + 1) / 2, level_height = (level_height + 1) / 2)
+    {
+        int32_t level = rd->occlusion_num_levels;
+        rd->occlusion_level_widths[level] = level_width;
+        rd->occlusion_level_heights[level] = level_height;
+        rd->occlusion_min_depths[level] = (uint32_t*)malloc(sizeof(uint32_t) * level_width * level_height);
+        assert(rd->occlusion_min_depths[level]);
+        rd->occlusion_max_depths[level] = (uint32_t*)malloc(sizeof(uint32_t) * level_width * level_height);
+        assert(rd->occlusion_max_depths[level]);
+        rd->occlusion_num_levels++;
+
+        if (level_width == 1 && level_height == 1)
+        {
+            break;
+        }
+    }
+
+    rd->pc_frequency = qpf();
+    memset(&rd->perfcounters, 0, sizeof(renderer_perfcounters_t));
+    memset(&rd->statistics, 0, sizeof(renderer_statistics_t));
+
+    return rd;
+}
+
+void delete_renderer(renderer_t* rd)
+{
+    if (!rd)
+        return;
+
+    for (int32_t i = 0; i < rd->num_batch_renderers; i++)
+    {
+        delete_renderer(rd->batch_renderers[i]);
+    }
+    free(rd->batch_renderers);
+
+    for (int32_t level = 0; level < rd->occlusion_num_levels; level++)
+    {
+        free(rd->occlusion_min_depths[level]);
+        free(rd->occlusion_max_depths[level]);
+    }
+    free(rd->occlusion_readback);
+    delete_framebuffer(rd->occlusion_fb);
+
+    free(rd->draws);
+    free(rd->draws_scratch);
+    free(rd->xformed_positions);
+    delete_framebuffer(rd->fb);
+    free(rd);
+}
+
+static void s15164x4_mul(const int32_t* a, const int32_t* b, int32_t* dst)
+{
+    dst[0]  = s1516_fma(a[0],  b[0], s1516_fma(a[4],  b[1], s1516_fma( a[8],  b[2], s1516_mul(a[12],  b[3]))));
+    dst[1]  = s1516_fma(a[1],  b[0], s1516_fma(a[5],  b[1], s1516_fma( a[9],  b[2], s1516_mul(a[13],  b[3]))));
+    dst[2]  = s1516_fma(a[2],  b[0], s1516_fma(a[6],  b[1], s1516_fma(a[10],  b[2], s1516_mul(a[14],  b[3]))));
+    dst[3]  = s1516_fma(a[3],  b[0], s1516_fma(a[7],  b[1], s1516_fma(a[11],  b[2], s1516_mul(a[15],  b[3]))));
+    dst[4]  = s1516_fma(a[0],  b[4], s1516_fma(a[4],  b[5], s1516_fma( a[8],  b[6], s1516_mul(a[12],  b[7]))));
+    dst[5]  = s1516_fma(a[1],  b[4], s1516_fma(a[5],  b[5], s1516_fma( a[9],  b[6], s1516_mul(a[13],  b[7]))));
+    dst[6]  = s1516_fma(a[2],  b[4], s1516_fma(a[6],  b[5], s1516_fma(a[10],  b[6], s1516_mul(a[14],  b[7]))));
+    dst[7]  = s1516_fma(a[3],  b[4], s1516_fma(a[7],  b[5], s1516_fma(a[11],  b[6], s1516_mul(a[15],  b[7]))));
+    dst[8]  = s1516_fma(a[0],  b[8], s1516_fma(a[4],  b[9], s1516_fma( a[8], b[10], s1516_mul(a[12], b[11]))));
+    dst[9]  = s1516_fma(a[1],  b[8], s1516_fma(a[5],  b[9], s1516_fma( a[9], b[10], s1516_mul(a[13], b[11]))));
+    dst[10] = s1516_fma(a[2],  b[8], s1516_fma(a[6],  b[9], s1516_fma(a[10], b[10], s1516_mul(a[14], b[11]))));
+    dst[11] = s1516_fma(a[3],  b[8], s1516_fma(a[7],  b[9], s1516_fma(a[11], b[10], s1516_mul(a[15], b[11]))));
+    dst[12] = s1516_fma(a[0], b[12], s1516_fma(a[4], b[13], s1516_fma( a[8], b[14], s1516_mul(a[12], b[15]))));
+    dst[13] = s1516_fma(a[1], b[12], s1516_fma(a[5], b[13], s1516_fma( a[9], b[14], s1516_mul(a[13], b[15]))));
+    dst[14] = s1516_fma(a[2], b[12], s1516_fma(a[6], b[13], s1516_fma(a[10], b[14], s1516_mul(a[14], b[15]))));
+    dst[15] = s1516_fma(a[3], b[12], s1516_fma(a[7], b[13], s1516_fma(a[11], b[14], s1516_mul(a[15], b[15]))));
+}
+
+#ifdef USE_HSWni
+// 8-wide version of s1516_fma. Reproduces the scalar rounding and saturation exactly.
+// AVX2 has no 64-bit arithmetic shift or 64-bit min/max, so they are emulated with compares and blends.
+static __m256i s1516_fma_avx2(__m256i a, __m256i b, __m256i c)
+{
+    const __m256i one_s1516 = _mm256_set1_epi32(1 << 16);
+    const __m256i round_half = _mm256_set1_epi64x(1 << 15);
+    const __m256i int32_max = _mm256_set1_epi64x(0x7FFFFFFF);
+    const __m256i int32_min = _mm256_set1_epi64x(-(int64_t)0x80000000);
+
+    __m256i results[2];
+    for (int32_t odd = 0; odd < 2; odd++)
+    {
+        // _mm256_mul_epi32 only reads the even 32-bit lanes, so the odd lanes are shifted down first.
+        __m256i a64 = odd ? _mm256_srli_epi64(a, 32) : a;
+        __m256i b64 = odd ? _mm256_srli_epi64(b, 32) : b;
+        __m256i c64 = odd ? _mm256_srli_epi64(c, 32) : c;
+
+        // a * b + (c << 16), computed as a 64-bit signed multiply-add (c * 2^16 sign-extends c for free)
+        __m256i temp = _mm256_add_epi64(_mm256_mul_epi32(a64, b64), _mm256_mul_epi32(c64, one_s1516));
+
+        // Rounding: mid values are rounded up
+        temp = _mm256_add_epi64(temp, round_half);
+
+        // Correct by dividing by base (arithmetic shift right by 16)
+        __m256i sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), temp);
+        temp = _mm256_or_si256(_mm256_srli_epi64(temp, 16), _mm256_slli_epi64(sign, 48));
+
+        // saturate to range of int32_t
+        temp = _mm256_blendv_epi8(temp, int32_max, _mm256_cmpgt_epi64(temp, int32_max));
+        temp = _mm256_blendv_epi8(temp, int32_min, _mm256_cmpgt_epi64(int32_min, temp));
+
+        results[odd] = temp;
+    }
+
+    // the low 32 bits of each 64-bit lane hold the results. interleave them back together.
+    return _mm256_blend_epi32(results[0], _mm256_slli_epi64(results[1], 32), 0xAA);
+}
+#endif
+
+#ifdef USE_HSWni
+// transforms 8 xyz s15.16 vertices (SoA) by a matrix broadcast into m, and stores them as AoS xyzw
+static __forceinline void s1516_transform_8_positions_avx2(const __m256i* m, __m256i x, __m256i y, __m256i z, int32_t* xformed)
+{
+    __m256i X = s1516_fma_avx2(m[0], x, s1516_fma_avx2(m[4], y, s1516_fma_avx2(m[8], z, m[12])));
+    __m256i Y = s1516_fma_avx2(m[1], x, s1516_fma_avx2(m[5], y, s1516_fma_avx2(m[9], z, m[13])));
+    __m256i Z = s1516_fma_avx2(m[2], x, s1516_fma_avx2(m[6], y, s1516_fma_avx2(m[10], z, m[14])));
+    __m256i W = s1516_fma_avx2(m[3], x, s1516_fma_avx2(m[7], y, s1516_fma_avx2(m[11], z, m[15])));
+
+    // transpose SoA xxxxxxxx/yyyyyyyy/zzzzzzzz/wwwwwwww into AoS xyzw xyzw ...
+    __m256i xy_lo = _mm256_unpacklo_epi32(X, Y); // x0 y0 x1 y1 | x4 y4 x5 y5
+    __m256i xy_hi = _mm256_unpackhi_epi32(X, Y); // x2 y2 x3 y3 | x6 y6 x7 y7
+    __m256i zw_lo = _mm256_unpacklo_epi32(Z, W);
+    __m256i zw_hi = _mm256_unpackhi_epi32(Z, W);
+
+    __m256i v04 = _mm256_unpacklo_epi64(xy_lo, zw_lo); // v0 | v4
+    __m256i v15 = _mm256_unpackhi_epi64(xy_lo, zw_lo); // v1 | v5
+    __m256i v26 = _mm256_unpacklo_epi64(xy_hi, zw_hi); // v2 | v6
+    __m256i v37 = _mm256_unpackhi_epi64(xy_hi, zw_hi); // v3 | v7
+
+    __m256i* dst = (__m256i*)xformed;
+    _mm256_storeu_si256(dst + 0, _mm256_permute2x128_si256(v04, v15, 0x20));
+    _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(v26, v37, 0x20));
+    _mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(v04, v15, 0x31));
+    _mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(v26, v37, 0x31));
+}
+#endif
+
+static __forceinline void s1516_transform_position(const int32_t* mvp, const int32_t* vert, int32_t* dst)
+{
+    dst[0] = s1516_fma(mvp[0], vert[0], s1516_fma(mvp[4], vert[1], s1516_fma(mvp[8], vert[2], mvp[12])));
+    dst[1] = s1516_fma(mvp[1], vert[0], s1516_fma(mvp[5], vert[1], s1516_fma(mvp[9], vert[2], mvp[13])));
+    dst[2] = s1516_fma(mvp[2], vert[0], s1516_fma(mvp[6], vert[1], s1516_fma(mvp[10], vert[2], mvp[14])));
+    dst[3] = s1516_fma(mvp[3], vert[0], s1516_fma(mvp[7], vert[1], s1516_fma(mvp[11], vert[2], mvp[15])));
+}
+
+// transforms xyz s15.16 positions into xyzw clip space positions (AoS, as consumed by framebuffer_draw_indexed)
+static void s1516_transform_positions(const int32_t* mvp, const int32_t* positions, uint32_t num_positions, int32_t* xformed)
+{
+    uint32_t vertex_id = 0;
+
+#ifdef USE_HSWni
+    // 8 vertices at a time
+    __m256i m[16];
+    for (int32_t i = 0; i < 16; i++)
+    {
+        m[i] = _mm256_set1_epi32(mvp[i]);
+    }
+
+    const __m256i xyz_offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+
+    for (; vertex_id + 8 <= num_positions; vertex_id += 8)
+    {
+        const int* src = (const int*)&positions[vertex_id * 3];
+        __m256i x = _mm256_i32gather_epi32(src + 0, xyz_offsets, 4);
+        __m256i y = _mm256_i32gather_epi32(src + 1, xyz_offsets, 4);
+        __m256i z = _mm256_i32gather_epi32(src + 2, xyz_offsets, 4);
+
+        s1516_transform_8_positions_avx2(m, x, y, z, &xformed[vertex_id * 4]);
+    }
+#endif
+
+    // leftovers (or everything, without SIMD)
+    for (; vertex_id < num_positions; vertex_id++)
+    {
+        s1516_transform_position(mvp, &positions[vertex_id * 3], &xformed[vertex_id * 4]);
+    }
+}
+
+// Same as s1516_transform_positions, for each view whose bit is set in view_mask, with the positions read only once.
+// The positions of view i are written view_stride ints after those of view i - 1.
+static void s1516_transform_positions_views(const int32_t (*mvps)[16], uint32_t view_mask, const int32_t* positions, uint32_t num_positions, int32_t* xformed, uint32_t view_stride)
+{
+    uint32_t vertex_id = 0;
+
+#ifdef USE_HSWni
+    __m256i m[RENDERER_MAX_VIEWS][16];
+    for (uint32_t views_left = view_mask; views_left; views_left &= views_left - 1)
+    {
+        uint32_t view = _tzcnt_u32(views_left);
+        for (int32_t i = 0; i < 16; i++)
+        {
+            m[view][i] = _mm256_set1_epi32(mvps[view][i]);
+        }
+    }
+
+    const __m256i xyz_offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+
+    for (; vertex_id + 8 <= num_positions; vertex_id += 8)
+    {
+        const int* src = (const int*)&positions[vertex_id * 3];
+        __m256i x = _mm256_i32gather_epi32(src + 0, xyz_offsets, 4);
+        __m256i y = _mm256_i32gather_epi32(src + 1, xyz_offsets, 4);
+        __m256i z = _mm256_i32gather_epi32(src + 2, xyz_offsets, 4);
+
+        for (uint32_t views_left = view_mask; views_left; views_left &= views_left - 1)
+        {
+            uint32_t view = _tzcnt_u32(views_left);
+            s1516_transform_8_positions_avx2(m[view], x, y, z, &xformed[view * view_stride + vertex_id * 4]);
+        }
+    }
+#endif
+
+    for (; vertex_id < num_positions; vertex_id++)
+    {
+        for (uint32_t views_left = view_mask; views_left; views_left &= views_left - 1)
+        {
+            uint32_t view = _tzcnt_u32(views_left);
+            s1516_transform_position(mvps[view], &positions[vertex_id * 3], &xformed[view * view_stride + vertex_id * 4]);
+        }
+    }
+}
+
+static bool g_FilterTriangles = false;
+static int g_FilterTriangle0 = -1;
+static int g_FilterTriangle1 = -1;
+static int g_FilterTriangle2 = -1;
+
+static bool g_FilterInstances = false;
+static int g_FilterInstance0 = -1;
+
+static bool g_CullClusters = true;
+
+// Extra distance (in model space units) a cluster has to be past a plane before it gets culled.
+// Covers the difference between the float culling math and the fixed point transform.
+#define CLUSTER_CULL_EPSILON 1e-3f
+
+typedef struct cluster_culling_t
+{
+    // xyzd planes pointing into the view frustum, normalized
+    float frustum_planes[6][4];
+
+    // camera position, in model space
+    float eye[3];
+
+    // xyzd plane through the eye facing the view direction, normalized. The distance to it is the view depth.
+    float depth_plane[4];
+
+    // size of a subpixel at a view depth of 1, in model space units, in the direction where pixels are the largest
+    float subpixel_size;
+} cluster_culling_t;
+
+// width and height are the size in pixels of the framebuffer the view is drawn into
+static void setup_cluster_culling(cluster_culling_t* culling, const int32_t* view, const int32_t* viewproj, int32_t width, int32_t height)
+{
+    // Gribb/Hartmann plane extraction for D3D style clip space (-w <= x,y <= w, 0 <= z < w)
+    float rows[4][4];
+    for (int32_t row = 0; row < 4; row++)
+    {
+        for (int32_t col = 0; col < 4; col++)
+        {
+            rows[row][col] = (float)viewproj[col * 4 + row] / (1 << 16);
+        }
+    }
+
+    for (int32_t k = 0; k < 4; k++)
+    {
+        culling->frustum_planes[0][k] = rows[3][k] + rows[0][k];
+        culling->frustum_planes[1][k] = rows[3][k] - rows[0][k];
+        culling->frustum_planes[2][k] = rows[3][k] + rows[1][k];
+        culling->frustum_planes[3][k] = rows[3][k] - rows[1][k];
+        culling->frustum_planes[4][k] = rows[2][k];
+        culling->frustum_planes[5][k] = rows[3][k] - rows[2][k];
+    }
+
+    for (int32_t plane = 0; plane < 6; plane++)
+    {
+        float* p = culling->frustum_planes[plane];
+        float length = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        float inv_length = length == 0.0f ? 0.0f : 1.0f / length;
+        p[0] *= inv_length;
+        p[1] *= inv_length;
+        p[2] *= inv_length;
+        p[3] *= inv_length;
+    }
+
+    // clip space w is the view depth with a perspective projection
+    {
+        float* p = culling->depth_plane;
+        float length = sqrtf(rows[3][0] * rows[3][0] + rows[3][1] * rows[3][1] + rows[3][2] * rows[3][2]);
+        float inv_length = length == 0.0f ? 0.0f : 1.0f / length;
+        for (int32_t k = 0; k < 4; k++)
+        {
+            p[k] = rows[3][k] * inv_length;
+        }
+
+        // x / w and y / w span [-1,1] over the width and height, and window coordinates are 16.8 fixed point
+        float x_pixels = sqrtf(rows[0][0] * rows[0][0] + rows[0][1] * rows[0][1] + rows[0][2] * rows[0][2]) * inv_length * 0.5f * width;
+        float y_pixels = sqrtf(rows[1][0] * rows[1][0] + rows[1][1] * rows[1][1] + rows[1][2] * rows[1][2]) * inv_length * 0.5f * height;
+        float min_pixels = x_pixels < y_pixels ? x_pixels : y_pixels;
+        culling->subpixel_size = min_pixels == 0.0f ? FLT_MAX : 1.0f / (min_pixels * (1 << 8));
+    }
+
+    // the view matrix is affine, so the eye is where its rotation part maps -translation: eye = -A^-1 * t
+    float a[3][3];
+    for (int32_t row = 0; row < 3; row++)
+    {
+        for (int32_t col = 0; col < 3; col++)
+        {
+            a[row][col] = (float)view[col * 4 + row] / (1 << 16);
+        }
+    }
+
+    float t[3] = { (float)view[12] / (1 << 16), (float)view[13] / (1 << 16), (float)view[14] / (1 << 16) };
+
+    float cofactors[3][3];
+    for (int32_t row = 0; row < 3; row++)
+    {
+        for (int32_t col = 0; col < 3; col++)
+        {
+            int32_t r1 = (row + 1) % 3, r2 = (row + 2) % 3;
+            int32_t c1 = (col + 1) % 3, c2 = (col + 2) % 3;
+            cofactors[row][col] = a[r1][c1] * a[r2][c2] - a[r1][c2] * a[r2][c1];
+        }
+    }
+
+    float det = a[0][0] * cofactors[0][0] + a[0][1] * cofactors[0][1] + a[0][2] * cofactors[0][2];
+    float inv_det = det == 0.0f ? 0.0f : 1.0f / det;
+
+    // A^-1 is the transposed cofactor matrix over the determinant
+    for (int32_t k = 0; k < 3; k++)
+    {
+        culling->eye[k] = -(cofactors[0][k] * t[0] + cofactors[1][k] * t[1] + cofactors[2][k] * t[2]) * inv_det;
+    }
+}
+
+// 0 = visible, 1 = outside the frustum, 2 = all triangles are backfacing
+static int32_t cull_cluster(const cluster_culling_t* culling, const mesh_cluster_t* cluster)
+{
+    const float* sphere = cluster->bounding_sphere;
+
+    for (int32_t plane = 0; plane < 6; plane++)
+    {
+        const float* p = culling->frustum_planes[plane];
+        float distance = p[0] * sphere[0] + p[1] * sphere[1] + p[2] * sphere[2] + p[3];
+        if (distance < -sphere[3] - CLUSTER_CULL_EPSILON)
+        {
+            return 1;
+        }
+    }
+
+    if (cluster->cone_cutoff < 1.0f)
+    {
+        // every point of the bounding sphere has to be seen from inside the backfacing cone
+        float to_center[3] = { sphere[0] - culling->eye[0], sphere[1] - culling->eye[1], sphere[2] - culling->eye[2] };
+        float distance = sqrtf(to_center[0] * to_center[0] + to_center[1] * to_center[1] + to_center[2] * to_center[2]);
+        float dp = to_center[0] * cluster->cone_axis[0] + to_center[1] * cluster->cone_axis[1] + to_center[2] * cluster->cone_axis[2];
+
+        // snapping to subpixels can turn small triangles to face the viewer, so the view directions need to be that far inside the cone.
+        // the turn is about the subpixel size at the farthest depth of the cluster times the perimeter over area, doubled to stay on the safe side.
+        const float* p = culling->depth_plane;
+        float max_depth = p[0] * sphere[0] + p[1] * sphere[1] + p[2] * sphere[2] + p[3] + sphere[3];
+        float snap_margin = 2.0f * culling->subpixel_size * max_depth * cluster->max_perimeter_over_area;
+
+        if (dp - sphere[3] >= (cluster->cone_cutoff + snap_margin) * (distance + sphere[3]) + CLUSTER_CULL_EPSILON)
+        {
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+static void reserve_xformed_positions(renderer_t* rd, uint32_t vertex_count)
+{
+    if (vertex_count > rd->xformed_capacity)
+    {
+        free(rd->xformed_positions);
+        rd->xformed_capacity = vertex_count;
+        rd->xformed_positions = (int32_t*)malloc(sizeof(int32_t) * 4 * rd->xformed_capacity);
+        assert(rd->xformed_positions);
+    }
+}
+
+// Sets up the pixel stage for the material of the model.
+// Returns whether the model is textured, in which case the stage has to be set back to previous_stage after drawing it.
+static int32_t begin_model_pixel_stage(renderer_t* rd, framebuffer_t* fb, scene_t* sc, const model_t* model, pixel_stage_t* previous_stage)
+{
+    // textures only go to color buffers: not to the occlusion pass, the depth prepass or the renderer's visibility buffer
+    int32_t textured = fb != rd->occlusion_fb && !rd->drawing_depth_prepass && rd->texturing && !(fb == rd->fb && rd->visibility_buffer) && model->texture_id != -1;
+    if (textured)
+    {
+        *previous_stage = framebuffer_get_pixel_stage(fb);
+        framebuffer_set_pixel_stage(fb, pixel_stage_textured);
+        framebuffer_set_vertex_attributes(fb, model->texcoords, 2);
+        framebuffer_set_texture(fb, sc->textures[model->texture_id]);
+    }
+
+    return textured;
+}
+
+static void end_model_pixel_stage(framebuffer_t* fb, int32_t textured, pixel_stage_t previous_stage)
+{
+    if (textured)
+    {
+        framebuffer_set_pixel_stage(fb, previous_stage);
+    }
+}
+
+// visibility_instance_id identifies the instance in the visibility ids of the triangles drawn
+static void renderer_render_instance(renderer_t* rd, framebuffer_t* fb, scene_t* sc, instance_t* instance, uint32_t visibility_instance_id, int32_t* viewproj, const cluster_culling_t* culling)
+{
+    int32_t model_id = instance->model_id;
+    model_t* model = &sc->models[model_id];
+
+    uint64_t renderinstance_start_pc = qpc();
+
+    reserve_xformed_positions(rd, model->vertex_count);
+
+    // TODO: incorporate modelworld matrix
+
+    pixel_stage_t previous_stage;
+    int32_t textured = begin_model_pixel_stage(rd, fb, sc, model, &previous_stage);
+
+    if (g_FilterTriangles && (g_FilterTriangle0 != -1 || g_FilterTriangle1 != -1 || g_FilterTriangle2 != -1))
+    {
+        uint64_t mvptransform_start_pc = qpc();
+        s1516_transform_positions(viewproj, model->positions, model->vertex_count, rd->xformed_positions);
+        rd->perfcounters.mvptransform += qpc() - mvptransform_start_pc;
+
+        for (uint32_t index_id = 0; index_id < model->index_count; index_id += 3)
+        {
+            if (index_id / 3 != g_FilterTriangle0 && index_id / 3 != g_FilterTriangle1 && index_id / 3 != g_FilterTriangle2)
+            {
+                continue;
+            }
+
+            framebuffer_draw_indexed_with_ids(fb, rd->xformed_positions, &model->indices[index_id], 3, VISIBILITY_ID(visibility_instance_id, index_id / 3));
+        }
+    }
+    else
+    {
+        // Clusters own contiguous ranges of vertices and indices, so consecutive visible clusters are
+        // transformed and drawn as one run. Every vertex of a visible cluster is transformed exactly once.
+        uint32_t run_first_cluster = 0;
+        for (uint32_t cluster_id = 0; cluster_id <= model->cluster_count; cluster_id++)
+        {
+            if (cluster_id < model->cluster_count)
+            {
+                int32_t culled = g_CullClusters ? cull_cluster(culling, &model->clusters[cluster_id]) : 0;
+                if (culled == 0)
+                {
+                    rd->statistics.clusters_drawn++;
+                    continue;
+                }
+                
+                if (culled == 1)
+                    rd->statistics.clusters_frustum_culled++;
+                else
+                    rd->statistics.clusters_backface_culled++;
+            }
+
+            // flush the run of visible clusters preceding this one
+            if (run_first_cluster < cluster_id)
+            {
+                const mesh_cluster_t* first = &model->clusters[run_first_cluster];
+                const mesh_cluster_t* last = &model->clusters[cluster_id - 1];
+
+                uint64_t mvptransform_start_pc = qpc();
+                s1516_transform_positions(
+                    viewproj,
+                    &model->positions[first->first_vertex * 3],
+                    last->first_vertex + last->vertex_count - first->first_vertex,
+                    &rd->xformed_positions[first->first_vertex * 4]);
+                rd->perfcounters.mvptransform += qpc() - mvptransform_start_pc;
+
+                framebuffer_draw_indexed_with_ids(
+                    fb, rd->xformed_positions,
+                    &model->indices[first->first_index], last->first_index + last->index_count - first->first_index,
+                    VISIBILITY_ID(visibility_instance_id, first->first_index / 3));
+            }
+
+            run_first_cluster = cluster_id + 1;
+        }
+    }
+
+    end_model_pixel_stage(fb, textured, previous_stage);
+
+    rd->perfcounters.renderinstance += qpc() - renderinstance_start_pc;
+}
+
+// Draws one cluster of an instance into the main framebuffer, for draw orders that interleave the clusters of instances.
+// The cluster was already culled.
+static void renderer_render_cluster(renderer_t* rd, scene_t* sc, instance_t* instance, uint32_t visibility_instance_id, uint32_t cluster_id, int32_t* viewproj)
+{
+    model_t* model = &sc->models[instance->model_id];
+    const mesh_cluster_t* cluster = &model->clusters[cluster_id];
+
+    uint64_t renderinstance_start_pc = qpc();
+
+    reserve_xformed_positions(rd, model->vertex_count);
+
+    pixel_stage_t previous_stage;
+    int32_t textured = begin_model_pixel_stage(rd, rd->fb, sc, model, &previous_stage);
+
+    uint64_t mvptransform_start_pc = qpc();
+    s1516_transform_positions(
+        viewproj,
+        &model->positions[cluster->first_vertex * 3],
+        cluster->vertex_count,
+        &rd->xformed_positions[cluster->first_vertex * 4]);
+    rd->perfcounters.mvptransform += qpc() - mvptransform_start_pc;
+
+    framebuffer_draw_indexed_with_ids(
+        rd->fb, rd->xformed_positions,
+        &model->indices[cluster->first_index], cluster->index_count,
+        VISIBILITY_ID(visibility_instance_id, cluster->first_index / 3));
+
+    end_model_pixel_stage(rd->fb, textured, previous_stage);
+
+    rd->perfcounters.renderinstance += qpc() - renderinstance_start_pc;
+}
+
+// Draws an instance into the framebuffer of each view, culling its clusters against all the views at once.
+// Consecutive clusters visible in the same views are transformed and drawn as one run, with each vertex read once for all of them.
+static void renderer_render_instance_views(renderer_t* rd, int32_t num_views, framebuffer_t* const* fbs, scene_t* sc, instance_t* instance, uint32_t visibility_instance_id, const int32_t (*viewprojs)[16], const cluster_culling_t* cullings)
+{
+    model_t* model = &sc->models[instance->model_id];
+
+    uint64_t renderinstance_start_pc = qpc();
+
+    // the positions of each view are vertex_count apart
+    reserve_xformed_positions(rd, model->vertex_count * num_views);
+    uint32_t view_stride = model->vertex_count * 4;
+
+    int32_t textured[RENDERER_MAX_VIEWS];
+    pixel_stage_t previous_stages[RENDERER_MAX_VIEWS];
+    for (int32_t view = 0; view < num_views; view++)
+    {
+        textured[view] = begin_model_pixel_stage(rd, fbs[view], sc, model, &previous_stages[view]);
+    }
+
+    uint32_t run_first_cluster = 0;
+    uint32_t run_view_mask = 0;
+    for (uint32_t cluster_id = 0; cluster_id <= model->cluster_count; cluster_id++)
+    {
+        uint32_t view_mask = 0;
+        if (cluster_id < model->cluster_count)
+        {
+            for (int32_t view = 0; view < num_views; view++)
+            {
+                int32_t culled = g_CullClusters ? cull_cluster(&cullings[view], &model->clusters[cluster_id]) : 0;
+                if (culled == 0)
+                {
+                    rd->statistics.clusters_drawn++;
+                    view_mask |= 1 << view;
+                }
+                else if (culled == 1)
+                    rd->statistics.clusters_frustum_culled++;
+                else
+                    rd->statistics.clusters_backface_culled++;
+            }
+
+            if (view_mask == run_view_mask)
+            {
+                continue;
+            }
+        }
+
+        // flush the run of clusters preceding this one, which are visible in the same views
+        if (run_view_mask != 0)
+        {
+            const mesh_cluster_t* first = &model->clusters[run_first_cluster];
+            const mesh_cluster_t* last = &model->clusters[cluster_id - 1];
+
+            uint64_t mvptransform_start_pc = qpc();
+            s1516_transform_positions_views(
+                viewprojs, run_view_mask,
+                &model->positions[first->first_vertex * 3],
+                last->first_vertex + last->vertex_count - first->first_vertex,
+                &rd->xformed_positions[first->first_vertex * 4],
+                view_stride);
+            rd->perfcounters.mvptransform += qpc() - mvptransform_start_pc;
+
+            for (uint32_t views_left = run_view_mask; views_left; views_left &= views_left - 1)
+            {
+                uint32_t view = _tzcnt_u32(views_left);
+                framebuffer_draw_indexed_with_ids(
+                    fbs[view], &rd->xformed_positions[view * view_stride],
+                    &model->indices[first->first_index], last->first_index + last->index_count - first->first_index,
+                    VISIBILITY_ID(visibility_instance_id, first->first_index / 3));
+            }
+        }
+
+        run_first_cluster = cluster_id;
+        run_view_mask = view_mask;
+    }
+
+    for (int32_t view = 0; view < num_views; view++)
+    {
+        end_model_pixel_stage(fbs[view], textured[view], previous_stages[view]);
+    }
+
+    rd->perfcounters.renderinstance += qpc() - renderinstance_start_pc;
+}
+
+static void push_draw(renderer_t* rd, float depth, uint32_t instance_id, uint32_t visibility_instance_id, uint32_t cluster_id)
+{
+    if (rd->num_draws == rd->draws_capacity)
+    {
+        rd->draws_capacity = rd->draws_capacity ? rd->draws_capacity * 2 : SCENE_MAX_NUM_INSTANCES;
+
+        rd->draws = (draw_t*)realloc(rd->draws, sizeof(draw_t) * rd->draws_capacity);
+        assert(rd->draws);
+
+        free(rd->draws_scratch);
+        rd->draws_scratch = (draw_t*)malloc(sizeof(draw_t) * rd->draws_capacity);
+        assert(rd->draws_scratch);
+    }
+
+    draw_t* draw = &rd->draws[rd->num_draws++];
+    draw->sort_key = 0;
+    draw->depth = depth;
+    draw->instance_id = instance_id;
+    draw->visibility_instance_id = visibility_instance_id;
+    draw->cluster_id = cluster_id;
+}
+
+// View depth of the point of a model space sphere farthest from the eye.
+// Sorting on the far side puts large walls and floors, whose spheres often contain the eye, behind the smaller geometry in front of them.
+static float sphere_view_depth(const cluster_culling_t* culling, const float* center, float radius)
+{
+    const float* p = culling->depth_plane;
+    return p[0] * center[0] + p[1] * center[1] + p[2] * center[2] + p[3] + radius;
+}
+
+// Quantizes the depths of the draws to sort keys over the range of depths of the frame, then sorts them front to back.
+// This is a stable LSD radix sort, so draws at the same quantized depth stay in scene order.
+static void sort_draws_front_to_back(renderer_t* rd)
+{
+    static_assert(DRAW_SORT_KEY_BITS % (2 * DRAW_SORT_RADIX_BITS) == 0, "The sorted draws have to end up back in rd->draws");
+
+    if (rd->num_draws < 2)
+    {
+        return;
+    }
+
+    float min_depth = FLT_MAX, max_depth = -FLT_MAX;
+    for (uint32_t draw_i = 0; draw_i < rd->num_draws; draw_i++)
+    {
+        min_depth = std::min(min_depth, rd->draws[draw_i].depth);
+        max_depth = std::max(max_depth, rd->draws[draw_i].depth);
+    }
+
+    const uint32_t max_key = (1u << DRAW_SORT_KEY_BITS) - 1;
+    float key_scale = max_depth > min_depth ? (float)max_key / (max_depth - min_depth) : 0.0f;
+    for (uint32_t draw_i = 0; draw_i < rd->num_draws; draw_i++)
+    {
+        uint32_t key = (uint32_t)((rd->draws[draw_i].depth - min_depth) * key_scale);
+        rd->draws[draw_i].sort_key = std::min(key, max_key);
+    }
+
+    draw_t* src = rd->draws;
+    draw_t* dst = rd->draws_scratch;
+    for (int32_t shift = 0; shift < DRAW_SORT_KEY_BITS; shift += DRAW_SORT_RADIX_BITS)
+    {
+        const uint32_t digit_mask = (1 << DRAW_SORT_RADIX_BITS) - 1;
+
+        uint32_t offsets[1 << DRAW_SORT_RADIX_BITS] = {};
+        for (uint32_t draw_i = 0; draw_i < rd->num_draws; draw_i++)
+        {
+            offsets[(src[draw_i].sort_key >> shift) & digit_mask]++;
+        }
+
+        uint32_t offset = 0;
+        for (uint32_t digit = 0; digit <= digit_mask; digit++)
+        {
+            uint32_t count = offsets[digit];
+            offsets[digit] = offset;
+            offset += count;
+        }
+
+        for (uint32_t draw_i = 0; draw_i < rd->num_draws; draw_i++)
+        {
+            dst[offsets[(src[draw_i].sort_key >> shift) & digit_mask]++] = src[draw_i];
+        }
+
+        std::swap(src, dst);
+    }
+}
+
+// Builds the min/max depth pyramid from the depth buffer of the occlusion framebuffer
+static void build_occlusion_pyramid(renderer_t* rd)
+{
+    int32_t width = rd->occlusion_level_widths[0];
+    int32_t height = rd->occlusion_level_heights[0];
+
+    framebuffer_pack_row_major(rd->occlusion_fb, attachment_depth, 0, 0, width, height, pixelformat_r32_unorm, rd->occlusion_readback);
+
+    // Occluders were sampled at the center of their low resolution pixels only, so their real coverage at full resolution
+    // is known within a pixel. The max depth is dilated by one pixel to account for that.
+    uint32_t* min_depths = rd->occlusion_min_depths[0];
+    uint32_t* max_depths = rd->occlusion_max_depths[0];
+    for (int32_t y = 0; y < height; y++)
+    {
+        for (int32_t x = 0; x < width; x++)
+        {
+            uint32_t max_depth = 0;
+            for (int32_t ny = y - 1; ny <= y + 1; ny++)
+            {
+                for (int32_t nx = x - 1; nx <= x + 1; nx++)
+                {
+                    // outside the framebuffer counts as uncovered
+                    uint32_t depth = 0xFFFFFFFF;
+                    if (nx >= 0 && nx < width && ny >= 0 && ny < height)
+                    {
+                        depth = rd->occlusion_readback[ny * width + nx];
+                    }
+                    max_depth = depth > max_depth ? depth : max_depth;
+                }
+            }
+
+            min_depths[y * width + x] = rd->occlusion_readback[y * width + x];
+            max_depths[y * width + x] = max_depth;
+        }
+    }
+
+    for (int32_t level = 1; level < rd->occlusion_num_levels; level++)
+    {
+        int32_t src_width = rd->occlusion_level_widths[level - 1];
+        int32_t src_height = rd->occlusion_level_heights[level - 1];
+        const uint32_t* src_min = rd->occlusion_min_depths[level - 1];
+        const uint32_t* src_max = rd->occlusion_max_depths[level - 1];
+
+        int32_t dst_width = rd->occlusion_level_widths[level];
+        int32_t dst_height = rd->occlusion_level_heights[level];
+        uint32_t* dst_min = rd->occlusion_min_depths[level];
+        uint32_t* dst_max = rd->occlusion_max_depths[level];
+
+        for (int32_t y = 0; y < dst_height; y++)
+        {
+            for (int32_t x = 0; x < dst_width; x++)
+            {
+                // odd sizes: the last row/column of the source is reused
+                int32_t x0 = x * 2, x1 = x * 2 + 1 < src_width ? x * 2 + 1 : x * 2;
+                int32_t y0 = y * 2, y1 = y * 2 + 1 < src_height ? y * 2 + 1 : y * 2;
+
+                uint32_t min_depth = src_min[y0 * src_width + x0];
+                min_depth = src_min[y0 * src_width + x1] < min_depth ? src_min[y0 * src_width + x1] : min_depth;
+                min_depth = src_min[y1 * src_width + x0] < min_depth ? src_min[y1 * src_width + x0] : min_depth;
+                min_depth = src_min[y1 * src_width + x1] < min_depth ? src_min[y1 * src_width + x1] : min_depth;
+
+                uint32_t max_depth = src_max[y0 * src_width + x0];
+                max_depth = src_max[y0 * src_width + x1] > max_depth ? src_max[y0 * src_width + x1] : max_depth;
+                max_depth = src_max[y1 * src_width + x0] > max_depth ? src_max[y1 * src_width + x0] : max_depth;
+                max_depth = src_max[y1 * src_width + x1] > max_depth ? src_max[y1 * src_width + x1] : max_depth;
+
+                dst_min[y * dst_width + x] = min_depth;
+                dst_max[y * dst_width + x] = max_depth;
+            }
+        }
+    }
+}
+
+// Bounds of a s15.16 box in normalized device coordinates (xyz). Returns 0 if the box crosses the near plane, since it can't be projected then.
+static int32_t project_bbox(const int32_t* viewproj, const int32_t* bbox_min, const int32_t* bbox_max, float* ndc_min, float* ndc_max)
+{
+    float m[16];
+    for (int32_t i = 0; i < 16; i++)
+    {
+        m[i] = (float)viewproj[i] / (1 << 16);
+    }
+
+    for (int32_t k = 0; k < 3; k++)
+    {
+        ndc_min[k] = FLT_MAX;
+        ndc_max[k] = -FLT_MAX;
+    }
+
+    for (int32_t corner = 0; corner < 8; corner++)
+    {
+        float p[3];
+        p[0] = (float)((corner & 1) ? bbox_max[0] : bbox_min[0]) / (1 << 16);
+        p[1] = (float)((corner & 2) ? bbox_max[1] : bbox_min[1]) / (1 << 16);
+        p[2] = (float)((corner & 4) ? bbox_max[2] : bbox_min[2]) / (1 << 16);
+
+        float x = m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12];
+        float y = m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13];
+        float z = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+        float w = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+
+        if (z <= 0.0f || w <= 0.0f)
+        {
+            return 0;
+        }
+
+        float one_over_w = 1.0f / w;
+        x *= one_over_w;
+        y *= one_over_w;
+        z *= one_over_w;
+
+        ndc_min[0] = x < ndc_min[0] ? x : ndc_min[0];
+        ndc_min[1] = y < ndc_min[1] ? y : ndc_min[1];
+        ndc_min[2] = z < ndc_min[2] ? z : ndc_min[2];
+        ndc_max[0] = x > ndc_max[0] ? x : ndc_max[0];
+        ndc_max[1] = y > ndc_max[1] ? y : ndc_max[1];
+        ndc_max[2] = z > ndc_max[2] ? z : ndc_max[2];
+    }
+
+    return 1;
+}
+
+// Returns 1 if the model's bounding box is certainly hidden behind the occluders
+static int32_t is_instance_occluded(renderer_t* rd, scene_t* sc, instance_t* instance, const int32_t* viewproj)
+{
+    model_t* model = &sc->models[instance->model_id];
+
+    // crosses the near plane: can't project the box, so assume it's visible
+    float ndc_min[3], ndc_max[3];
+    if (!project_bbox(viewproj, model->bbox_min, model->bbox_max, ndc_min, ndc_max))
+    {
+        return 0;
+    }
+
+    float min_x = ndc_min[0], min_y = ndc_min[1], min_z = ndc_min[2];
+    float max_x = ndc_max[0], max_y = ndc_max[1], max_z = ndc_max[2];
+
+    // rectangle of level 0 pixels touched by the box (window y goes down)
+    int32_t width = rd->occlusion_level_widths[0];
+    int32_t height = rd->occlusion_level_heights[0];
+    int32_t rect_x0 = (int32_t)floorf((min_x + 1.0f) * 0.5f * width);
+    int32_t rect_x1 = (int32_t)ceilf((max_x + 1.0f) * 0.5f * width);
+    int32_t rect_y0 = (int32_t)floorf((1.0f - max_y) * 0.5f * height);
+    int32_t rect_y1 = (int32_t)ceilf((1.0f - min_y) * 0.5f * height);
+    rect_x0 = rect_x0 < 0 ? 0 : rect_x0;
+    rect_y0 = rect_y0 < 0 ? 0 : rect_y0;
+    rect_x1 = rect_x1 > width ? width : rect_x1;
+    rect_y1 = rect_y1 > height ? height : rect_y1;
+
+    if (rect_x0 >= rect_x1 || rect_y0 >= rect_y1)
+    {
+        // off screen. that's for frustum culling to deal with.
+        return 0;
+    }
+
+    // pick the level where the rectangle fits in 2x2 pixels
+    int32_t level = 0;
+    while (level + 1 < rd->occlusion_num_levels &&
+        (((rect_x1 - 1) >> level) - (rect_x0 >> level) > 1 || ((rect_y1 - 1) >> level) - (rect_y0 >> level) > 1))
+    {
+        level++;
+    }
+
+    int32_t level_width = rd->occlusion_level_widths[level];
+    uint32_t occluder_min_depth = 0xFFFFFFFF;
+    uint32_t occluder_max_depth = 0;
+    for (int32_t y = rect_y0 >> level; y <= ((rect_y1 - 1) >> level); y++)
+    {
+        for (int32_t x = rect_x0 >> level; x <= ((rect_x1 - 1) >> level); x++)
+        {
+            uint32_t min_depth = rd->occlusion_min_depths[level][y * level_width + x];
+            uint32_t max_depth = rd->occlusion_max_depths[level][y * level_width + x];
+            occluder_min_depth = min_depth < occluder_min_depth ? min_depth : occluder_min_depth;
+            occluder_max_depth = max_depth > occluder_max_depth ? max_depth : occluder_max_depth;
+        }
+    }
+
+    // depth buffer values are z/w scaled to 32 bits. leave a margin of a few 16 bit depth steps for rounding.
+    const double kDepthScale = 4294967296.0;
+    const double kDepthMargin = 4.0 * 65536.0;
+    double box_min_depth = (double)min_z * kDepthScale - kDepthMargin;
+    double box_max_depth = (double)max_z * kDepthScale + kDepthMargin;
+
+    // entirely in front of all occluders in the area
+    if (box_max_depth < (double)occluder_min_depth)
+    {
+        return 0;
+    }
+
+    return box_min_depth > (double)occluder_max_depth;
+}
+
+// Rectangle of the pixels of fb that a box can cover, grown to whole tiles so that it's exactly what a tile scissor redraws.
+// The whole framebuffer if the box crosses the near plane. Returns 0 if the box is off screen.
+static int32_t get_bbox_tile_rect(const renderer_t* rd, const int32_t* viewproj, const int32_t* bbox_min, const int32_t* bbox_max, framebuffer_rect_t* rect)
+{
+    float ndc_min[3], ndc_max[3];
+    if (!project_bbox(viewproj, bbox_min, bbox_max, ndc_min, ndc_max))
+    {
+        rect->x = 0;
+        rect->y = 0;
+        rect->width = rd->fbwidth;
+        rect->height = rd->fbheight;
+        return 1;
+    }
+
+    // window y goes down. a pixel of margin for the rounding of the vertices.
+    int32_t x0 = (int32_t)floorf((ndc_min[0] + 1.0f) * 0.5f * rd->fbwidth) - 1;
+    int32_t x1 = (int32_t)ceilf((ndc_max[0] + 1.0f) * 0.5f * rd->fbwidth) + 1;
+    int32_t y0 = (int32_t)floorf((1.0f - ndc_max[1]) * 0.5f * rd->fbheight) - 1;
+    int32_t y1 = (int32_t)ceilf((1.0f - ndc_min[1]) * 0.5f * rd->fbheight) + 1;
+    x0 = x0 < 0 ? 0 : x0 / rd->tile_width * rd->tile_width;
+    y0 = y0 < 0 ? 0 : y0 / rd->tile_width * rd->tile_width;
+    x1 = x1 > rd->fbwidth ? rd->fbwidth : x1;
+    y1 = y1 > rd->fbheight ? rd->fbheight : y1;
+
+    if (x0 >= x1 || y0 >= y1)
+    {
+        return 0;
+    }
+
+    rect->x = x0;
+    rect->y = y0;
+    rect->width = (x1 + rd->tile_width - 1) / rd->tile_width * rd->tile_width - x0;
+    rect->height = (y1 + rd->tile_width - 1) / rd->tile_width * rd->tile_width - y0;
+    return 1;
+}
+
+// whether the instance can cover pixels of the tiles being redrawn
+static int32_t is_instance_damaged(const renderer_t* rd, const scene_t* sc, const instance_t* instance, const int32_t* viewproj, int32_t num_damage_rects, const framebuffer_rect_t* damage_rects)
+{
+    const model_t* model = &sc->models[instance->model_id];
+
+    framebuffer_rect_t rect;
+    if (!get_bbox_tile_rect(rd, viewproj, model->bbox_min, model->bbox_max, &rect))
+    {
+        return 0;
+    }
+
+    for (int32_t rect_i = 0; rect_i < num_damage_rects; rect_i++)
+    {
+        const framebuffer_rect_t* damage = &damage_rects[rect_i];
+        if (rect.x < damage->x + damage->width && damage->x < rect.x + rect.width &&
+            rect.y < damage->y + damage->height && damage->y < rect.y + rect.height)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct visibility_shading_t
+{
+    renderer_t* rd;
+    scene_t* sc;
+    float eye[3];
+} visibility_shading_t;
+
+// Lights the triangle of each pixel with a light at the eye.
+static void shade_visible_pixels(void* userdata, int32_t num_pixels, const int32_t* pixel_xs, const int32_t* pixel_ys, const uint32_t* visibility_ids, uint32_t* colors)
+{
+    const visibility_shading_t* shading = (const visibility_shading_t*)userdata;
+
+    // neighboring pixels usually see the same triangle
+    uint32_t last_visibility_id = VISIBILITY_ID_NONE;
+    uint32_t last_color = 0;
+
+    for (int32_t i = 0; i < num_pixels; i++)
+    {
+        uint32_t visibility_id = visibility_ids[i];
+        if (visibility_id == last_visibility_id)
+        {
+            colors[i] = last_color;
+            continue;
+        }
+
+        const model_t* model = &shading->sc->models[shading->rd->visibility_instance_models[VISIBILITY_ID_INSTANCE(visibility_id)]];
+        const uint32_t* tri = &model->indices[VISIBILITY_ID_PRIMITIVE(visibility_id) * 3];
+
+        float verts[3][3];
+        for (int32_t v = 0; v < 3; v++)
+        {
+            for (int32_t c = 0; c < 3; c++)
+            {
+                verts[v][c] = (float)model->positions[tri[v] * 3 + c] / 65536.0f;
+            }
+        }
+
+        // e1 x e2 points outward with the winding the indices are stored in
+        float e1[3] = { verts[1][0] - verts[0][0], verts[1][1] - verts[0][1], verts[1][2] - verts[0][2] };
+        float e2[3] = { verts[2][0] - verts[0][0], verts[2][1] - verts[0][1], verts[2][2] - verts[0][2] };
+        float normal[3] = {
+            e1[1] * e2[2] - e1[2] * e2[1],
+            e1[2] * e2[0] - e1[0] * e2[2],
+            e1[0] * e2[1] - e1[1] * e2[0]
+        };
+        float normal_sq = normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2];
+
+        float to_eye[3];
+        float to_eye_sq = 0.0f;
+        for (int32_t c = 0; c < 3; c++)
+        {
+            to_eye[c] = shading->eye[c] - (verts[0][c] + verts[1][c] + verts[2][c]) / 3.0f;
+            to_eye_sq += to_eye[c] * to_eye[c];
+        }
+
+        float n_dot_l = normal[0] * to_eye[0] + normal[1] * to_eye[1] + normal[2] * to_eye[2];
+        n_dot_l = normal_sq > 0.0f && to_eye_sq > 0.0f && n_dot_l > 0.0f ? n_dot_l / sqrtf(normal_sq * to_eye_sq) : 0.0f;
+        if (n_dot_l > 1.0f)
+            n_dot_l = 1.0f;
+
+        // small ambient term so that silhouettes stay visible
+        uint32_t intensity = (uint32_t)(0xFF * (0.1f + 0.9f * n_dot_l));
+        last_color = (0xFF << 24) | (intensity << 16) | (intensity << 8) | intensity;
+        last_visibility_id = visibility_id;
+
+        colors[i] = last_color;
+    }
+}
+
+// Renders the scene into rd->fb from the given camera.
+// Only reads the scene (and the debug settings), so several renderers can render the same scene at once.
+// Draws the scene into rd->fb. With damage_rects, only the tiles they cover are cleared and redrawn, with the instances that overlap them.
+static void render_scene_from_camera(renderer_t* rd, scene_t* sc, const int32_t* view, const int32_t* proj, int32_t num_damage_rects, const framebuffer_rect_t* damage_rects)
+{
+    framebuffer_reset_perfcounters(rd->fb);
+    framebuffer_reset_statistics(rd->fb);
+    framebuffer_set_tile_scissor(rd->fb, num_damage_rects, damage_rects);
+    framebuffer_clear(rd->fb, 0x00000000);
+
+    int32_t viewproj[16];
+    s15164x4_mul(proj, view, viewproj);
+
+    // Reversed-Z: the main framebuffer gets z' = w - z, which maps the near plane to 1 and the far plane to 0.
+    // Culling and the occlusion pass keep the projection as given.
+    int32_t fb_viewproj[16];
+    memcpy(fb_viewproj, viewproj, sizeof(fb_viewproj));
+    if (rd->reversed_z)
+    {
+        for (int32_t col = 0; col < 4; col++)
+        {
+            fb_viewproj[col * 4 + 2] = viewproj[col * 4 + 3] - viewproj[col * 4 + 2];
+        }
+    }
+
+    depth_func_t closer_depth_func = rd->reversed_z ? depth_func_greater : depth_func_less;
+
+    cluster_culling_t culling;
+    setup_cluster_culling(&culling, view, viewproj, rd->fbwidth, rd->fbheight);
+
+    if (rd->occlusion_culling)
+    {
+        uint64_t occlusionculling_start_pc = qpc();
+
+        framebuffer_clear(rd->occlusion_fb, 0x00000000);
+
+        // drawing the occluders only counts as occlusion culling, not as the transforms and instances of the frame
+        renderer_perfcounters_t perfcounters = rd->perfcounters;
+
+        for (uint32_t instance_id : *sc->instances)
+        {
+            instance_t* instance = &(*sc->instances)[instance_id];
+            if (instance->is_occluder)
+            {
+                renderer_render_instance(rd, rd->occlusion_fb, sc, instance, 0, viewproj, &culling);
+            }
+        }
+
+        rd->perfcounters.mvptransform = perfcounters.mvptransform;
+        rd->perfcounters.renderinstance = perfcounters.renderinstance;
+
+        framebuffer_resolve(rd->occlusion_fb);
+
+        build_occlusion_pyramid(rd);
+
+        rd->perfcounters.occlusionculling += qpc() - occlusionculling_start_pc;
+    }
+
+    // don't count the occlusion pass
+    memset(&rd->statistics, 0, sizeof(renderer_statistics_t));
+
+    // the triangle filter works on whole instances
+    int32_t draw_clusters = rd->draw_order == draw_order_clusters_front_to_back &&
+        !(g_FilterTriangles && (g_FilterTriangle0 != -1 || g_FilterTriangle1 != -1 || g_FilterTriangle2 != -1));
+
+    rd->num_draws = 0;
+
+    uint32_t instance_index = 0;
+    for (uint32_t instance_id : *sc->instances)
+    {
+        if (g_FilterInstances && (g_FilterInstance0 != -1) &&
+            instance_index != g_FilterInstance0)
+        {
+            goto skipinstance;
+        }
+
+        instance_t* instance = &(*sc->instances)[instance_id];
+
+        // the other tiles keep what the instance drew in them
+        if (damage_rects && !is_instance_damaged(rd, sc, instance, viewproj, num_damage_rects, damage_rects))
+        {
+            goto skipinstance;
+        }
+
+        if (rd->occlusion_culling)
+        {
+            uint64_t occlusionculling_start_pc = qpc();
+            int32_t occluded = is_instance_occluded(rd, sc, instance, viewproj);
+            rd->perfcounters.occlusionculling += qpc() - occlusionculling_start_pc;
+
+            if (occluded)
+            {
+                rd->statistics.instances_occlusion_culled++;
+                goto skipinstance;
+            }
+        }
+
+        rd->statistics.instances_drawn++;
+        rd->visibility_instance_models[instance_index] = instance->model_id;
+
+        if (draw_clusters)
+        {
+            model_t* model = &sc->models[instance->model_id];
+            for (uint32_t cluster_id = 0; cluster_id < model->cluster_count; cluster_id++)
+            {
+                const mesh_cluster_t* cluster = &model->clusters[cluster_id];
+
+                int32_t culled = g_CullClusters ? cull_cluster(&culling, cluster) : 0;
+                if (culled == 1)
+                {
+                    rd->statistics.clusters_frustum_culled++;
+                    continue;
+                }
+                else if (culled == 2)
+                {
+                    rd->statistics.clusters_backface_culled++;
+                    continue;
+                }
+
+                rd->statistics.clusters_drawn++;
+                push_draw(rd, sphere_view_depth(&culling, cluster->bounding_sphere, cluster->bounding_sphere[3]), instance_id, instance_index, cluster_id);
+            }
+        }
+        else
+        {
+            model_t* model = &sc->models[instance->model_id];
+
+            float center[3], radius_sq = 0.0f;
+            for (int32_t k = 0; k < 3; k++)
+            {
+                center[k] = ((float)model->bbox_min[k] + (float)model->bbox_max[k]) / (2 << 16);
+                float extent = ((float)model->bbox_max[k] - (float)model->bbox_min[k]) / (2 << 16);
+                radius_sq += extent * extent;
+            }
+
+            push_draw(rd, sphere_view_depth(&culling, center, sqrtf(radius_sq)), instance_id, instance_index, DRAW_ALL_CLUSTERS);
+        }
+
+    skipinstance:
+        instance_index++;
+    }
+
+    if (rd->draw_order != draw_order_scene)
+    {
+        uint64_t sorting_start_pc = qpc();
+        sort_draws_front_to_back(rd);
+        rd->perfcounters.sorting += qpc() - sorting_start_pc;
+    }
+
+    // With a depth prepass, the draws are first rendered depth-only, then again with an equal depth test.
+    // Only the closest triangle of each pixel passes the second time, so each pixel is shaded once.
+    for (int32_t pass = rd->depth_prepass ? 0 : 1; pass < 2; pass++)
+    {
+        uint64_t depthprepass_start_pc = qpc();
+
+        // the prepass culls the same clusters as the main pass, so they're only counted once
+        renderer_statistics_t statistics = rd->statistics;
+
+        if (rd->depth_prepass)
+        {
+            rd->drawing_depth_prepass = pass == 0;
+            framebuffer_set_depth_func(rd->fb, pass == 0 ? closer_depth_func : depth_func_equal);
+            framebuffer_set_pixel_stage(rd->fb, pass == 0 ? pixel_stage_depth_only : rd->visibility_buffer ? pixel_stage_visibility_id : pixel_stage_barycentric_color);
+        }
+
+        for (uint32_t draw_i = 0; draw_i < rd->num_draws; draw_i++)
+        {
+            const draw_t* draw = &rd->draws[draw_i];
+            instance_t* instance = &(*sc->instances)[draw->instance_id];
+
+            if (draw->cluster_id == DRAW_ALL_CLUSTERS)
+            {
+                renderer_render_instance(rd, rd->fb, sc, instance, draw->visibility_instance_id, fb_viewproj, &culling);
+
+                // pipelined frames are only resolved once they're submitted, in the background
+                if (!rd->pipelining)
+                    framebuffer_resolve(rd->fb);
+            }
+            else
+            {
+                renderer_render_cluster(rd, sc, instance, draw->visibility_instance_id, draw->cluster_id, fb_viewproj);
+            }
+        }
+
+        if (pass == 0)
+        {
+            rd->statistics = statistics;
+            rd->perfcounters.depthprepass += qpc() - depthprepass_start_pc;
+        }
+    }
+
+    if (rd->depth_prepass)
+    {
+        rd->drawing_depth_prepass = 0;
+        framebuffer_set_depth_func(rd->fb, closer_depth_func);
+    }
+
+    if (rd->visibility_buffer)
+    {
+        // the ids have to be there before shading
+        framebuffer_resolve(rd->fb);
+
+        uint64_t shading_start_pc = qpc();
+
+        visibility_shading_t shading;
+        shading.rd = rd;
+        shading.sc = sc;
+        memcpy(shading.eye, culling.eye, sizeof(shading.eye));
+
+        framebuffer_shade(rd->fb, shade_visible_pixels, &shading);
+
+        rd->perfcounters.shading += qpc() - shading_start_pc;
+    }
+
+    // resolves what's left of the frame, in the background if pipelined
+    rd->frame_fence = framebuffer_submit(rd->fb);
+
+    framebuffer_set_tile_scissor(rd->fb, 0, NULL);
+}
+
+// Finds the tiles of rd->fb to redraw, when only some instances changed since the last frame rendered by renderer_render_scene.
+// Returns the number of rectangles written to damage_rects (room for SCENE_MAX_TRACKED_CHANGES), or -1 if everything has to be redrawn.
+static int32_t find_damage_rects(renderer_t* rd, scene_t* sc, framebuffer_rect_t* damage_rects)
+{
+    // pipelined frames start over the pixels of an older frame
+    if (!rd->incremental || !rd->incremental_valid || rd->pipelining || rd->incremental_scene != sc ||
+        memcmp(rd->incremental_view, sc->view, sizeof(sc->view)) != 0 ||
+        memcmp(rd->incremental_proj, sc->proj, sizeof(sc->proj)) != 0 ||
+        sc->num_changes - rd->incremental_num_changes > SCENE_MAX_TRACKED_CHANGES)
+    {
+        return -1;
+    }
+
+    int32_t viewproj[16];
+    s15164x4_mul(sc->proj, sc->view, viewproj);
+
+    // instances are drawn with their model space bounds, so the pixels they covered before and after the change are both in there
+    int32_t num_damage_rects = 0;
+    for (uint64_t change_i = rd->incremental_num_changes; change_i < sc->num_changes; change_i++)
+    {
+        const scene_change_t* change = &sc->changes[change_i % SCENE_MAX_TRACKED_CHANGES];
+        if (get_bbox_tile_rect(rd, viewproj, change->bbox_min, change->bbox_max, &damage_rects[num_damage_rects]))
+        {
+            num_damage_rects++;
+        }
+    }
+
+    return num_damage_rects;
+}
+
+void renderer_render_scene(renderer_t* rd, scene_t* sc)
+{
+    assert(rd);
+    assert(sc);
+
+    // the filters change what's drawn everywhere
+    bool filters_changed = false;
+    if (ImGui::Begin("Renderer"))
+    {
+        filters_changed |= ImGui::Checkbox("Filter triangles", &g_FilterTriangles);
+        filters_changed |= ImGui::SliderInt("Filter Triangle 0", &g_FilterTriangle0, -1, 1000);
+        filters_changed |= ImGui::SliderInt("Filter Triangle 1", &g_FilterTriangle1, -1, 1000);
+        filters_changed |= ImGui::SliderInt("Filter Triangle 2", &g_FilterTriangle2, -1, 1000);
+        
+        filters_changed |= ImGui::Checkbox("Filter instances", &g_FilterInstances);
+        filters_changed |= ImGui::SliderInt("Filter Instance 0", &g_FilterInstance0, -1, (int)sc->instances->size() - 1);
+
+        filters_changed |= ImGui::Checkbox("Cull clusters", &g_CullClusters);
+    }
+    ImGui::End();
+
+    if (filters_changed)
+    {
+        rd->incremental_valid = 0;
+    }
+
+    framebuffer_rect_t damage_rects[SCENE_MAX_TRACKED_CHANGES];
+    int32_t num_damage_rects = find_damage_rects(rd, sc, damage_rects);
+
+    if (num_damage_rects == 0)
+    {
+        // nothing changed, the frame stays as it is
+        memset(&rd->statistics, 0, sizeof(renderer_statistics_t));
+        rd->frame_fence = framebuffer_submit(rd->fb);
+    }
+    else
+    {
+        render_scene_from_camera(rd, sc, sc->view, sc->proj, num_damage_rects, num_damage_rects > 0 ? damage_rects : NULL);
+    }
+
+    rd->incremental_valid = 1;
+    rd->incremental_scene = sc;
+    rd->incremental_num_changes = sc->num_changes;
+    memcpy(rd->incremental_view, sc->view, sizeof(sc->view));
+    memcpy(rd->incremental_proj, sc->proj, sizeof(sc->proj));
+}
+
+void renderer_render_scene_views(renderer_t* rd, scene_t* sc, int32_t num_views, const int32_t* views, const int32_t* projs, framebuffer_t* const* fbs)
+{
+    assert(rd);
+    assert(sc);
+    assert(num_views > 0 && num_views <= RENDERER_MAX_VIEWS);
+    assert(views);
+    assert(projs);
+    assert(fbs);
+
+    int32_t viewprojs[RENDERER_MAX_VIEWS][16];
+    cluster_culling_t cullings[RENDERER_MAX_VIEWS];
+    for (int32_t view = 0; view < num_views; view++)
+    {
+        assert(fbs[view]);
+
+        framebuffer_reset_perfcounters(fbs[view]);
+        framebuffer_reset_statistics(fbs[view]);
+        framebuffer_clear(fbs[view], 0x00000000);
+
+        s15164x4_mul(&projs[view * 16], &views[view * 16], viewprojs[view]);
+        setup_cluster_culling(&cullings[view], &views[view * 16], viewprojs[view], framebuffer_get_width(fbs[view]), framebuffer_get_height(fbs[view]));
+    }
+
+    memset(&rd->statistics, 0, sizeof(renderer_statistics_t));
+
+    uint32_t instance_index = 0;
+    for (uint32_t instance_id : *sc->instances)
+    {
+        instance_t* instance = &(*sc->instances)[instance_id];
+
+        rd->statistics.instances_drawn++;
+        rd->visibility_instance_models[instance_index] = instance->model_id;
+
+        renderer_render_instance_views(rd, num_views, fbs, sc, instance, instance_index, viewprojs, cullings);
+
+        // the tiles of all the views are spread over the same worker threads
+        framebuffer_resolve_many(fbs, num_views);
+
+        instance_index++;
+    }
+}
 
-typedef struct model_t
+typedef struct batch_t
 {
-    int32_t* positions;
-    uint32_t* indices;
+    renderer_t* rd;
+    scene_t* sc;
+    const int32_t* views;
+    const int32_t* projs;
+    pixelformat_t format;
+    uint8_t* images;
+    size_t image_size;
+} batch_t;
+
+static void render_batch_view(void* userdata, int32_t job_id, int32_t thread_id)
+{
+    const batch_t* batch = (const batch_t*)userdata;
+    renderer_t* batch_rd = batch->rd->batch_renderers[thread_id];
 
-    uint32_t vertex_count;
-    uint32_t index_count;
-} model_t;
+    render_scene_from_camera(batch_rd, batch->sc, &batch->views[job_id * 16], &batch->projs[job_id * 16], 0, NULL);
 
-typedef struct instance_t
-{
-    int32_t model_id;
-} instance_t;
+    framebuffer_pack_row_major(
+        batch_rd->fb, attachment_color0, 0, 0, batch_rd->fbwidth, batch_rd->fbheight,
+        batch->format, batch->images + batch->image_size * job_id);
+}
 
-typedef struct scene_t
+void renderer_render_scene_batch(renderer_t* rd, scene_t* sc, int32_t num_views, const int32_t* views, const int32_t* projs, int32_t width, int32_t height, pixelformat_t format, void* images)
 {
-    model_t* models;
-    uint32_t model_count;
+    assert(rd);
+    assert(sc);
+    assert(num_views >= 0);
+    assert(views);
+    assert(projs);
+    assert(width > 0 && height > 0);
+    assert(images);
+
+    int32_t num_threads = rasterizer_get_num_threads();
+    if (num_threads != rd->num_batch_renderers || width != rd->batch_width || height != rd->batch_height)
+    {
+        for (int32_t i = 0; i < rd->num_batch_renderers; i++)
+        {
+            delete_renderer(rd->batch_renderers[i]);
+        }
+        free(rd->batch_renderers);
 
-    freelist_t<instance_t>* instances;
+        rd->batch_renderers = (renderer_t**)malloc(sizeof(renderer_t*) * num_threads);
+        assert(rd->batch_renderers);
+        for (int32_t i = 0; i < num_threads; i++)
+        {
+            rd->batch_renderers[i] = new_renderer(width, height);
+        }
+        rd->num_batch_renderers = num_threads;
+        rd->batch_width = width;
+        rd->batch_height = height;
+    }
 
-    int32_t view[16];
-    int32_t proj[16];
-} scene_t;
+    for (int32_t i = 0; i < rd->num_batch_renderers; i++)
+    {
+        renderer_t* batch_rd = rd->batch_renderers[i];
+        renderer_set_occlusion_culling(batch_rd, rd->occlusion_culling);
+        renderer_set_visibility_buffer(batch_rd, rd->visibility_buffer);
+        renderer_set_reversed_z(batch_rd, rd->reversed_z);
+        renderer_set_tile_width(batch_rd, rd->tile_width);
+        renderer_set_large_pages(batch_rd, rd->large_pages);
+        renderer_set_texturing(batch_rd, rd->texturing);
+        renderer_set_depth_prepass(batch_rd, rd->depth_prepass);
+        renderer_set_draw_order(batch_rd, rd->draw_order);
+    }
 
-typedef struct renderer_perfcounters_t
-{
-    uint64_t renderinstance;
-} renderer_perfcounters_t;
+    batch_t batch;
+    batch.rd = rd;
+    batch.sc = sc;
+    batch.views = views;
+    batch.projs = projs;
+    batch.format = format;
+    batch.images = (uint8_t*)images;
+    batch.image_size = sizeof(uint32_t) * width * height;
+
+    // views are handed out one at a time, so threads that get cheap views just take more of them
+    rasterizer_run_jobs(num_views, render_batch_view, &batch);
+}
 
-const char* kRendererPerfCounterNames[] =  {
-    "renderinstance"
-};
+void renderer_set_occlusion_culling(renderer_t* rd, int32_t enabled)
+{
+    assert(rd);
 
-static_assert(sizeof(kRendererPerfCounterNames) / sizeof(kRendererPerfCounterNames) == sizeof(renderer_perfcounters_t) / sizeof(uint64_t), "Renderer names count");
+    rd->occlusion_culling = enabled;
+    rd->incremental_valid = 0;
+}
 
-typedef struct renderer_t
+void renderer_set_texturing(renderer_t* rd, int32_t enabled)
 {
-    framebuffer_t* fb;
+    assert(rd);
 
-    uint64_t pc_frequency;
-    renderer_perfcounters_t perfcounters;
-} renderer_t;
+    rd->texturing = enabled;
+    rd->incremental_valid = 0;
+}
 
-renderer_t* new_renderer(int32_t fbwidth, int32_t fbheight)
+void renderer_set_depth_prepass(renderer_t* rd, int32_t enabled)
 {
-    renderer_t* rd = (renderer_t*)malloc(sizeof(renderer_t));
     assert(rd);
 
-    rd->fb = new_framebuffer(fbwidth, fbheight);
-    assert(rd->fb);
+    rd->depth_prepass = enabled;
+    rd->incremental_valid = 0;
+}
 
-    rd->pc_frequency = qpf();
-    memset(&rd->perfcounters, 0, sizeof(renderer_perfcounters_t));
+void renderer_set_draw_order(renderer_t* rd, draw_order_t order)
+{
+    assert(rd);
+    assert(order >= draw_order_scene && order <= draw_order_clusters_front_to_back);
 
-    return rd;
+    rd->draw_order = order;
+    rd->incremental_valid = 0;
 }
 
-void delete_renderer(renderer_t* rd)
+// the pixel output and depth range of a framebuffer are fixed when it's created
+static void recreate_framebuffer(renderer_t* rd)
 {
-    if (!rd)
-        return;
+    uint32_t flags = 0;
+    if (rd->visibility_buffer)
+        flags |= framebuffer_flag_visibility_buffer;
+    if (rd->reversed_z)
+        flags |= framebuffer_flag_reversed_z;
+    if (rd->pipelining)
+        flags |= framebuffer_flag_pipelined;
+    if (rd->tile_width == 32)
+        flags |= framebuffer_flag_tile_width_32;
+    else if (rd->tile_width == 128)
+        flags |= framebuffer_flag_tile_width_128;
+    if (rd->large_pages)
+        flags |= framebuffer_flag_large_pages;
 
     delete_framebuffer(rd->fb);
-    free(rd);
+    rd->fb = new_framebuffer_with_flags(rd->fbwidth, rd->fbheight, flags);
+    assert(rd->fb);
+    rd->frame_fence = 0;
+    rd->incremental_valid = 0;
 }
 
-static void s15164x4_mul(const int32_t* a, const int32_t* b, int32_t* dst)
+void renderer_set_visibility_buffer(renderer_t* rd, int32_t enabled)
 {
-    dst[0]  = s1516_fma(a[0],  b[0], s1516_fma(a[4],  b[1], s1516_fma( a[8],  b[2], s1516_mul(a[12],  b[3]))));
-    dst[1]  = s1516_fma(a[1],  b[0], s1516_fma(a[5],  b[1], s1516_fma( a[9],  b[2], s1516_mul(a[13],  b[3]))));
-    dst[2]  = s1516_fma(a[2],  b[0], s1516_fma(a[6],  b[1], s1516_fma(a[10],  b[2], s1516_mul(a[14],  b[3]))));
-    dst[3]  = s1516_fma(a[3],  b[0], s1516_fma(a[7],  b[1], s1516_fma(a[11],  b[2], s1516_mul(a[15],  b[3]))));
-    dst[4]  = s1516_fma(a[0],  b[4], s1516_fma(a[4],  b[5], s1516_fma( a[8],  b[6], s1516_mul(a[12],  b[7]))));
-    dst[5]  = s1516_fma(a[1],  b[4], s1516_fma(a[5],  b[5], s1516_fma( a[9],  b[6], s1516_mul(a[13],  b[7]))));
-    dst[6]  = s1516_fma(a[2],  b[4], s1516_fma(a[6],  b[5], s1516_fma(a[10],  b[6], s1516_mul(a[14],  b[7]))));
-    dst[7]  = s1516_fma(a[3],  b[4], s1516_fma(a[7],  b[5], s1516_fma(a[11],  b[6], s1516_mul(a[15],  b[7]))));
-    dst[8]  = s1516_fma(a[0],  b[8], s1516_fma(a[4],  b[9], s1516_fma( a[8], b[10], s1516_mul(a[12], b[11]))));
-    dst[9]  = s1516_fma(a[1],  b[8], s1516_fma(a[5],  b[9], s1516_fma( a[9], b[10], s1516_mul(a[13], b[11]))));
-    dst[10] = s1516_fma(a[2],  b[8], s1516_fma(a[6],  b[9], s1516_fma(a[10], b[10], s1516_mul(a[14], b[11]))));
-    dst[11] = s1516_fma(a[3],  b[8], s1516_fma(a[7],  b[9], s1516_fma(a[11], b[10], s1516_mul(a[15], b[11]))));
-    dst[12] = s1516_fma(a[0], b[12], s1516_fma(a[4], b[13], s1516_fma( a[8], b[14], s1516_mul(a[12], b[15]))));
-    dst[13] = s1516_fma(a[1], b[12], s1516_fma(a[5], b[13], s1516_fma( a[9], b[14], s1516_mul(a[13], b[15]))));
-    dst[14] = s1516_fma(a[2], b[12], s1516_fma(a[6], b[13], s1516_fma(a[10], b[14], s1516_mul(a[14], b[15]))));
-    dst[15] = s1516_fma(a[3], b[12], s1516_fma(a[7], b[13], s1516_fma(a[11], b[14], s1516_mul(a[15], b[15]))));
-}
+    assert(rd);
 
-static bool g_FilterTriangles = false;
-static int g_FilterTriangle0 = -1;
-static int g_FilterTriangle1 = -1;
-static int g_FilterTriangle2 = -1;
+    if (!enabled == !rd->visibility_buffer)
+    {
+        return;
+    }
 
-static bool g_FilterInstances = false;
-static int g_FilterInstance0 = -1;
+    rd->visibility_buffer = enabled;
+    recreate_framebuffer(rd);
+}
 
-static void renderer_render_instance(renderer_t* rd, scene_t* sc, instance_t* instance, int32_t* viewproj)
+void renderer_set_reversed_z(renderer_t* rd, int32_t enabled)
 {
-    int32_t model_id = instance->model_id;
-    model_t* model = &sc->models[model_id];
-
-    uint64_t renderinstance_start_pc = qpc();
+    assert(rd);
 
-    for (uint32_t index_id = 0; index_id < model->index_count; index_id += 3)
+    if (!enabled == !rd->reversed_z)
     {
-        if (g_FilterTriangles && (g_FilterTriangle0 != -1 || g_FilterTriangle1 != -1 || g_FilterTriangle2 != -1) &&
-            index_id / 3 != g_FilterTriangle0 && index_id / 3 != g_FilterTriangle1 && index_id / 3 != g_FilterTriangle2)
-        {
-            continue;
-        }
-
-        int32_t xverts[3][4];
-
-        // TODO: cache transformations based on vertex_id
+        return;
+    }
 
-        for (uint32_t index_off = 0; index_off < 3; index_off++)
-        {
-            uint32_t vertex_id = model->indices[index_id + index_off];
-            int32_t vert[3];
-            vert[0] = model->positions[vertex_id * 3 + 0];
-            vert[1] = model->positions[vertex_id * 3 + 1];
-            vert[2] = model->positions[vertex_id * 3 + 2];
+    rd->reversed_z = enabled;
+    recreate_framebuffer(rd);
+}
 
-            // TODO: incorporate modelworld matrix
-            xverts[index_off][0] = s1516_fma(viewproj[0], vert[0], s1516_fma(viewproj[4], vert[1], s1516_fma(viewproj[8], vert[2],  viewproj[12])));
-            xverts[index_off][1] = s1516_fma(viewproj[1], vert[0], s1516_fma(viewproj[5], vert[1], s1516_fma(viewproj[9], vert[2],  viewproj[13])));
-            xverts[index_off][2] = s1516_fma(viewproj[2], vert[0], s1516_fma(viewproj[6], vert[1], s1516_fma(viewproj[10], vert[2], viewproj[14])));
-            xverts[index_off][3] = s1516_fma(viewproj[3], vert[0], s1516_fma(viewproj[7], vert[1], s1516_fma(viewproj[11], vert[2], viewproj[15])));
-        }
+void renderer_set_pipelining(renderer_t* rd, int32_t enabled)
+{
+    assert(rd);
 
-        // TODO: buffer up more triangles to draw
-        framebuffer_draw(rd->fb, &xverts[0][0], 3);
+    if (!enabled == !rd->pipelining)
+    {
+        return;
     }
 
-    rd->perfcounters.renderinstance += qpc() - renderinstance_start_pc;
+    rd->pipelining = enabled;
+    recreate_framebuffer(rd);
 }
 
-void renderer_render_scene(renderer_t* rd, scene_t* sc)
+void renderer_set_tile_width(renderer_t* rd, int32_t width)
 {
     assert(rd);
-    assert(sc);
+    assert(width == 32 || width == 64 || width == 128);
 
-    if (ImGui::Begin("Renderer"))
+    if (width == rd->tile_width)
     {
-        ImGui::Checkbox("Filter triangles", &g_FilterTriangles);
-        ImGui::SliderInt("Filter Triangle 0", &g_FilterTriangle0, -1, 1000);
-        ImGui::SliderInt("Filter Triangle 1", &g_FilterTriangle1, -1, 1000);
-        ImGui::SliderInt("Filter Triangle 2", &g_FilterTriangle2, -1, 1000);
-        
-        ImGui::Checkbox("Filter instances", &g_FilterInstances);
-        ImGui::SliderInt("Filter Instance 0", &g_FilterInstance0, -1, (int)sc->instances->size() - 1);
+        return;
     }
-    ImGui::End();
 
-    framebuffer_reset_perfcounters(rd->fb);
-    framebuffer_clear(rd->fb, 0x00000000);
+    rd->tile_width = width;
+    recreate_framebuffer(rd);
+}
 
-    int32_t viewproj[16];
-    s15164x4_mul(sc->proj, sc->view, viewproj);
+void renderer_set_large_pages(renderer_t* rd, int32_t enabled)
+{
+    assert(rd);
 
-    uint32_t instance_index = 0;
-    for (uint32_t instance_id : *sc->instances)
+    if (!enabled == !rd->large_pages)
     {
-        if (g_FilterInstances && (g_FilterInstance0 != -1) &&
-            instance_index != g_FilterInstance0)
-        {
-            goto skipinstance;
-        }
+        return;
+    }
 
-        instance_t* instance = &(*sc->instances)[instance_id];
-        renderer_render_instance(rd, sc, instance, viewproj);
-        framebuffer_resolve(rd->fb);
+    rd->large_pages = enabled;
+    recreate_framebuffer(rd);
+}
 
-    skipinstance:
-        instance_index++;
-    }
+void renderer_set_incremental(renderer_t* rd, int32_t enabled)
+{
+    assert(rd);
+
+    rd->incremental = enabled;
+}
 
-    framebuffer_resolve(rd->fb);
+uint64_t renderer_get_frame_fence(renderer_t* rd)
+{
+    assert(rd);
+    return rd->frame_fence;
 }
 
 framebuffer_t* renderer_get_framebuffer(renderer_t* rd)
@@ -262,6 +1958,29 @@ void renderer_get_perfcounter_names(renderer_t* rd, const char** names)
     memcpy(names, kRendererPerfCounterNames, sizeof(kRendererPerfCounterNames));
 }
 
+int32_t renderer_get_num_statistics(renderer_t* rd)
+{
+    assert(rd);
+
+    return sizeof(rd->statistics) / sizeof(uint64_t);
+}
+
+void renderer_get_statistics(renderer_t* rd, uint64_t* stats)
+{
+    assert(rd);
+    assert(stats);
+
+    memcpy(stats, &rd->statistics, sizeof(rd->statistics));
+}
+
+void renderer_get_statistic_names(renderer_t* rd, const char** names)
+{
+    assert(rd);
+    assert(names);
+
+    memcpy(names, kRendererStatisticNames, sizeof(kRendererStatisticNames));
+}
+
 scene_t* new_scene()
 {
     scene_t* sc = (scene_t*)malloc(sizeof(scene_t));
@@ -272,8 +1991,17 @@ scene_t* new_scene()
 
     sc->model_count = 0;
 
+    sc->textures = (texture_t**)malloc(sizeof(texture_t*) * SCENE_MAX_NUM_TEXTURES);
+    assert(sc->textures);
+
+    sc->texture_count = 0;
+
+    sc->optimize_meshes = 1;
+
     sc->instances = new freelist_t<instance_t>(SCENE_MAX_NUM_INSTANCES);
     assert(sc->instances);
+
+    sc->num_changes = 0;
     
     return sc;
 }
@@ -286,12 +2014,69 @@ void delete_scene(scene_t* sc)
     {
         free(sc->models[i].positions);
         free(sc->models[i].indices);
+        free(sc->models[i].texcoords);
+        free(sc->models[i].clusters);
     }
     free(sc->models);
 
+    for (uint32_t i = 0; i < sc->texture_count; i++)
+    {
+        delete_texture(sc->textures[i]);
+    }
+    free(sc->textures);
+
     free(sc);
 }
 
+// Loads a texture relative to the folder of the material file. Returns its id, or -1 if it couldn't be loaded.
+static int32_t scene_load_texture(scene_t* sc, const char* mtl_basepath, const char* texname)
+{
+    // material files often come from Windows
+    std::string path = std::string(mtl_basepath ? mtl_basepath : "") + texname;
+    for (char& c : path)
+    {
+        if (c == '\\')
+            c = '/';
+    }
+
+    size_t dot = path.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    for (char& c : extension)
+    {
+        c = (char)tolower(c);
+    }
+
+    if (extension != "tga")
+    {
+        fprintf(stderr, "Skipping texture %s: only TGA files are supported\n", path.c_str());
+        return -1;
+    }
+
+    int32_t width, height;
+    uint32_t* pixels = load_tga(path.c_str(), &width, &height);
+    if (!pixels)
+    {
+        return -1;
+    }
+
+    if ((width & (width - 1)) != 0 || (height & (height - 1)) != 0)
+    {
+        fprintf(stderr, "Skipping texture %s: the size (%dx%d) must be a power of two\n", path.c_str(), width, height);
+        free(pixels);
+        return -1;
+    }
+
+    assert(sc->texture_count + 1 <= SCENE_MAX_NUM_TEXTURES);
+
+    int32_t texture_id = (int32_t)sc->texture_count;
+    sc->textures[texture_id] = new_texture(width, height, pixels);
+    sc->texture_count++;
+
+    free(pixels);
+
+    return texture_id;
+}
+
 int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_basepath, uint32_t* first_model_id, uint32_t* num_added_models)
 {
     assert(sc);
@@ -310,6 +2095,10 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
     uint32_t tmp_first_model_id = sc->model_count;
     uint32_t tmp_num_added_models = 0;
 
+    // materials' diffuse textures are loaded when a model first uses them
+    const int32_t kTextureNotLoaded = -2;
+    std::vector<int32_t> material_texture_ids(materials.size(), kTextureNotLoaded);
+
     for (size_t shapeIdx = 0; shapeIdx < shapes.size(); shapeIdx++)
     {
         tinyobj::shape_t& tobj_sh = shapes[shapeIdx];
@@ -329,6 +2118,9 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
         mdl->vertex_count = (uint32_t)(tobj_m.positions.size() / 3);
         mdl->index_count = (uint32_t)tobj_m.indices.size();
 
+        // visibility ids only have room for this many primitives per instance
+        assert(mdl->index_count / 3 <= (1u << VISIBILITY_PRIMITIVE_ID_BITS));
+
         sc->model_count++;
 
         for (size_t i = 0; i < tobj_m.positions.size(); i++)
@@ -344,6 +2136,86 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
             mdl->indices[i + 1] = tobj_m.indices[i + 2];
             mdl->indices[i + 2] = tobj_m.indices[i + 1];
         }
+
+        // texcoords are only usable if every vertex has one
+        mdl->texcoords = NULL;
+        if (tobj_m.texcoords.size() == mdl->vertex_count * 2)
+        {
+            mdl->texcoords = (float*)malloc(sizeof(float) * tobj_m.texcoords.size());
+            assert(mdl->texcoords);
+
+            for (size_t i = 0; i < tobj_m.texcoords.size(); i += 2)
+            {
+                // OBJ has t going up the image
+                mdl->texcoords[i + 0] = tobj_m.texcoords[i + 0];
+                mdl->texcoords[i + 1] = 1.0f - tobj_m.texcoords[i + 1];
+            }
+        }
+
+        mdl->texture_id = -1;
+        int32_t material_id = tobj_m.material_ids.empty() ? -1 : tobj_m.material_ids[0];
+        if (mdl->texcoords && material_id >= 0 && material_id < (int32_t)materials.size() && !materials[material_id].diffuse_texname.empty())
+        {
+            if (material_texture_ids[material_id] == kTextureNotLoaded)
+            {
+                material_texture_ids[material_id] = scene_load_texture(sc, mtl_basepath, materials[material_id].diffuse_texname.c_str());
+            }
+
+            mdl->texture_id = material_texture_ids[material_id];
+        }
+
+        mdl->statistics.acmr_before = analyze_acmr(mdl->indices, mdl->index_count, mdl->vertex_count, MODEL_STATISTICS_CACHE_SIZE);
+        mdl->statistics.overdraw_before = analyze_overdraw(mdl->indices, mdl->index_count, mdl->positions, mdl->vertex_count);
+
+        if (sc->optimize_meshes)
+        {
+            // triangle order first, since the overdraw pass only shuffles around clusters made of vertex cache friendly runs.
+            // vertex order last, since it depends on the final triangle order.
+            optimize_vertex_cache(mdl->indices, mdl->index_count, mdl->vertex_count);
+            optimize_overdraw(mdl->indices, mdl->index_count, mdl->positions, mdl->vertex_count, MESH_OPTIMIZATION_OVERDRAW_THRESHOLD);
+            mdl->vertex_count = optimize_vertex_fetch(mdl->positions, mdl->texcoords, mdl->indices, mdl->index_count, mdl->vertex_count);
+
+            mdl->statistics.acmr_after = analyze_acmr(mdl->indices, mdl->index_count, mdl->vertex_count, MODEL_STATISTICS_CACHE_SIZE);
+            mdl->statistics.overdraw_after = analyze_overdraw(mdl->indices, mdl->index_count, mdl->positions, mdl->vertex_count);
+        }
+        else
+        {
+            mdl->statistics.acmr_after = mdl->statistics.acmr_before;
+            mdl->statistics.overdraw_after = mdl->statistics.overdraw_before;
+        }
+
+        int32_t* clustered_positions;
+        float* clustered_texcoords = NULL;
+        uint32_t* clustered_indices;
+        uint32_t clustered_vertex_count;
+        mdl->cluster_count = build_mesh_clusters(
+            mdl->positions, mdl->texcoords, mdl->indices, mdl->index_count, mdl->vertex_count,
+            &clustered_positions, &clustered_texcoords, &clustered_indices, &clustered_vertex_count,
+            &mdl->clusters);
+
+        free(mdl->positions);
+        free(mdl->texcoords);
+        free(mdl->indices);
+        mdl->positions = clustered_positions;
+        mdl->texcoords = clustered_texcoords;
+        mdl->indices = clustered_indices;
+        mdl->vertex_count = clustered_vertex_count;
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            mdl->bbox_min[k] = mdl->vertex_count > 0 ? INT32_MAX : 0;
+            mdl->bbox_max[k] = mdl->vertex_count > 0 ? INT32_MIN : 0;
+        }
+
+        for (uint32_t v = 0; v < mdl->vertex_count; v++)
+        {
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                int32_t coord = mdl->positions[v * 3 + k];
+                mdl->bbox_min[k] = coord < mdl->bbox_min[k] ? coord : mdl->bbox_min[k];
+                mdl->bbox_max[k] = coord > mdl->bbox_max[k] ? coord : mdl->bbox_max[k];
+            }
+        }
     }
 
     if (first_model_id)
@@ -355,6 +2227,17 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
     return 1;
 }
 
+// remembers the bounds of an instance that changed, so incremental renderers redraw what's around it
+static void scene_track_change(scene_t* sc, const instance_t* instance)
+{
+    const model_t* model = &sc->models[instance->model_id];
+
+    scene_change_t* change = &sc->changes[sc->num_changes % SCENE_MAX_TRACKED_CHANGES];
+    memcpy(change->bbox_min, model->bbox_min, sizeof(change->bbox_min));
+    memcpy(change->bbox_max, model->bbox_max, sizeof(change->bbox_max));
+    sc->num_changes++;
+}
+
 void scene_add_instance(scene_t* sc, uint32_t model_id, uint32_t* instance_id)
 {
     assert(sc);
@@ -364,6 +2247,9 @@ void scene_add_instance(scene_t* sc, uint32_t model_id, uint32_t* instance_id)
 
     instance_t* instance = &(*sc->instances)[tmp_instance_id];
     instance->model_id = model_id;
+    instance->is_occluder = 0;
+
+    scene_track_change(sc, instance);
 
     if (instance_id)
         *instance_id = tmp_instance_id;
@@ -373,9 +2259,35 @@ void scene_remove_instance(scene_t* sc, uint32_t instance_id)
 {
     assert(sc);
 
+    scene_track_change(sc, &(*sc->instances)[instance_id]);
+
     sc->instances->erase(instance_id);
 }
 
+void scene_set_instance_occluder(scene_t* sc, uint32_t instance_id, int32_t is_occluder)
+{
+    assert(sc);
+
+    instance_t* instance = &(*sc->instances)[instance_id];
+
+    // occluders hide other instances behind them
+    if (!instance->is_occluder != !is_occluder)
+    {
+        scene_track_change(sc, instance);
+    }
+
+    instance->is_occluder = is_occluder;
+}
+
+void scene_get_model_bounds(scene_t* sc, uint32_t model_id, int32_t bbox_min[3], int32_t bbox_max[3])
+{
+    assert(sc);
+    assert(model_id < sc->model_count);
+
+    memcpy(bbox_min, sc->models[model_id].bbox_min, sizeof(int32_t) * 3);
+    memcpy(bbox_max, sc->models[model_id].bbox_max, sizeof(int32_t) * 3);
+}
+
 void scene_set_view(scene_t* sc, int32_t view[16])
 {
     memcpy(sc->view, view, sizeof(int32_t) * 16);
@@ -384,4 +2296,35 @@ void scene_set_view(scene_t* sc, int32_t view[16])
 void scene_set_projection(scene_t* sc, int32_t proj[16])
 {
     memcpy(sc->proj, proj, sizeof(int32_t) * 16);
+}
+
+void scene_set_optimize_meshes(scene_t* sc, int32_t enabled)
+{
+    assert(sc);
+
+    sc->optimize_meshes = enabled;
+}
+
+int32_t scene_get_num_model_statistics(scene_t* sc)
+{
+    assert(sc);
+
+    return sizeof(model_statistics_t) / sizeof(float);
+}
+
+void scene_get_model_statistics(scene_t* sc, uint32_t model_id, float* stats)
+{
+    assert(sc);
+    assert(model_id < sc->model_count);
+    assert(stats);
+
+    memcpy(stats, &sc->models[model_id].statistics, sizeof(model_statistics_t));
+}
+
+void scene_get_model_statistic_names(scene_t* sc, const char** names)
+{
+    assert(sc);
+    assert(names);
+
+    memcpy(names, kModelStatisticNames, sizeof(kModelStatisticNames));
 }
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include <rasterizer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+// Replays a frame captured with framebuffer_begin_capture (see the viewer's "Capture frame" button) over and over,
+// to time the rasterization of real frames without the rest of the renderer.
+// Usage: replay <capture file> [iterations] [threads]
+//     threads is "all" (the default) to resolve on the worker threads like the renderer does, or "1" to resolve on the main thread only.
+// Prints the time of each part of the frame over the iterations, and the time spent in each kernel if the rasterizer counts it
+// (ENABLE_PERFCOUNTERS in rasterizer.cpp).
+
+static double now_in_ms()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+static void print_timings(const char* name, std::vector<double> timings_ms)
+{
+    std::sort(begin(timings_ms), end(timings_ms));
+
+    double total = 0.0;
+    for (double t : timings_ms)
+    {
+        total += t;
+    }
+
+    printf("%-20s min %8.3f ms, median %8.3f ms, average %8.3f ms, max %8.3f ms\n",
+        name, timings_ms.front(), timings_ms[timings_ms.size() / 2], total / timings_ms.size(), timings_ms.back());
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <capture file> [iterations] [threads: all or 1]\n", argv[0]);
+        return 1;
+    }
+
+    const char* capture_filename = argv[1];
+    int32_t num_iterations = argc > 2 ? atoi(argv[2]) : 100;
+    bool single_threaded = argc > 3 && strcmp(argv[3], "1") == 0;
+
+    if (num_iterations <= 0)
+    {
+        fprintf(stderr, "The number of iterations must be positive\n");
+        return 1;
+    }
+
+    // textures can't be captured, so textured draws sample a checkerboard of the same size as a typical material's texture
+    const int32_t kTextureWidth = 512;
+    std::vector<uint32_t> texels(kTextureWidth * kTextureWidth);
+    for (int32_t y = 0; y < kTextureWidth; y++)
+    {
+        for (int32_t x = 0; x < kTextureWidth; x++)
+        {
+            texels[y * kTextureWidth + x] = ((x / 32) ^ (y / 32)) & 1 ? 0xFFC0C0C0 : 0xFF404040;
+        }
+    }
+    texture_t* tex = new_texture(kTextureWidth, kTextureWidth, texels.data());
+
+    command_list_t* cl = load_command_list(capture_filename, tex);
+    if (!cl)
+    {
+        delete_texture(tex);
+        return 1;
+    }
+
+    int32_t width, height;
+    uint32_t flags;
+    command_list_get_framebuffer_info(cl, &width, &height, &flags);
+
+    framebuffer_t* fb = new_framebuffer_with_flags(width, height, flags);
+
+    printf("%s: %dx%d, tiles of %dx%d, %d iterations on %d thread(s)\n",
+        capture_filename, width, height, framebuffer_get_tile_width(fb), framebuffer_get_tile_width(fb),
+        num_iterations, single_threaded ? 1 : rasterizer_get_num_threads());
+
+    int32_t num_tile_pcs = framebuffer_get_num_tile_perfcounters(fb);
+    int32_t total_num_tiles = framebuffer_get_total_num_tiles(fb);
+    std::vector<const char*> tile_pc_names(num_tile_pcs);
+    framebuffer_get_tile_perfcounter_names(fb, tile_pc_names.data());
+    std::vector<uint64_t> tile_pcs(num_tile_pcs * total_num_tiles);
+
+    // without perfcounters, there's a single one with no name
+    bool has_tile_pcs = num_tile_pcs > 0 && tile_pc_names[0][0] != '\0';
+
+    // in single threaded mode, nothing may run on the worker threads, not even the flushes while the commands are pushed
+    auto run_frame = [&](double* executed_ms)
+    {
+        if (single_threaded)
+            framebuffer_execute_command_list_on_calling_thread(fb, cl);
+        else
+            framebuffer_execute_command_list(fb, cl);
+
+        *executed_ms = now_in_ms();
+
+        if (single_threaded)
+            framebuffer_resolve_on_calling_thread(fb);
+        else
+            framebuffer_resolve(fb);
+    };
+
+    // the first run warms up the caches (and the thread pool, unless single threaded)
+    double warmup_executed_ms;
+    run_frame(&warmup_executed_ms);
+
+    std::vector<double> execute_ms(num_iterations);
+    std::vector<double> resolve_ms(num_iterations);
+    std::vector<double> frame_ms(num_iterations);
+    std::vector<std::vector<double>> kernel_ms(num_tile_pcs, std::vector<double>(num_iterations));
+
+    for (int32_t iteration = 0; iteration < num_iterations; iteration++)
+    {
+        framebuffer_reset_perfcounters(fb);
+
+        // tiles whose command buffers fill up are resolved while the commands are pushed, so the execute time has some rasterization in it
+        double start_ms = now_in_ms();
+        double executed_ms;
+        run_frame(&executed_ms);
+        double end_ms = now_in_ms();
+
+        execute_ms[iteration] = executed_ms - start_ms;
+        resolve_ms[iteration] = end_ms - executed_ms;
+        frame_ms[iteration] = end_ms - start_ms;
+
+        if (has_tile_pcs)
+        {
+            framebuffer_get_tile_perfcounters(fb, tile_pcs.data());
+
+            uint64_t frequency = framebuffer_get_perfcounter_frequency(fb);
+            for (int32_t pc_i = 0; pc_i < num_tile_pcs; pc_i++)
+            {
+                uint64_t total = 0;
+                for (int32_t tile_id = 0; tile_id < total_num_tiles; tile_id++)
+                {
+                    total += tile_pcs[tile_id * num_tile_pcs + pc_i];
+                }
+
+                // summed over the tiles, so that's the time of all the threads together
+                kernel_ms[pc_i][iteration] = (double)total * 1000.0 / frequency;
+            }
+        }
+    }
+
+    print_timings("execute", execute_ms);
+    print_timings("resolve", resolve_ms);
+    print_timings("frame", frame_ms);
+
+    if (has_tile_pcs)
+    {
+        printf("kernels (summed over the threads):\n");
+        for (int32_t pc_i = 0; pc_i < num_tile_pcs; pc_i++)
+        {
+            print_timings(tile_pc_names[pc_i], kernel_ms[pc_i]);
+        }
+    }
+    else
+    {
+        printf("kernels: enable ENABLE_PERFCOUNTERS in rasterizer.cpp to time them\n");
+    }
+
+    delete_framebuffer(fb);
+    delete_command_list(cl);
+    delete_texture(tex);
+
+    return 0;
+}
\ No newline at end of file
@@ -24,11 +24,11 @@
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <thread>
 
 #pragma comment(lib, "OpenGL32.lib")
 #pragma comment(lib, "glu32.lib")
 
-#define TILE_WIDTH_IN_PIXELS 64
 #define COARSE_BLOCK_WIDTH_IN_PIXELS 16
 #define FINE_BLOCK_WIDTH_IN_PIXELS 4
 
@@ -308,10 +308,11 @@ layout(origin_upper_left) in vec4 gl_FragCoord;
 layout(location = 0) uniform int show_tiles;
 layout(location = 1) uniform int show_coarse;
 layout(location = 2) uniform int show_fine;
+layout(location = 3) uniform uint tile_mask;
 out vec4 FragColor;
 void main() {
     uvec2 pos = uvec2(gl_FragCoord.xy);
-    if (((pos.x & 0x3F) == 0 || (pos.y & 0x3F) == 0) && show_tiles != 0)
+    if (((pos.x & tile_mask) == 0 || (pos.y & tile_mask) == 0) && show_tiles != 0)
         FragColor = vec4(1,1,1,0.5);
     else if (((pos.x & 0xF) == 0 || (pos.y & 0xF) == 0) && show_coarse != 0)
          FragColor = vec4(1,0.7,0.7,0.5);
@@ -420,6 +421,18 @@ int main()
     bool show_fine_blocks = false;
     bool show_perfheatmap = false;
 
+    bool optimize_meshes = true;
+    bool occlusion_culling = false;
+    bool visibility_buffer = false;
+    bool texturing = false;
+    bool depth_prepass = false;
+    bool reversed_z = false;
+    bool pipelining = false;
+    bool incremental = false;
+    int tile_size = 1; // 32, 64, 128
+    bool large_pages = false;
+    int draw_order = draw_order_scene;
+
     bool recording_camera = false;
     std::vector<std::array<int32_t, 16>> recorded_camera_views;
     
@@ -470,6 +483,9 @@ int main()
         bool requested_screenshot = false;
         std::string screenshot_filename;
 
+        bool requested_capture = false;
+        std::string capture_filename;
+
         ImGui::SetNextWindowSize(ImVec2(400, 375), ImGuiSetCond_Once);
         if (ImGui::Begin("Toolbox"))
         {
@@ -479,6 +495,79 @@ int main()
             ImGui::Checkbox("Show depth", &show_depth);
             ImGui::Checkbox("Show performance heatmap", &show_perfheatmap);
 
+            if (ImGui::Checkbox("Optimize meshes (applies to models loaded next)", &optimize_meshes))
+            {
+                scene_set_optimize_meshes(sc, optimize_meshes);
+            }
+
+            if (ImGui::Checkbox("Occlusion culling", &occlusion_culling))
+            {
+                renderer_set_occlusion_culling(rd, occlusion_culling);
+            }
+
+            if (ImGui::Checkbox("Visibility buffer", &visibility_buffer))
+            {
+                renderer_set_visibility_buffer(rd, visibility_buffer);
+
+                // the renderer made a new framebuffer
+                fb = renderer_get_framebuffer(rd);
+            }
+
+            if (ImGui::Checkbox("Texturing", &texturing))
+            {
+                renderer_set_texturing(rd, texturing);
+            }
+
+            if (ImGui::Checkbox("Reversed-Z", &reversed_z))
+            {
+                renderer_set_reversed_z(rd, reversed_z);
+
+                // the renderer made a new framebuffer
+                fb = renderer_get_framebuffer(rd);
+            }
+
+            if (ImGui::Checkbox("Depth prepass", &depth_prepass))
+            {
+                renderer_set_depth_prepass(rd, depth_prepass);
+            }
+
+            // shows the previous frame while the workers resolve the current one
+            if (ImGui::Checkbox("Pipelining", &pipelining))
+            {
+                renderer_set_pipelining(rd, pipelining);
+
+                // the renderer made a new framebuffer
+                fb = renderer_get_framebuffer(rd);
+            }
+
+            // while the camera stays still, only redraws around the instances that changed
+            if (ImGui::Checkbox("Incremental rendering", &incremental))
+            {
+                renderer_set_incremental(rd, incremental);
+            }
+
+            if (ImGui::Combo("Tile size", &tile_size, "32x32\0" "64x64\0" "128x128\0"))
+            {
+                renderer_set_tile_width(rd, 32 << tile_size);
+
+                // the renderer made a new framebuffer
+                fb = renderer_get_framebuffer(rd);
+            }
+
+            // needs the "Lock pages in memory" privilege, otherwise the framebuffer stays on regular pages
+            if (ImGui::Checkbox("Large pages", &large_pages))
+            {
+                renderer_set_large_pages(rd, large_pages);
+
+                // the renderer made a new framebuffer
+                fb = renderer_get_framebuffer(rd);
+            }
+
+            if (ImGui::Combo("Draw order", &draw_order, "Scene\0Instances front to back\0Clusters front to back\0"))
+            {
+                renderer_set_draw_order(rd, (draw_order_t)draw_order);
+            }
+
             if (ImGui::Button("Save camera"))
             {
                 std::string camfile = GetSaveFileNameEasy();
@@ -582,6 +671,14 @@ int main()
                 }
             }
 
+            // saves the tile commands of the next frame, to replay them with the replay benchmark
+            ImGui::SameLine();
+            if (ImGui::Button("Capture frame"))
+            {
+                capture_filename = GetSaveFileNameEasy();
+                requested_capture = !capture_filename.empty();
+            }
+
             if (ImGui::ListBox("Model selection", &curr_model_index, all_model_names, num_models))
             {
                 switched_model = true;
@@ -621,6 +718,9 @@ int main()
                 memcpy(cpuname + 32, cpuInfo, sizeof(cpuInfo));
 
                 fprintf(f, "cpu,%s\n", cpuname);
+                fprintf(f, "tile_width,%d\n", framebuffer_get_tile_width(fb));
+                fprintf(f, "threads,%u\n", std::thread::hardware_concurrency());
+                fprintf(f, "large_pages,%d\n", framebuffer_get_large_pages(fb));
 
                 fprintf(f, "\n");
 
@@ -869,11 +969,35 @@ int main()
                 scene_add_models(sc, filename.c_str(), mtl_basepath.c_str(), &loaded_model_first_ids[curr_model_index], &loaded_model_num_ids[curr_model_index]);
             }
 
+            // the biggest models are likely to hide others, so they're used as occluders
+            std::vector<float> model_diagonals;
+            float max_model_diagonal = 0.0f;
+            for (uint32_t model_id = loaded_model_first_ids[curr_model_index]; model_id < loaded_model_first_ids[curr_model_index] + loaded_model_num_ids[curr_model_index]; model_id++)
+            {
+                int32_t bbox_min[3], bbox_max[3];
+                scene_get_model_bounds(sc, model_id, bbox_min, bbox_max);
+
+                float diagonal_sq = 0.0f;
+                for (int i = 0; i < 3; i++)
+                {
+                    float extent = (float)(bbox_max[i] - bbox_min[i]) / 65536.0f;
+                    diagonal_sq += extent * extent;
+                }
+
+                model_diagonals.push_back(sqrtf(diagonal_sq));
+                max_model_diagonal = std::max(max_model_diagonal, model_diagonals.back());
+            }
+
             for (uint32_t model_id = loaded_model_first_ids[curr_model_index]; model_id < loaded_model_first_ids[curr_model_index] + loaded_model_num_ids[curr_model_index]; model_id++)
             {
                 uint32_t new_instance_id;
                 scene_add_instance(sc, model_id, &new_instance_id);
                 curr_instances.push_back(new_instance_id);
+
+                if (model_diagonals[model_id - loaded_model_first_ids[curr_model_index]] >= max_model_diagonal * 0.25f)
+                {
+                    scene_set_instance_occluder(sc, new_instance_id, 1);
+                }
             }
         }
 
@@ -953,9 +1077,35 @@ int main()
         LARGE_INTEGER before_raster, after_raster;
         QueryPerformanceCounter(&before_raster);
         renderer_reset_perfcounters(rd);
+
+        command_list_t* capture = NULL;
+        if (requested_capture)
+        {
+            // an incremental frame would only have the tiles that changed
+            if (incremental)
+            {
+                renderer_set_incremental(rd, 0);
+            }
+
+            capture = new_command_list();
+            framebuffer_begin_capture(renderer_get_framebuffer(rd), capture);
+        }
+
         renderer_render_scene(rd, sc);
         QueryPerformanceCounter(&after_raster);
 
+        if (capture)
+        {
+            framebuffer_end_capture(renderer_get_framebuffer(rd));
+            save_command_list(capture, capture_filename.c_str());
+            delete_command_list(capture);
+
+            if (incremental)
+            {
+                renderer_set_incremental(rd, 1);
+            }
+        }
+
         glClear(GL_COLOR_BUFFER_BIT);
 
         // render rasterization to screen
@@ -966,6 +1116,15 @@ int main()
 
             if (show_depth)
             {
+                // reversed-Z depth buffers are cleared to 0 and closer is larger
+                if (reversed_z)
+                {
+                    for (int32_t i = 0; i < fbwidth * fbheight; i++)
+                    {
+                        d32_pixels[i] = ~d32_pixels[i];
+                    }
+                }
+
                 // map depth values to a visually meaningful range while ignoring the background
                 uint32_t min_depth = -1, max_depth = -1;
                 for (int32_t i = 0; i < fbwidth * fbheight; i++)
@@ -1060,11 +1219,12 @@ int main()
             glEnable(GL_BLEND);
             glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
             glUseProgram(0);
-            for (int32_t tile_y = 0; tile_y < (fbheight + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS; tile_y++)
+            int32_t tile_width = framebuffer_get_tile_width(fb);
+            for (int32_t tile_y = 0; tile_y < (fbheight + tile_width - 1) / tile_width; tile_y++)
             {
-                for (int32_t tile_x = 0; tile_x < (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS; tile_x++)
+                for (int32_t tile_x = 0; tile_x < (fbwidth + tile_width - 1) / tile_width; tile_x++)
                 {
-                    int width_in_tiles = (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS;
+                    int width_in_tiles = (fbwidth + tile_width - 1) / tile_width;
                     int tile_i = tile_y * width_in_tiles + tile_x;
 
                     glMatrixMode(GL_PROJECTION);
@@ -1075,10 +1235,10 @@ int main()
 
                     glColor4d((double)tile_summedticks[tile_i] / perf_max * 0.5, 0.0, 0.0, 0.5);
                     glBegin(GL_QUADS);
-                    glVertex2d(tile_x * TILE_WIDTH_IN_PIXELS, tile_y * TILE_WIDTH_IN_PIXELS);
-                    glVertex2d(tile_x * TILE_WIDTH_IN_PIXELS, (tile_y + 1) * TILE_WIDTH_IN_PIXELS);
-                    glVertex2d((tile_x + 1) * TILE_WIDTH_IN_PIXELS, (tile_y + 1) * TILE_WIDTH_IN_PIXELS);
-                    glVertex2d((tile_x + 1) * TILE_WIDTH_IN_PIXELS, tile_y * TILE_WIDTH_IN_PIXELS);
+                    glVertex2d(tile_x * tile_width, tile_y * tile_width);
+                    glVertex2d(tile_x * tile_width, (tile_y + 1) * tile_width);
+                    glVertex2d((tile_x + 1) * tile_width, (tile_y + 1) * tile_width);
+                    glVertex2d((tile_x + 1) * tile_width, tile_y * tile_width);
                     glEnd();
                 }
             }
@@ -1094,6 +1254,7 @@ int main()
             glUniform1i(0, show_tiles);
             glUniform1i(1, show_coarse_blocks);
             glUniform1i(2, show_fine_blocks);
+            glUniform1ui(3, framebuffer_get_tile_width(fb) - 1);
             glDrawArrays(GL_TRIANGLES, 0, 3);
             glUseProgram(0);
             glBlendFunc(GL_ONE, GL_ZERO);
@@ -1120,14 +1281,15 @@ int main()
             {
                 ImGui::Text("CursorPos: (%d, %d)", cursor.x, cursor.y);
                 
-                int tile_y = cursor.y / TILE_WIDTH_IN_PIXELS;
-                int tile_x = cursor.x / TILE_WIDTH_IN_PIXELS;
-                int width_in_tiles = (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS;
+                int tile_width = framebuffer_get_tile_width(fb);
+                int tile_y = cursor.y / tile_width;
+                int tile_x = cursor.x / tile_width;
+                int width_in_tiles = (fbwidth + tile_width - 1) / tile_width;
                 int tile_i = tile_y * width_in_tiles + tile_x;
                 ImGui::Text("TileID: %d", tile_i);
-                int tile_start = tile_i * TILE_WIDTH_IN_PIXELS * TILE_WIDTH_IN_PIXELS;
-                int swizzled = pdep_u32(cursor.x, 0x55555555 & (TILE_WIDTH_IN_PIXELS * TILE_WIDTH_IN_PIXELS - 1));
-                swizzled |= pdep_u32(cursor.y, 0xAAAAAAAA & (TILE_WIDTH_IN_PIXELS * TILE_WIDTH_IN_PIXELS - 1));
+                int tile_start = tile_i * tile_width * tile_width;
+                int swizzled = pdep_u32(cursor.x, 0x55555555 & (tile_width * tile_width - 1));
+                swizzled |= pdep_u32(cursor.y, 0xAAAAAAAA & (tile_width * tile_width - 1));
                 ImGui::Text("Swizzled pixel: %d + %d = %d", tile_start, swizzled, tile_start + swizzled);
 
                 uint8_t r = rgba8_pixels[(cursor.y * fbwidth + cursor.x) * 4 + 0];
@@ -1184,6 +1346,59 @@ int main()
             LONGLONG raster_time = after_raster.QuadPart - before_raster.QuadPart;
             LONGLONG raster_time_us = raster_time * 1000000 / freq.QuadPart;
             ImGui::Text("Total render time: %u microseconds", raster_time_us);
+
+            if (loaded_model_first_ids[curr_model_index] != -1 && loaded_model_num_ids[curr_model_index] > 0)
+            {
+                // averaged over all the models (shapes) that make up the current selection
+                std::vector<float> model_stats(scene_get_num_model_statistics(sc));
+                std::vector<float> avg_model_stats(model_stats.size(), 0.0f);
+                std::vector<const char*> model_stat_names(model_stats.size());
+                scene_get_model_statistic_names(sc, model_stat_names.data());
+
+                for (uint32_t model_id = loaded_model_first_ids[curr_model_index]; model_id < loaded_model_first_ids[curr_model_index] + loaded_model_num_ids[curr_model_index]; model_id++)
+                {
+                    scene_get_model_statistics(sc, model_id, model_stats.data());
+                    for (size_t i = 0; i < model_stats.size(); i++)
+                    {
+                        avg_model_stats[i] += model_stats[i] / loaded_model_num_ids[curr_model_index];
+                    }
+                }
+
+                for (size_t i = 0; i < model_stats.size(); i++)
+                {
+                    ImGui::Text("Mesh %s: %.3f", model_stat_names[i], avg_model_stats[i]);
+                }
+            }
+
+            {
+                std::vector<uint64_t> renderer_stats(renderer_get_num_statistics(rd));
+                std::vector<const char*> renderer_stat_names(renderer_stats.size());
+                renderer_get_statistics(rd, renderer_stats.data());
+                renderer_get_statistic_names(rd, renderer_stat_names.data());
+
+                for (size_t i = 0; i < renderer_stats.size(); i++)
+                {
+                    ImGui::Text("%s: %llu", renderer_stat_names[i], renderer_stats[i]);
+                }
+            }
+
+            {
+                std::vector<uint64_t> framebuffer_stats(framebuffer_get_num_statistics(fb));
+                std::vector<const char*> framebuffer_stat_names(framebuffer_stats.size());
+                framebuffer_get_statistics(fb, framebuffer_stats.data());
+                framebuffer_get_statistic_names(fb, framebuffer_stat_names.data());
+
+                for (size_t i = 0; i < framebuffer_stats.size(); i++)
+                {
+                    ImGui::Text("%s: %llu", framebuffer_stat_names[i], framebuffer_stats[i]);
+                }
+
+                // depth_tests_passed / depth_tests: the lower, the more hidden fragments the depth test rejected, which drawing front to back increases
+                if (framebuffer_stats[0] > 0)
+                {
+                    ImGui::Text("depth test pass rate: %.3f", (double)framebuffer_stats[1] / framebuffer_stats[0]);
+                }
+            }
         }
         ImGui::End();
 
@@ -1260,9 +1475,10 @@ int main()
                         if (cursorpos.x >= 0 && cursorpos.x < fbwidth &&
                             cursorpos.y >= 0 && cursorpos.y < fbheight)
                         {
-                            int tile_y = cursorpos.y / TILE_WIDTH_IN_PIXELS;
-                            int tile_x = cursorpos.x / TILE_WIDTH_IN_PIXELS;
-                            int width_in_tiles = (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS;
+                            int tile_width = framebuffer_get_tile_width(fb);
+                            int tile_y = cursorpos.y / tile_width;
+                            int tile_x = cursorpos.x / tile_width;
+                            int width_in_tiles = (fbwidth + tile_width - 1) / tile_width;
                             int tile_i = tile_y * width_in_tiles + tile_x;
 
                             ImGui::Text("Tile %d perfcounters:", tile_i);